@@ -78,7 +78,7 @@ compile_and_install() {
     
     # Compile the shell with necessary libraries (e.g., -lm for math if used, -lncurses for better TUI, etc. - based on myshell.c, none needed but good practice)
     # The provided myshell.c only needs standard libs
-    gcc -o "$SHELL_NAME" "$SOURCE_FILE" -O2 -Wall -Wextra
+    gcc -o "$SHELL_NAME" "$SOURCE_FILE" -O2 -Wall -Wextra -pthread
     
     if [[ $? -ne 0 ]]; then
         print_error "Compilation failed!"
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,15 +12,36 @@
 #include <ctype.h>
 #include <sys/time.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdio_ext.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <regex.h>
+#include <poll.h>
 
 #define MAX_INPUT 1024
 #define MAX_ARGS 64
-#define MAX_PIPES 10
 #define MAX_COMPLETIONS 256
 #define MAX_HISTORY 1000
-#define MAX_ALIASES 100
 #define MAX_BOOKMARKS 50
 #define MAX_NOTES 200
+#define SHARED_HISTORY_SLOTS 1024
+#define SHARED_HISTORY_MAGIC 0x4d534831u  // "MSH1"
+#define SPLICE_CHUNK (1 << 20)
+#define COPY_BUFFER_SIZE 65536
+#define CAPTURE_PIPE_SIZE (1 << 20)
+#define FUNCTION_CALL 1000        // find_builtin's answer for a shell function
+#define FUNCTION_MAX_DEPTH 1000
 
 // Terminal settings
 struct termios orig_termios;
@@ -29,14 +51,53 @@ char* history[MAX_HISTORY];
 int history_count = 0;
 int history_index = 0;
 
-// Aliases
+// Shared history ring (optional, enabled with MYSHELL_SHARED_HISTORY=1).
+// Every instance maps the same file under $HOME and appends to a ring of
+// fixed-size slots. Writers claim an entry number with an atomic counter and
+// publish it through a per-slot sequence word, so readers never take a lock.
 typedef struct {
-    char* name;
+    _Atomic uint64_t seq;   // 2n+1 while entry n is being written, 2n+2 once published
+    int32_t pid;            // writer, so an instance can skip its own entries
+    uint32_t len;
+    char text[MAX_INPUT];
+} SharedHistorySlot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    uint32_t reserved;
+    _Atomic uint64_t head;  // number of entries ever published
+    SharedHistorySlot slots[SHARED_HISTORY_SLOTS];
+} SharedHistory;
+
+SharedHistory* shared_history = NULL;
+uint64_t shared_history_seen = 0;
+
+// Aliases, in an open-addressing hash table. The body is scanned once when
+// the alias is defined: its words are kept as offsets, marked where a
+// command name goes, so expanding it never lexes it again.
+typedef struct {
+    int start;
+    int len;
+    int command;     // in command position, where an alias applies
+} AliasWord;
+
+typedef struct {
+    char* name;      // NULL for an empty slot
     char* value;
+    int value_len;
+    AliasWord* words;
+    int word_count;
+    int open;        // the word after the alias is checked as well: the body
+                     // ends in a blank or where a command goes
+    int active;      // being expanded; a use inside itself stays literal
 } Alias;
 
-Alias aliases[MAX_ALIASES];
+Alias* aliases = NULL;
+int alias_cap = 0;
 int alias_count = 0;
+int alias_generation = 0;  // changes whenever an alias is added or changed
 
 // Directory bookmarks
 typedef struct {
@@ -47,13 +108,440 @@ typedef struct {
 Bookmark bookmarks[MAX_BOOKMARKS];
 int bookmark_count = 0;
 
+// Bump allocator for per-command data (input copy, parse tree, argv arrays,
+// expansion results). The command arena is reset after every command; nested
+// runs (source, rc lines) release back to a mark instead.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_RETAIN_LIMIT (1024 * 1024)
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* head;
+    ArenaChunk* current;
+    size_t in_use;           // bytes handed out since the last reset
+    // Counters reported by the memstat builtin
+    unsigned long allocations;
+    unsigned long long bytes_allocated;
+    size_t peak;
+    unsigned long resets;
+    unsigned long chunk_mallocs;
+    size_t reserved;
+} Arena;
+
+typedef struct {
+    ArenaChunk* chunk;
+    size_t used;
+    size_t in_use;
+} ArenaMark;
+
+Arena cmd_arena;
+
+// Lexer tokens. Tokens are slices of the source buffer and are never copied.
+typedef enum {
+    TOK_EOF,
+    TOK_WORD,
+    TOK_NEWLINE,
+    TOK_SEMI,       // ;
+    TOK_AMP,        // &
+    TOK_PIPE,       // |
+    TOK_AND_IF,     // &&
+    TOK_OR_IF,      // ||
+    TOK_LESS,       // <
+    TOK_GREAT,      // >
+    TOK_DGREAT,     // >>
+    TOK_LESSAND,    // <&
+    TOK_GREATAND,   // >&
+    TOK_LESSGREAT,  // <>
+    TOK_DLESS,      // <<
+    TOK_DLESSDASH,  // <<-
+    TOK_TLESS,      // <<<
+    TOK_LPAREN,     // (
+    TOK_RPAREN,     // )
+    TOK_DSEMI       // ;;
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    const char* start;
+    int len;
+    int io_number;  // explicit fd before a redirection operator (2>file), or -1
+} Token;
+
+typedef struct {
+    const char* src;
+    int len;
+    int pos;
+    Token peeked;
+    int has_peeked;
+    int incomplete;  // input ended inside a quote or here-document
+    const char* prev_end;  // end of the last token consumed
+    struct Redirect* heredocs;  // here-documents whose bodies follow the next newline
+    struct Redirect** heredoc_tail;
+} Lexer;
+
+// Parse tree
+typedef struct {
+    const char* start;
+    int len;
+} Word;
+
+typedef struct Redirect {
+    TokenType op;
+    int fd;
+    Word target;
+    struct Redirect* next;
+    // Here-documents: the delimiter with quotes removed and the body as a
+    // slice of the source. A quoted delimiter turns off expansion.
+    char* delimiter;
+    int quoted;
+    const char* body;
+    int body_len;
+    struct Redirect* next_heredoc;
+} Redirect;
+
+typedef enum {
+    NODE_COMMAND,   // simple command: words and redirections
+    NODE_PIPELINE,  // stages joined by |
+    NODE_AND,       // left && right
+    NODE_OR,        // left || right
+    NODE_LIST,      // commands separated by ; or newlines
+    NODE_IF,        // if/elif/else: children are condition, body pairs, then the else body
+    NODE_WHILE,     // while left; do right; done
+    NODE_UNTIL,     // until left; do right; done
+    NODE_FOR,       // for name in words; do left; done
+    NODE_CASE,      // case words[0] in ...: each child is a clause list whose words are its patterns
+    NODE_GROUP,     // { left; }
+    NODE_SUBSHELL,  // ( left ): run in a forked copy of the shell
+    NODE_FUNCTION,  // name() left
+    NODE_COND       // [[ expression ]]: one node per operator, see CondOp
+} NodeType;
+
+// Parts of a [[ ]] expression
+typedef enum {
+    COND_WORD,    // words[0]: true if not empty
+    COND_UNARY,   // words[0] is the operator (-f, -z, ...), words[1] the operand
+    COND_BINARY,  // words[0] operator words[2]; operator is words[1]
+    COND_NOT,     // ! left
+    COND_AND,     // left && right
+    COND_OR       // left || right
+} CondOp;
+
+struct Code;
+
+typedef struct Node {
+    NodeType type;
+    // NODE_COMMAND
+    Word* words;
+    int word_count;
+    int assign_count;  // leading NAME=value words
+    Redirect* redirects;
+    // NODE_PIPELINE (stages) and NODE_LIST (items)
+    struct Node** children;
+    int child_count;
+    int negate;
+    int timed;       // prefixed with the time keyword: a TimeFormat, 0 if not
+    // NODE_AND, NODE_OR
+    struct Node* left;
+    struct Node* right;
+    // NODE_FOR and NODE_FUNCTION
+    Word name;
+    int has_in;      // NODE_FOR: without "in" the loop runs over "$@"
+    CondOp cond_op;  // NODE_COND
+    struct Code* code;  // compound commands: the compiled body, once compiled
+    // Source text, for job listings
+    const char* text;
+    int text_len;
+    int background;  // list item ended with &
+} Node;
+
+// Descriptor setup for a child: moves are applied in order, like the
+// redirections they come from. A source of -1 closes the descriptor.
+typedef struct {
+    int fd;
+    int source;
+} FdMove;
+
+// Output redirected to several files (cmd > a > b): the command writes into a
+// pipe and a helper process copies the pipe to every target
+typedef struct {
+    int source;  // read end of the pipe
+    int* targets;
+    int target_count;
+} Fanout;
+
+typedef struct {
+    FdMove* moves;
+    int count;
+    int cap;
+    int* opened;  // descriptors the shell opened for the child
+    int opened_count;
+    int opened_cap;
+    Fanout* fanouts;
+    int fanout_count;
+    int fanout_cap;
+} IoPlan;
+
+// A <(cmd) or >(cmd) met during expansion. The pipe exists from then on; the
+// command is started once the job of the command using it exists.
+typedef struct {
+    char* command;
+    int output;  // >(cmd): the user writes and cmd reads
+    int fd;      // the user's end, passed as /dev/fd/N
+    int other;   // cmd's end
+} ProcSubst;
+
+typedef enum {
+    PARSE_OK,
+    PARSE_INCOMPLETE,  // more input needed (open quote, trailing | or &&)
+    PARSE_ERROR
+} ParseStatus;
+
+// Report formats of the time keyword: time, time -p, time -j
+typedef enum {
+    TIME_NONE,
+    TIME_TABLE,
+    TIME_POSIX,
+    TIME_JSON
+} TimeFormat;
+
+typedef struct {
+    Lexer lex;
+    ParseStatus status;
+    Arena* arena;  // owns the tree
+} Parser;
+
+// Exit status of the last command, used by && and ||
+int last_status = 0;
+int previous_status = 0;   // the status before the running builtin, for return
+int expand_failed = 0;     // a ${NAME?message} failed: the command must not run
+int pipefail = 0;          // set -o pipefail: a pipeline fails if any stage fails
+int* pipe_status = NULL;   // PIPESTATUS: per-stage statuses of the last pipeline
+int pipe_status_count = 0;
+int pipe_status_cap = 0;
+char** rematch = NULL;     // BASH_REMATCH: the last [[ =~ ]] match and its groups
+int rematch_count = 0;
+
+// Options for set -o / set +o
+typedef struct {
+    char* name;
+    int* flag;
+} ShellOption;
+
+ShellOption shell_options[] = {
+    {"pipefail", &pipefail},
+};
+
+// Shell variables, kept in an open-addressing hash table. The value is stored
+// as a "NAME=value" string so that exported variables can be handed to exec
+// as they are.
+typedef struct {
+    char* name;     // NULL for a slot that was never used
+    char* entry;    // "NAME=value", or NULL while the variable is unset
+    int exported;
+} Var;
+
+// A binding hidden by a scope, restored when the scope ends
+typedef struct {
+    char* name;
+    char* entry;
+    int exported;
+    int depth;
+} VarSave;
+
+Var* vars = NULL;
+int var_cap = 0;
+int var_used = 0;          // slots holding a name, set or not
+char** var_envp = NULL;    // exported variables; environ points here
+int var_envp_cap = 0;
+VarSave* var_saves = NULL;
+int var_save_count = 0;
+int var_save_cap = 0;
+int var_depth = 0;         // current scope, 0 for global
+
+// Positional parameters $1..$N of the running function, and $0
+char** positional = NULL;
+int positional_count = 0;
+char* shell_name = "myshell";
+pid_t shell_pid = 0;       // $$: kept by subshells, as in other shells
+
+// Shell functions. The body is copied out of the command line that defined
+// it and compiled once. A call holds a reference, so a function that
+// redefines itself finishes running its old body.
+typedef struct {
+    Arena arena;     // owns the copied tree and its bytecode
+    Node* node;
+    int refs;
+} FunctionBody;
+
+typedef struct {
+    char* name;
+    FunctionBody* body;
+} Function;
+
+Function* functions = NULL;
+int function_count = 0;
+int function_cap = 0;
+int function_depth = 0;
+
+// Control flow asked for by break, continue and return, carried out by the
+// interpreter running the loop or function it applies to
+int loop_depth = 0;        // loops around the running command
+int pending_break = 0;     // loops still to leave
+int pending_continue = 0;
+int pending_return = 0;
+int source_depth = 0;
+volatile sig_atomic_t interrupted = 0;  // Ctrl+C: abandon loops and lists
+
+// Jobs: a pipeline or command started by the shell, with one process group
+typedef struct {
+    pid_t pid;
+    int status;       // raw wait status
+    int completed;
+    int stopped;
+    int helper;       // a fan-out copier, not a pipeline stage
+    struct rusage usage;
+    struct timespec started;   // CLOCK_MONOTONIC, for time
+    struct timespec finished;
+} Process;
+
+// Measurements for one timed pipeline. The job's processes are copied here
+// when it finishes, before the job is freed.
+typedef struct {
+    TimeFormat format;
+    struct timespec started;
+    Process* procs;
+    int proc_count;
+} TimeCapture;
+
+// Resource usage of the shell and its reaped children at one moment, to
+// measure builtins that run inside the shell
+typedef struct {
+    struct timespec wall;
+    struct rusage self;
+    struct rusage children;
+} UsageMark;
+
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    char* command;
+    Process* procs;
+    int proc_count;
+    int proc_cap;
+    int foreground;
+    int background;
+    int notified;          // stop already reported
+    struct termios tmodes; // terminal modes to restore when resumed
+    TimeCapture* timing;   // where to copy the processes when done, if timed
+    struct Job* next;
+} Job;
+
+#define TERMINAL_FD 255   // lowest descriptor an interactive shell keeps its terminal on
+
+Job* job_list = NULL;
+int job_control = 0;      // interactive on a terminal: process groups and fg/bg
+int interactive = 0;
+int shell_terminal = STDIN_FILENO;  // moved to TERMINAL_FD when interactive
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+pid_t last_background_pid = 0;
+TimeCapture* time_capture = NULL;  // handed from a timed pipeline to the command it runs
+ProcSubst* proc_substs = NULL;     // substitutions expanded but not yet started
+int proc_subst_count = 0;
+int proc_subst_cap = 0;
+int stopped_jobs_warned = 0;
+
+// Launch external commands with posix_spawn; MYSHELL_FORCE_FORK=1 switches
+// back to plain fork+exec for comparison
+int use_posix_spawn = 1;
+
+// Set while probing whether input is complete, to keep syntax errors quiet
+int parse_quiet = 0;
+
 // Function prototypes
 void display_prompt();
 char* read_input_with_completion();
-char** parse_input(char* input);
-int execute_command(char** args);
-int execute_piped_commands(char** args);
-void handle_redirection(char** args);
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strdup(Arena* arena, const char* str);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+ArenaMark arena_mark(Arena* arena);
+void arena_release(Arena* arena, ArenaMark mark);
+void arena_reset(Arena* arena);
+int builtin_memstat(char** args);
+void lexer_init(Lexer* lex, const char* src, int len);
+Token lexer_next(Lexer* lex);
+Token lexer_peek(Lexer* lex);
+Node* parse_program(Parser* p, Arena* arena, const char* src, int len);
+Node* parse_list(Parser* p);
+Node* parse_command(Parser* p);
+char* expand_word(Word* word);
+char** expand_words(Node* cmd);
+int compare_strings(const void* a, const void* b);
+int execute_node(Node* node);
+int execute_command(Node* cmd, int background);
+int execute_simple(Node* cmd, char** args, int background, TimeCapture* timing);
+int execute_piped_commands(Node* pipeline, int background);
+int expand_abort();
+int vm_run_node(Node* node);
+int subshell_run(Node* node);
+int control_pending();
+void function_define(Node* node);
+Function* function_find(const char* name);
+int function_call(char** args);
+void function_unset(const char* name);
+int run_builtin(int builtin, char** args);
+void builtin_check_output(const char* name);
+int open_redirections(Redirect* redirects, IoPlan* plan);
+void apply_io_plan(IoPlan* plan);
+void close_io_plan(IoPlan* plan);
+void apply_pipe_size(int fd);
+int splice_stream(int in, int out);
+int write_all(int fd, const char* buf, size_t len);
+void start_fanouts(IoPlan* plan, Job* job);
+pid_t launch_process(char** args, IoPlan* plan, Job* job);
+pid_t fork_in_job(Job* job);
+char* command_path(const char* name, char* buf, size_t size, struct stat* st);
+int is_own_script(const char* path, struct stat* st);
+void script_run_forked(const char* path, char** args);
+void init_job_control(int want_interactive);
+void notify_jobs();
+int wait_for_job(Job* job);
+int builtin_jobs(char** args);
+int builtin_fg(char** args);
+int builtin_bg(char** args);
+int builtin_wait(char** args);
+int builtin_set(char** args);
+int builtin_tee(char** args);
+int builtin_export(char** args);
+int builtin_unset(char** args);
+int builtin_local(char** args);
+int builtin_return(char** args);
+int builtin_break(char** args);
+int builtin_continue(char** args);
+int builtin_echo(char** args);
+int builtin_printf(char** args);
+int builtin_test(char** args);
+int builtin_true(char** args);
+int builtin_false(char** args);
+int builtin_pwd(char** args);
+int builtin_read(char** args);
+int builtin_enable(char** args);
+int test_is_binary(const char* s);
+int test_is_unary(const char* s);
+int cond_execute(Node* node);
+int job_is_stopped(Job* job);
+int run_builtin_redirected(int builtin, char** args, IoPlan* plan);
+int run_command_line(char* line);
+int parse_needs_more(char* input);
+void var_import_environ();
+char* var_lookup(const char* name);
+int var_assign(const char* name, int len, const char* value, int export);
 int builtin_cd(char** args);
 int builtin_exit(char** args);
 int builtin_help(char** args);
@@ -69,11 +557,21 @@ int builtin_delnote(char** args);
 int builtin_exec(char** args);
 int builtin_source(char** args);
 int builtin_type(char** args);
+int builtin_parallel(char** args);
+int builtin_task(char** args);
+int builtin_tasks(char** args);
 int is_arithmetic_expression(char* str);
 double evaluate_expression(char* expr);
 void load_myshellrc();
 void add_alias(char* name, char* value);
 char* get_alias(char* name);
+void* arena_grow(Arena* arena, void* array, int count, int* cap, size_t elem_size);
+unsigned int var_hash(const char* name, int len);
+void* parse_alloc(Parser* p, size_t size);
+void heredoc_delimiter(Parser* p, Redirect* redir);
+int is_redirect_op(TokenType type);
+int is_assignment(Token tok);
+int token_is(Token tok, const char* word);
 char* expand_aliases(char* input);
 void load_bookmarks();
 void save_bookmarks();
@@ -89,6 +587,9 @@ void disable_raw_mode();
 void add_to_history(char* cmd);
 void save_history_to_file();
 void load_history_from_file();
+void shared_history_init();
+void shared_history_publish(char* cmd);
+int shared_history_sync(int skip_known);
 
 // Built-in command names
 char* builtin_names[] = {
@@ -106,7 +607,33 @@ char* builtin_names[] = {
     "delnote",
     "exec",
     "source",
-    "type"
+    "type",
+    "parallel",
+    "task",
+    "tasks",
+    "memstat",
+    "jobs",
+    "fg",
+    "bg",
+    "wait",
+    "set",
+    "tee",
+    "export",
+    "unset",
+    "local",
+    "return",
+    "break",
+    "continue",
+    "echo",
+    "printf",
+    "test",
+    "[",
+    "true",
+    "false",
+    ":",
+    "pwd",
+    "read",
+    "enable"
 };
 
 // Built-in command functions
@@ -125,9 +652,38 @@ int (*builtin_funcs[])(char**) = {
     &builtin_delnote,
     &builtin_exec,
     &builtin_source,
-    &builtin_type
+    &builtin_type,
+    &builtin_parallel,
+    &builtin_task,
+    &builtin_tasks,
+    &builtin_memstat,
+    &builtin_jobs,
+    &builtin_fg,
+    &builtin_bg,
+    &builtin_wait,
+    &builtin_set,
+    &builtin_tee,
+    &builtin_export,
+    &builtin_unset,
+    &builtin_local,
+    &builtin_return,
+    &builtin_break,
+    &builtin_continue,
+    &builtin_echo,
+    &builtin_printf,
+    &builtin_test,
+    &builtin_test,
+    &builtin_true,
+    &builtin_false,
+    &builtin_true,
+    &builtin_pwd,
+    &builtin_read,
+    &builtin_enable
 };
 
+// Builtins turned off with enable -n, found on PATH instead
+int builtin_disabled[sizeof(builtin_names) / sizeof(char*)];
+
 int num_builtins() {
     return sizeof(builtin_names) / sizeof(char*);
 }
@@ -136,16 +692,37 @@ int num_builtins() {
 int builtin_cd(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: expected argument to \"cd\"\n");
+        last_status = 1;
     } else {
         if (chdir(args[1]) != 0) {
             perror("myshell");
+            last_status = 1;
         }
     }
     return 1;
 }
 
-// Built-in: exit
+// Built-in: exit [n]. The shell exits with status n, or that of the last
+// command.
 int builtin_exit(char** args) {
+    // Stopped jobs would be left behind; warn once before leaving
+    for (Job* job = job_list; job != NULL; job = job->next) {
+        if (job_is_stopped(job) && !stopped_jobs_warned) {
+            fprintf(stderr, "There are stopped jobs.\n");
+            stopped_jobs_warned = 1;
+            return 1;
+        }
+    }
+    last_status = previous_status;
+    if (args[1] != NULL) {
+        char* end;
+        long value = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            fprintf(stderr, "myshell: exit: %s: numeric argument required\n", args[1]);
+            value = 2;
+        }
+        last_status = value & 0xff;
+    }
     return 0;
 }
 
@@ -159,8 +736,9 @@ int builtin_help(char** args) {
     }
     printf("\nFeatures:\n");
     printf("  - Command execution\n");
-    printf("  - Input/Output redirection (< and >)\n");
-    printf("  - Piping (|)\n");
+    printf("  - Input/Output redirection (<, >, >>, 2>, 2>&1)\n");
+    printf("  - Piping (|) and command lists (;, &&, ||)\n");
+    printf("  - Quoting ('...', \"...\") and backslash escapes\n");
     printf("  - Tab completion for commands and files\n");
     printf("  - Command history with UP/DOWN arrows\n");
     printf("  - Arithmetic evaluation (e.g., 2+3, 10*5, 100/4)\n");
@@ -177,8 +755,9 @@ int builtin_help(char** args) {
     printf("  - BACKSPACE: Delete character before cursor\n");
     printf("  - CTRL+D: Exit shell\n");
     printf("\n~/.myshellrc Support:\n");
-    printf("  - alias name='command': Create command alias\n");
+    printf("  - alias name='command': Create command alias (used wherever a command goes)\n");
     printf("  - export VAR=value: Set environment variable\n");
+    printf("  - export MYSHELL_SHARED_HISTORY=1: Share history live across sessions\n");
     printf("  - # comments: Add comments\n");
     printf("\nDirectory Bookmarks:\n");
     printf("  - mark <name>: Bookmark current directory\n");
@@ -192,28 +771,107 @@ int builtin_help(char** args) {
     printf("  - clearnotes: Clear all notes\n");
     printf("\nAdvanced Commands:\n");
     printf("  - exec <cmd>: Replace shell with command\n");
-    printf("  - source <file>: Execute commands from file\n");
+    printf("  - source [-q] <file>: Execute commands from file (-q: no start/end messages)\n");
     printf("  - type <cmd>: Show command type and location\n");
+    printf("  - parallel [-j N] [-k] <cmd> ::: <args>: Run cmd for each argument, N at a time\n");
+    printf("  - parallel --pipe [-j N] [--block size] <cmd>: Split stdin into blocks for copies of cmd\n");
+    printf("  - task <name> [-d task...] [-i file...] [-o file...] -- <cmd>: Declare a task\n");
+    printf("    (quote a command with redirections or pipes as one word: -- 'sort < in > out')\n");
+    printf("  - tasks [-f file] [-j N] [-n] [-B] [task...]: Run the tasks of a Taskfile that are out of date\n");
+    printf("  - memstat: Show per-command memory arena counters\n");
+    printf("  - exit [n]: Leave the shell with status n\n");
+    printf("  - myshell -c 'cmd' / myshell file.sh: Run a command string or script\n");
+    printf("\nJob Control:\n");
+    printf("  - cmd &: Run a command in the background\n");
+    printf("  - jobs: List background and stopped jobs\n");
+    printf("  - fg [%%n]: Bring a job to the foreground\n");
+    printf("  - bg [%%n]: Resume a stopped job in the background\n");
+    printf("  - wait [%%n|pid]: Wait for background jobs to finish\n");
+    printf("  - CTRL+C / CTRL+Z: Interrupt / stop the foreground job\n");
+    printf("\nExit Status:\n");
+    printf("  - $?: Exit status of the last command\n");
+    printf("  - ${PIPESTATUS[@]}: Exit status of every stage of the last pipeline\n");
+    printf("  - set -o pipefail: A pipeline fails if any of its stages fails\n");
+    printf("  - time [-p|-j] pipeline: Report real/user/sys time, max RSS, context\n");
+    printf("    switches and I/O blocks per stage (-p: POSIX format, -j: JSON)\n");
+    printf("\nData Paths:\n");
+    printf("  - cmd > a > b: Send output to several files at once\n");
+    printf("  - tee [-a] [file...]: Copy input to stdout and files\n");
+    printf("  - < file | cmd: Feed a file into a pipeline\n");
+    printf("  - <(cmd) / >(cmd): Use a command's output or input as a file\n");
+    printf("  - cmd <<EOF ... EOF: Here-document (<<'EOF' for literal text, <<- strips tabs)\n");
+    printf("  - cmd <<< word: Here-string, word plus a newline on stdin\n");
+    printf("  - PIPESIZE=1M: Set the size of pipes the shell creates\n");
+    printf("\nVariables:\n");
+    printf("  - NAME=value: Set a shell variable\n");
+    printf("  - NAME=value cmd: Set a variable for one command only\n");
+    printf("  - $NAME, ${NAME}, ${NAME:-default}: Use a variable's value\n");
+    printf("  - ${#NAME}: Length; ${NAME:offset:length}: Substring\n");
+    printf("  - ${NAME#pat} / ${NAME##pat}: Remove shortest / longest matching prefix\n");
+    printf("  - ${NAME%%pat} / ${NAME%%%%pat}: Remove shortest / longest matching suffix\n");
+    printf("  - ${NAME/pat/str} / ${NAME//pat/str}: Replace first / every match\n");
+    printf("  - ${NAME^^} / ${NAME,,}: Upper / lower case (^ and , for the first character)\n");
+    printf("  - ${NAME:?message}: Fail with message if empty or unset; $$: The shell's process id\n");
+    printf("  - $((expr)): Replace with the integer value of an arithmetic expression\n");
+    printf("  - $(cmd) or `cmd`: Replace with the output of cmd\n");
+    printf("  - $(< file): Replace with the contents of file\n");
+    printf("  - export NAME[=value]: Pass a variable to programs\n");
+    printf("  - unset NAME: Remove a variable\n");
+    printf("\nFile Names:\n");
+    printf("  - *, ?, [a-z]: Match file names (*.c, file?.txt, [ab]*)\n");
+    printf("  - **: Match any number of directories (src/**/*.h)\n");
+    printf("  - a{b,c}d, {1..10}, {a..e}: Brace expansion\n");
+    printf("\nControl Flow:\n");
+    printf("  - if cmd; then ...; elif cmd; then ...; else ...; fi\n");
+    printf("  - while cmd; do ...; done / until cmd; do ...; done\n");
+    printf("  - for NAME in words; do ...; done (without in: the arguments)\n");
+    printf("  - case word in pat|pat) ...;; *) ...;; esac\n");
+    printf("  - { cmd; cmd; } > file: Group commands\n");
+    printf("  - ( cmd; cmd ): Run commands in a subshell; cd and variables stay inside\n");
+    printf("  - break [n] / continue [n]: Leave or restart the nth enclosing loop\n");
+    printf("  - name() { ...; }: Define a function; $1..$9, $#, $@ are its arguments\n");
+    printf("  - local NAME[=value] / return [n]: Function variables and exit status\n");
+    printf("  - unset -f name: Remove a function\n");
+    printf("  - [[ expr ]]: Test without word splitting; &&, ||, !, ( ) combine tests\n");
+    printf("  - [[ $s == glob ]] / [[ $s != glob ]]: Match a pattern (quoted parts literally)\n");
+    printf("  - [[ $s =~ regex ]]: Match an extended regex; groups in ${BASH_REMATCH[n]}\n");
+    printf("\nCore Utilities (run inside the shell, no process started):\n");
+    printf("  - echo [-neE] args / printf [-v NAME] format args: Print text\n");
+    printf("  - test expr / [ expr ]: Check files, strings and numbers\n");
+    printf("  - true / false / :: Succeed or fail\n");
+    printf("  - pwd [-L|-P]: Print the current directory\n");
+    printf("  - read [-rs] [-p prompt] [-d c] [-n n] [-u fd] [NAME...]: Read a line\n");
+    printf("  - enable -n name...: Use the program instead of the builtin (enable name undoes it)\n");
     return 1;
 }
 
-// Built-in: alias
+// Built-in: alias [name[=value]...]
 int builtin_alias(char** args) {
     if (args[1] == NULL) {
         // List all aliases
         if (alias_count == 0) {
             printf("No aliases defined.\n");
-        } else {
-            for (int i = 0; i < alias_count; i++) {
-                printf("alias %s='%s'\n", aliases[i].name, aliases[i].value);
-            }
+            return 1;
         }
-    } else {
+        char** names = malloc(alias_count * sizeof(char*));
+        int n = 0;
+        for (int i = 0; i < alias_cap; i++) {
+            if (aliases[i].name) names[n++] = aliases[i].name;
+        }
+        qsort(names, n, sizeof(char*), compare_strings);
+        for (int i = 0; i < n; i++) {
+            printf("alias %s='%s'\n", names[i], get_alias(names[i]));
+        }
+        free(names);
+        return 1;
+    }
+    
+    for (int i = 1; args[i] != NULL; i++) {
         // Parse alias definition: alias name='value' or alias name=value
-        char* equal = strchr(args[1], '=');
+        char* equal = strchr(args[i], '=');
         if (equal) {
             *equal = '\0';
-            char* name = args[1];
+            char* name = args[i];
             char* value = equal + 1;
             
             // Remove quotes if present
@@ -229,179 +887,263 @@ int builtin_alias(char** args) {
             printf("alias %s='%s'\n", name, value);
         } else {
             // Show specific alias
-            char* value = get_alias(args[1]);
+            char* value = get_alias(args[i]);
             if (value) {
-                printf("alias %s='%s'\n", args[1], value);
+                printf("alias %s='%s'\n", args[i], value);
             } else {
-                printf("myshell: alias: %s: not found\n", args[1]);
+                fprintf(stderr, "myshell: alias: %s: not found\n", args[i]);
+                last_status = 1;
             }
         }
     }
     return 1;
 }
 
+// The slot for an alias name: the alias, or the empty slot it would go in
+Alias* alias_slot(const char* name, int len) {
+    unsigned int mask = alias_cap - 1;
+    for (unsigned int i = var_hash(name, len) & mask;; i = (i + 1) & mask) {
+        Alias* a = &aliases[i];
+        if (a->name == NULL || (strncmp(a->name, name, len) == 0 && a->name[len] == '\0')) {
+            return a;
+        }
+    }
+}
+
+Alias* alias_find(const char* name, int len) {
+    if (alias_count == 0) return NULL;
+    Alias* a = alias_slot(name, len);
+    return a->name ? a : NULL;
+}
+
+// Find the words of src and whether each is in command position, the only
+// place an alias is used. Reserved words, case patterns, names after for,
+// case and function, redirection targets and here-document bodies are not.
+// The words are allocated in cmd_arena. *ends_command is set if a command
+// could follow the end of src.
+int alias_scan(const char* src, int len, AliasWord** words, int* ends_command) {
+    Parser p;
+    memset(&p, 0, sizeof(Parser));
+    p.arena = &cmd_arena;
+    lexer_init(&p.lex, src, len);
+    int count = 0;
+    int cap = 0;
+    *words = NULL;
+    
+    int command = 1;       // a command name may come next
+    int case_depth = 0;
+    int case_head = 0;     // between case and in
+    int pattern = 0;       // in the patterns of a case clause
+    int name_next = 0;     // the word after function
+    int time_options = 0;  // -p and -j after time
+    int in_cond = 0;       // between [[ and ]]
+    TokenType prev = TOK_NEWLINE;
+    
+    while (1) {
+        Token tok = lexer_next(&p.lex);
+        if (tok.type == TOK_EOF) break;
+        
+        if (is_redirect_op(tok.type)) {
+            Token target = lexer_next(&p.lex);
+            if (target.type != TOK_WORD) break;
+            if (tok.type == TOK_DLESS || tok.type == TOK_DLESSDASH) {
+                // The body follows the next newline; the lexer skips it
+                Redirect* redir = parse_alloc(&p, sizeof(Redirect));
+                redir->op = tok.type;
+                redir->target.start = target.start;
+                redir->target.len = target.len;
+                heredoc_delimiter(&p, redir);
+                *p.lex.heredoc_tail = redir;
+                p.lex.heredoc_tail = &redir->next_heredoc;
+            }
+            prev = TOK_WORD;
+            continue;
+        }
+        
+        if (tok.type == TOK_WORD) {
+            int is_command = 0;
+            if (in_cond) {
+                if (token_is(tok, "]]")) in_cond = 0;
+            } else if (pattern) {
+                if (token_is(tok, "esac")) {
+                    pattern = 0;
+                    case_depth--;
+                    command = 0;
+                }
+            } else if (case_head) {
+                if (token_is(tok, "in")) {
+                    case_head = 0;
+                    pattern = 1;
+                }
+            } else if (name_next) {
+                name_next = 0;
+                command = 1;
+            } else if (time_options && (token_is(tok, "-p") || token_is(tok, "-j"))) {
+                // still before the command
+            } else if (command) {
+                time_options = 0;
+                if (token_is(tok, "if") || token_is(tok, "then") || token_is(tok, "else") ||
+                    token_is(tok, "elif") || token_is(tok, "while") || token_is(tok, "until") ||
+                    token_is(tok, "do") || token_is(tok, "{") || token_is(tok, "!") ||
+                    is_assignment(tok)) {
+                    // a command may still follow
+                } else if (token_is(tok, "time")) {
+                    time_options = 1;
+                } else if (token_is(tok, "function")) {
+                    name_next = 1;
+                    command = 0;
+                } else if (token_is(tok, "case")) {
+                    case_depth++;
+                    case_head = 1;
+                    command = 0;
+                } else if (token_is(tok, "esac") && case_depth > 0) {
+                    case_depth--;
+                    command = 0;
+                } else if (token_is(tok, "[[")) {
+                    in_cond = 1;
+                    command = 0;
+                } else if (token_is(tok, "for") || token_is(tok, "fi") || token_is(tok, "done") ||
+                           token_is(tok, "}")) {
+                    command = 0;
+                } else {
+                    is_command = 1;
+                    command = 0;
+                }
+            }
+            *words = arena_grow(&cmd_arena, *words, count, &cap, sizeof(AliasWord));
+            (*words)[count].start = tok.start - src;
+            (*words)[count].len = tok.len;
+            (*words)[count].command = is_command;
+            count++;
+        } else if (in_cond) {
+            // && || ( ) inside [[ ]] combine tests
+        } else if (tok.type == TOK_RPAREN) {
+            // f() is followed by the body; ")" after patterns by the commands
+            command = pattern || prev == TOK_LPAREN;
+            pattern = 0;
+        } else if (tok.type == TOK_DSEMI) {
+            pattern = case_depth > 0;
+            command = 0;
+        } else if (!pattern) {
+            // ; & | && || ( and newline start a command
+            command = 1;
+            time_options = 0;
+        }
+        prev = tok.type;
+    }
+    *ends_command = command && !pattern && !case_head && !in_cond;
+    return count;
+}
+
 // Add or update an alias
 void add_alias(char* name, char* value) {
-    // Check if alias already exists
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            free(aliases[i].value);
-            aliases[i].value = strdup(value);
-            return;
+    int name_len = strlen(name);
+    if ((alias_count + 1) * 4 > alias_cap * 3) {
+        Alias* old = aliases;
+        int old_cap = alias_cap;
+        alias_cap = alias_cap ? alias_cap * 2 : 32;
+        aliases = calloc(alias_cap, sizeof(Alias));
+        if (!aliases) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
         }
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i].name) *alias_slot(old[i].name, strlen(old[i].name)) = old[i];
+        }
+        free(old);
     }
     
-    // Add new alias
-    if (alias_count < MAX_ALIASES) {
-        aliases[alias_count].name = strdup(name);
-        aliases[alias_count].value = strdup(value);
+    Alias* a = alias_slot(name, name_len);
+    if (a->name != NULL && strcmp(a->value, value) == 0) return;
+    alias_generation++;
+    if (a->name == NULL) {
+        a->name = strdup(name);
         alias_count++;
     } else {
-        fprintf(stderr, "myshell: maximum number of aliases reached\n");
+        free(a->value);
+        free(a->words);
     }
+    a->value = strdup(value);
+    a->value_len = strlen(value);
+    
+    ArenaMark mark = arena_mark(&cmd_arena);
+    AliasWord* words;
+    int ends_command;
+    a->word_count = alias_scan(a->value, a->value_len, &words, &ends_command);
+    a->words = malloc((a->word_count + 1) * sizeof(AliasWord));
+    memcpy(a->words, words, a->word_count * sizeof(AliasWord));
+    arena_release(&cmd_arena, mark);
+    char last = a->value_len > 0 ? a->value[a->value_len - 1] : '\0';
+    a->open = ends_command || last == ' ' || last == '\t';
 }
 
 // Get alias value
 char* get_alias(char* name) {
-    for (int i = 0; i < alias_count; i++) {
-        if (strcmp(aliases[i].name, name) == 0) {
-            return aliases[i].value;
-        }
-    }
-    return NULL;
+    Alias* a = alias_find(name, strlen(name));
+    return a ? a->value : NULL;
 }
 
-// Expand aliases in command
-char* expand_aliases(char* input) {
-    static char expanded[MAX_INPUT * 2];
-    char* result = expanded;
-    char temp[MAX_INPUT];
-    
-    strncpy(temp, input, MAX_INPUT);
-    
-    // Get first word (command)
-    char* first_word = strtok(temp, " \t");
-    if (!first_word) {
-        return input;
-    }
-    
-    // Check if it's an alias
-    char* alias_value = get_alias(first_word);
-    if (alias_value) {
-        // Replace with alias value
-        strcpy(result, alias_value);
+// Replace the alias names among the words of text by their bodies, which
+// are expanded in turn, except for aliases already being expanded. Returns
+// the length of the result, which is written to out unless it is NULL.
+// *hits counts the replacements; *open is set if text ends in an alias
+// whose next word should be checked too.
+size_t alias_expand_text(const char* text, int len, AliasWord* words, int count,
+                         char* out, int* hits, int* open) {
+    size_t n = 0;
+    int pos = 0;
+    int check_next = 0;
+    for (int i = 0; i < count; i++) {
+        AliasWord* w = &words[i];
+        Alias* a = w->command || check_next ? alias_find(text + w->start, w->len) : NULL;
+        check_next = 0;
+        if (a == NULL || a->active) continue;
         
-        // Add remaining arguments
-        char* rest = input + strlen(first_word);
-        if (*rest) {
-            strcat(result, rest);
-        }
-        return result;
+        if (out) memcpy(out + n, text + pos, w->start - pos);
+        n += w->start - pos;
+        int inner_open;
+        a->active = 1;
+        n += alias_expand_text(a->value, a->value_len, a->words, a->word_count,
+                               out ? out + n : NULL, hits, &inner_open);
+        a->active = 0;
+        (*hits)++;
+        check_next = a->open || inner_open;
+        pos = w->start + w->len;
     }
+    if (out) memcpy(out + n, text + pos, len - pos);
+    n += len - pos;
     
-    return input;
+    // Only blanks may follow an alias that leaves the next word open
+    while (pos < len && (text[pos] == ' ' || text[pos] == '\t')) pos++;
+    *open = check_next && pos == len;
+    return n;
 }
 
-// Load and execute .myshellrc
-void load_myshellrc() {
-    char* home = getenv("HOME");
-    if (!home) return;
-    
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/.myshellrc", home);
-    
-    FILE* f = fopen(filepath, "r");
-    if (!f) return;
-    
-    printf("Loading ~/.myshellrc...\n");
-    
-    char line[MAX_INPUT];
-    int line_num = 0;
-    while (fgets(line, sizeof(line), f)) {
-        line_num++;
-        
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        // Skip empty lines and comments
-        char* trimmed = line;
-        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
-        if (*trimmed == '\0' || *trimmed == '#') continue;
-        
-        // Handle alias definitions
-        if (strncmp(trimmed, "alias ", 6) == 0) {
-            char* alias_def = trimmed + 6;
-            char* equal = strchr(alias_def, '=');
-            if (equal) {
-                *equal = '\0';
-                char* name = alias_def;
-                char* value = equal + 1;
-                
-                // Trim name
-                while (*name == ' ' || *name == '\t') name++;
-                char* name_end = name + strlen(name) - 1;
-                while (name_end > name && (*name_end == ' ' || *name_end == '\t')) {
-                    *name_end = '\0';
-                    name_end--;
-                }
-                
-                // Remove quotes from value
-                while (*value == ' ' || *value == '\t') value++;
-                if (*value == '\'' || *value == '"') {
-                    value++;
-                    int len = strlen(value);
-                    if (len > 0 && (value[len-1] == '\'' || value[len-1] == '"')) {
-                        value[len-1] = '\0';
-                    }
-                }
-                
-                add_alias(name, value);
-            }
-        }
-        // Handle export statements
-        else if (strncmp(trimmed, "export ", 7) == 0) {
-            char* export_def = trimmed + 7;
-            char* equal = strchr(export_def, '=');
-            if (equal) {
-                *equal = '\0';
-                char* name = export_def;
-                char* value = equal + 1;
-                
-                // Trim name
-                while (*name == ' ' || *name == '\t') name++;
-                
-                // Remove quotes from value
-                while (*value == ' ' || *value == '\t') value++;
-                if (*value == '\'' || *value == '"') {
-                    value++;
-                    int len = strlen(value);
-                    if (len > 0 && (value[len-1] == '\'' || value[len-1] == '"')) {
-                        value[len-1] = '\0';
-                    }
-                }
-                
-                setenv(name, value, 1);
-            }
-        }
-        // Execute other commands (like echo)
-        else {
-            char** args = parse_input(strdup(line));
-            if (args[0] != NULL) {
-                execute_command(args);
-            }
-            free(args);
-        }
-    }
-    
-    fclose(f);
-    printf("Loaded %d aliases from ~/.myshellrc\n", alias_count);
+// Expand aliases at every command position of a line, and in what they
+// expand to. The line is copied once, into cmd_arena, and only if it uses
+// an alias; otherwise input itself is returned.
+char* expand_aliases(char* input) {
+    if (alias_count == 0) return input;
+    int len = strlen(input);
+    AliasWord* words;
+    int ends_command;
+    int count = alias_scan(input, len, &words, &ends_command);
+    
+    int hits = 0;
+    int open;
+    size_t size = alias_expand_text(input, len, words, count, NULL, &hits, &open);
+    if (hits == 0) return input;
+    char* result = arena_alloc(&cmd_arena, size + 1);
+    alias_expand_text(input, len, words, count, result, &hits, &open);
+    result[size] = '\0';
+    return result;
 }
 
 // Directory Bookmarks Functions
 
 // Load bookmarks from file
 void load_bookmarks() {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -428,7 +1170,7 @@ void load_bookmarks() {
 
 // Save bookmarks to file
 void save_bookmarks() {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -482,12 +1224,14 @@ int builtin_mark(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: mark: missing bookmark name\n");
         fprintf(stderr, "Usage: mark <name>\n");
+        last_status = 1;
         return 1;
     }
     
     char cwd[1024];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
         perror("myshell: getcwd");
+        last_status = 1;
         return 1;
     }
     
@@ -502,17 +1246,20 @@ int builtin_jump(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: jump: missing bookmark name\n");
         fprintf(stderr, "Usage: jump <name>\n");
+        last_status = 1;
         return 1;
     }
     
     char* path = get_bookmark(args[1]);
     if (path == NULL) {
         fprintf(stderr, "myshell: jump: bookmark '%s' not found\n", args[1]);
+        last_status = 1;
         return 1;
     }
     
     if (chdir(path) != 0) {
         perror("myshell: jump");
+        last_status = 1;
         return 1;
     }
     
@@ -542,6 +1289,7 @@ int builtin_unmark(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: unmark: missing bookmark name\n");
         fprintf(stderr, "Usage: unmark <name>\n");
+        last_status = 1;
         return 1;
     }
     
@@ -565,6 +1313,7 @@ int builtin_unmark(char** args) {
     }
     
     fprintf(stderr, "myshell: unmark: bookmark '%s' not found\n", args[1]);
+    last_status = 1;
     return 1;
 }
 
@@ -572,7 +1321,7 @@ int builtin_unmark(char** args) {
 
 // Save a note
 void save_note(char* note) {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -593,7 +1342,7 @@ void save_note(char* note) {
 
 // Display all notes
 void display_notes() {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -630,6 +1379,7 @@ int builtin_note(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: note: missing note text\n");
         fprintf(stderr, "Usage: note <text>\n");
+        last_status = 1;
         return 1;
     }
     
@@ -654,7 +1404,7 @@ int builtin_notes(char** args) {
 
 // Built-in: clearnotes
 int builtin_clearnotes(char** args) {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return 1;
     
     char filepath[1024];
@@ -685,16 +1435,18 @@ int builtin_delnote(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: delnote: missing note number\n");
         fprintf(stderr, "Usage: delnote <n>\n");
+        last_status = 1;
         return 1;
     }
     
     int note_num = atoi(args[1]);
     if (note_num <= 0) {
         fprintf(stderr, "myshell: delnote: invalid note number\n");
+        last_status = 1;
         return 1;
     }
     
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return 1;
     
     char filepath[1024];
@@ -716,6 +1468,7 @@ int builtin_delnote(char** args) {
     
     if (note_num > count) {
         fprintf(stderr, "myshell: delnote: note number %d not found (total: %d)\n", note_num, count);
+        last_status = 1;
         return 1;
     }
     
@@ -723,6 +1476,7 @@ int builtin_delnote(char** args) {
     f = fopen(filepath, "w");
     if (!f) {
         perror("myshell: delnote");
+        last_status = 1;
         return 1;
     }
     
@@ -744,88 +1498,19 @@ int builtin_exec(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: exec: missing command\n");
         fprintf(stderr, "Usage: exec <command> [args...]\n");
+        last_status = 1;
         return 1;
     }
     
     // Save history before exec
     save_history_to_file();
     
-    // Expand aliases
-    char* expanded = expand_aliases(args[1]);
-    
     // Execute the command, replacing the shell process
     execvp(args[1], &args[1]);
     
     // If we get here, exec failed
     perror("myshell: exec");
-    return 1;
-}
-
-// Built-in: source
-int builtin_source(char** args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "myshell: source: missing filename\n");
-        fprintf(stderr, "Usage: source <file>\n");
-        return 1;
-    }
-    
-    FILE* f = fopen(args[1], "r");
-    if (!f) {
-        perror("myshell: source");
-        return 1;
-    }
-    
-    printf("Sourcing %s...\n", args[1]);
-    
-    char line[MAX_INPUT];
-    int line_num = 0;
-    int errors = 0;
-    
-    while (fgets(line, sizeof(line), f)) {
-        line_num++;
-        
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        // Skip empty lines and comments
-        char* trimmed = line;
-        while (*trimmed == ' ' || *trimmed == '\t') trimmed++;
-        if (*trimmed == '\0' || *trimmed == '#') continue;
-        
-        // Expand aliases
-        char* expanded = expand_aliases(trimmed);
-        
-        // Check if it's an arithmetic expression
-        if (is_arithmetic_expression(expanded)) {
-            double result = evaluate_expression(expanded);
-            if (result == (int)result) {
-                printf("%d\n", (int)result);
-            } else {
-                printf("%.2f\n", result);
-            }
-        } else {
-            // Parse and execute command
-            char** cmd_args = parse_input(strdup(expanded));
-            if (cmd_args[0] != NULL) {
-                // Execute command silently unless it's echo or similar
-                int status = execute_command(cmd_args);
-                if (status == 0) {
-                    fprintf(stderr, "myshell: source: line %d: command failed\n", line_num);
-                    errors++;
-                }
-            }
-            free(cmd_args);
-        }
-    }
-    
-    fclose(f);
-    
-    if (errors > 0) {
-        printf("⚠️  Sourced %s with %d error(s)\n", args[1], errors);
-    } else {
-        printf("✅ Successfully sourced %s\n", args[1]);
-    }
-    
+    last_status = 1;
     return 1;
 }
 
@@ -834,14 +1519,20 @@ int builtin_type(char** args) {
     if (args[1] == NULL) {
         fprintf(stderr, "myshell: type: missing argument\n");
         fprintf(stderr, "Usage: type <command>\n");
+        last_status = 1;
         return 1;
     }
     
     char* cmd = args[1];
     
+    if (function_find(cmd)) {
+        printf("%s is a function\n", cmd);
+        return 1;
+    }
+    
     // Check if it's a builtin
     for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(cmd, builtin_names[i]) == 0) {
+        if (strcmp(cmd, builtin_names[i]) == 0 && !builtin_disabled[i]) {
             printf("%s is a shell builtin\n", cmd);
             return 1;
         }
@@ -855,13 +1546,14 @@ int builtin_type(char** args) {
     }
     
     // Search in PATH
-    char* path_env = getenv("PATH");
+    char* path_env = var_lookup("PATH");
     if (!path_env) {
         printf("%s: not found\n", cmd);
+        last_status = 1;
         return 1;
     }
     
-    char* path = strdup(path_env);
+    char* path = arena_strdup(&cmd_arena, path_env);
     char* dir = strtok(path, ":");
     
     int found = 0;
@@ -878,10 +1570,9 @@ int builtin_type(char** args) {
         dir = strtok(NULL, ":");
     }
     
-    free(path);
-    
     if (!found) {
         printf("%s: not found\n", cmd);
+        last_status = 1;
     }
     
     return 1;
@@ -1070,7 +1761,7 @@ void add_to_history(char* cmd) {
 
 // Save history to file
 void save_history_to_file() {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -1088,7 +1779,7 @@ void save_history_to_file() {
 
 // Load history from file
 void load_history_from_file() {
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     if (!home) return;
     
     char filepath[1024];
@@ -1111,46 +1802,213 @@ void load_history_from_file() {
     fclose(f);
 }
 
-// Enable raw mode for terminal
-void enable_raw_mode() {
-    tcgetattr(STDIN_FILENO, &orig_termios);
-    struct termios raw = orig_termios;
-    raw.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-}
-
-// Disable raw mode
-void disable_raw_mode() {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+// Put a new, empty ring file in place of one that is missing or has another
+// format. Shells that have the old file mapped keep it; truncating it under
+// them would make their next access to it fault with SIGBUS. Returns the
+// mapped ring, or NULL after reporting an error.
+SharedHistory* shared_history_create(const char* path) {
+    char temp[1100];
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    SharedHistory* ring = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, sizeof(SharedHistory)) == 0) {
+        ring = mmap(NULL, sizeof(SharedHistory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ring != MAP_FAILED) {
+        ring->slot_count = SHARED_HISTORY_SLOTS;
+        ring->slot_size = sizeof(SharedHistorySlot);
+        ring->magic = SHARED_HISTORY_MAGIC;
+        if (rename(temp, path) < 0) {
+            munmap(ring, sizeof(SharedHistory));
+            ring = MAP_FAILED;
+        }
+    }
+    if (ring == MAP_FAILED) {
+        perror("myshell: shared history");
+        unlink(temp);
+    }
+    if (fd >= 0) close(fd);
+    return ring == MAP_FAILED ? NULL : ring;
 }
 
-// Get command completions from PATH
-char** get_command_completions(char* partial, int* count) {
-    char** completions = malloc(MAX_COMPLETIONS * sizeof(char*));
-    *count = 0;
+// Map the shared history ring, creating it on first use
+void shared_history_init() {
+    char* enabled = var_lookup("MYSHELL_SHARED_HISTORY");
+    if (!enabled || strcmp(enabled, "1") != 0) return;
     
-    // Check built-in commands first
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strncmp(builtin_names[i], partial, strlen(partial)) == 0) {
-            completions[*count] = strdup(builtin_names[i]);
-            (*count)++;
+    char* home = var_lookup("HOME");
+    if (!home) return;
+    
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/.myshell_history_shm", home);
+    
+    // Only creation and format checks take the file lock; the ring itself is
+    // lock-free. A shell that replaced the file while we waited for the lock
+    // has put a new one at the path, so open again until the two agree.
+    int fd;
+    struct stat st, path_st;
+    while (1) {
+        fd = open(filepath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            perror("myshell: shared history");
+            return;
+        }
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) < 0 || stat(filepath, &path_st) < 0 ||
+            (st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino)) {
+            break;
         }
+        close(fd);
     }
     
-    // Get PATH
-    char* path_env = getenv("PATH");
-    if (!path_env) return completions;
+    SharedHistory* ring = MAP_FAILED;
+    if (st.st_size == (off_t)sizeof(SharedHistory)) {
+        ring = mmap(NULL, sizeof(SharedHistory), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (ring != MAP_FAILED && (ring->magic != SHARED_HISTORY_MAGIC ||
+                               ring->slot_count != SHARED_HISTORY_SLOTS ||
+                               ring->slot_size != sizeof(SharedHistorySlot))) {
+        munmap(ring, sizeof(SharedHistory));
+        ring = MAP_FAILED;
+    }
+    if (ring == MAP_FAILED) {
+        ring = shared_history_create(filepath);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (ring == NULL) return;
     
-    char* path = strdup(path_env);
-    char* dir = strtok(path, ":");
+    shared_history = ring;
     
-    while (dir && *count < MAX_COMPLETIONS) {
-        DIR* d = opendir(dir);
-        if (!d) {
-            dir = strtok(NULL, ":");
-            continue;
-        }
-        
+    // Pick up everything still in the ring, including commands from sessions
+    // that never got to save ~/.myshell_history
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    shared_history_seen = head > SHARED_HISTORY_SLOTS ? head - SHARED_HISTORY_SLOTS : 0;
+    shared_history_sync(1);
+}
+
+// Append a command to the shared ring
+void shared_history_publish(char* cmd) {
+    if (!shared_history || cmd == NULL) return;
+    
+    size_t len = strlen(cmd);
+    if (len == 0) return;
+    if (len >= MAX_INPUT) len = MAX_INPUT - 1;
+    
+    uint64_t n = atomic_fetch_add_explicit(&shared_history->head, 1, memory_order_acq_rel);
+    SharedHistorySlot* slot = &shared_history->slots[n % SHARED_HISTORY_SLOTS];
+    
+    atomic_store_explicit(&slot->seq, 2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->pid = getpid();
+    slot->len = len;
+    memcpy(slot->text, cmd, len);
+    slot->text[len] = '\0';
+    atomic_store_explicit(&slot->seq, 2 * n + 2, memory_order_release);
+}
+
+// Check whether a command is already in the local history
+int history_contains(char* cmd) {
+    for (int i = history_count - 1; i >= 0; i--) {
+        if (strcmp(history[i], cmd) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Import entries published by other sessions since the last sync. With
+// skip_known, commands already in the local history (e.g. loaded from
+// ~/.myshell_history) are not imported again.
+// Returns the number of commands added to the local history.
+int shared_history_sync(int skip_known) {
+    if (!shared_history) return 0;
+    
+    uint64_t head = atomic_load_explicit(&shared_history->head, memory_order_acquire);
+    if (head - shared_history_seen > SHARED_HISTORY_SLOTS) {
+        // We fell a whole ring behind; the oldest entries are gone
+        shared_history_seen = head - SHARED_HISTORY_SLOTS;
+    }
+    
+    int added = 0;
+    pid_t self = getpid();
+    char text[MAX_INPUT];
+    
+    while (shared_history_seen < head) {
+        uint64_t n = shared_history_seen;
+        SharedHistorySlot* slot = &shared_history->slots[n % SHARED_HISTORY_SLOTS];
+        
+        uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (before < 2 * n + 2) {
+            // Writer has claimed the entry but not finished it yet. Retry on the
+            // next sync unless the ring has moved far past it (writer died).
+            if (head - n < SHARED_HISTORY_SLOTS / 2) break;
+            shared_history_seen++;
+            continue;
+        }
+        
+        uint32_t len = slot->len;
+        int32_t pid = slot->pid;
+        if (len >= MAX_INPUT) len = MAX_INPUT - 1;
+        memcpy(text, slot->text, len);
+        text[len] = '\0';
+        
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        shared_history_seen++;
+        
+        // Overwritten by a newer entry while we copied it
+        if (before != 2 * n + 2 || after != before) continue;
+        
+        if (pid != self && !(skip_known && history_contains(text))) {
+            add_to_history(text);
+            added++;
+        }
+    }
+    
+    return added;
+}
+
+// Enable raw mode for terminal
+void enable_raw_mode() {
+    tcgetattr(STDIN_FILENO, &orig_termios);
+    struct termios raw = orig_termios;
+    raw.c_lflag &= ~(ECHO | ICANON);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+}
+
+// Disable raw mode
+void disable_raw_mode() {
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
+}
+
+// Get command completions from PATH
+char** get_command_completions(char* partial, int* count) {
+    char** completions = arena_alloc(&cmd_arena, MAX_COMPLETIONS * sizeof(char*));
+    *count = 0;
+    
+    // Check built-in commands first
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strncmp(builtin_names[i], partial, strlen(partial)) == 0) {
+            completions[*count] = arena_strdup(&cmd_arena, builtin_names[i]);
+            (*count)++;
+        }
+    }
+    
+    // Get PATH
+    char* path_env = var_lookup("PATH");
+    if (!path_env) return completions;
+    
+    char* path = arena_strdup(&cmd_arena, path_env);
+    char* dir = strtok(path, ":");
+    
+    while (dir && *count < MAX_COMPLETIONS) {
+        DIR* d = opendir(dir);
+        if (!d) {
+            dir = strtok(NULL, ":");
+            continue;
+        }
+        
         struct dirent* entry;
         while ((entry = readdir(d)) && *count < MAX_COMPLETIONS) {
             if (strncmp(entry->d_name, partial, strlen(partial)) == 0) {
@@ -1163,7 +2021,7 @@ char** get_command_completions(char* partial, int* count) {
                     }
                 }
                 if (!duplicate) {
-                    completions[*count] = strdup(entry->d_name);
+                    completions[*count] = arena_strdup(&cmd_arena, entry->d_name);
                     (*count)++;
                 }
             }
@@ -1172,13 +2030,12 @@ char** get_command_completions(char* partial, int* count) {
         dir = strtok(NULL, ":");
     }
     
-    free(path);
     return completions;
 }
 
 // Get file/directory completions
 char** get_file_completions(char* partial, int* count) {
-    char** completions = malloc(MAX_COMPLETIONS * sizeof(char*));
+    char** completions = arena_alloc(&cmd_arena, MAX_COMPLETIONS * sizeof(char*));
     *count = 0;
     
     char* dir_path = ".";
@@ -1220,7 +2077,7 @@ char** get_file_completions(char* partial, int* count) {
                 closedir(test);
             }
             
-            completions[*count] = strdup(full_path);
+            completions[*count] = arena_strdup(&cmd_arena, full_path);
             (*count)++;
         }
     }
@@ -1353,7 +2210,7 @@ char** get_completions(char* partial, int* count) {
 void display_prompt() {
     char cwd[1024];
     char hostname[256];
-    char* username = getenv("USER");
+    char* username = var_lookup("USER");
     const char *folder_icon = "";   // nf-fa-folder
     const char *user_icon   = "";   // nf-fa-user
     const char *star_icon   = "✦";   // star / sparkle
@@ -1369,7 +2226,7 @@ void display_prompt() {
     }
     
     // Replace home directory with ~
-    char* home = getenv("HOME");
+    char* home = var_lookup("HOME");
     char display_path[1024];
     if (home && strncmp(cwd, home, strlen(home)) == 0) {
         snprintf(display_path, sizeof(display_path), "~%s", cwd + strlen(home));
@@ -1450,6 +2307,9 @@ char* read_input_with_completion() {
     char* input = malloc(MAX_INPUT);
     int cursor = 0;  // Current cursor position
     int len = 0;     // Total length of input
+    
+    // Pull in commands run in other terminals since the last prompt
+    shared_history_sync(0);
     int temp_history_index = history_index;
     struct timeval last_esc_time = {0, 0};
     int esc_count = 0;
@@ -1459,7 +2319,14 @@ char* read_input_with_completion() {
     
     while (1) {
         char c;
-        read(STDIN_FILENO, &c, 1);
+        ssize_t got = read(STDIN_FILENO, &c, 1);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            // The terminal went away: leave as Ctrl+D does
+            disable_raw_mode();
+            free(input);
+            exit(last_status);
+        }
         
         if (c == '\n') {
             // Enter pressed
@@ -1522,6 +2389,9 @@ char* read_input_with_completion() {
                 if (seq[0] == '[') {
                     if (seq[1] == 'A') {
                         // Up arrow - navigate history
+                        if (temp_history_index == history_count && shared_history_sync(0) > 0) {
+                            temp_history_index = history_count;
+                        }
                         if (temp_history_index > 0) {
                             temp_history_index--;
                             
@@ -1634,6 +2504,8 @@ char* read_input_with_completion() {
             strncpy(partial, input + word_start, cursor - word_start);
             partial[cursor - word_start] = '\0';
             
+            // Candidates live in the command arena until this keypress is handled
+            ArenaMark mark = arena_mark(&cmd_arena);
             int count;
             char** completions = get_completions(partial, &count);
             
@@ -1686,10 +2558,7 @@ char* read_input_with_completion() {
             }
             
             // Free completions
-            for (int i = 0; i < count; i++) {
-                free(completions[i]);
-            }
-            free(completions);
+            arena_release(&cmd_arena, mark);
             
             fflush(stdout);
         } else if (c == 127 || c == 8) {
@@ -1743,181 +2612,8832 @@ char* read_input_with_completion() {
     // Add to history if not empty
     if (strlen(input) > 0) {
         add_to_history(input);
+        shared_history_publish(input);
     }
     
     return input;
 }
 
-// Parse input into arguments
-char** parse_input(char* input) {
-    int bufsize = MAX_ARGS;
-    int position = 0;
-    char** tokens = malloc(bufsize * sizeof(char*));
-    char* token;
+// Arena allocator
+
+// Allocate size bytes from the arena, 16-byte aligned. Never fails.
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    
+    ArenaChunk* chunk = arena->current;
+    while (chunk == NULL || chunk->used + size > chunk->size) {
+        if (chunk && chunk->next) {
+            // Reuse a chunk retained from an earlier command
+            chunk = chunk->next;
+            chunk->used = 0;
+            continue;
+        }
+        
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk* fresh = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (!fresh) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+        fresh->next = NULL;
+        fresh->size = chunk_size;
+        fresh->used = 0;
+        if (chunk) {
+            chunk->next = fresh;
+        } else {
+            arena->head = fresh;
+        }
+        arena->chunk_mallocs++;
+        arena->reserved += chunk_size;
+        chunk = fresh;
+    }
+    arena->current = chunk;
+    
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->in_use += size;
+    arena->allocations++;
+    arena->bytes_allocated += size;
+    if (arena->in_use > arena->peak) {
+        arena->peak = arena->in_use;
+    }
+    return ptr;
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t len) {
+    char* copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char* arena_strdup(Arena* arena, const char* str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+ArenaMark arena_mark(Arena* arena) {
+    ArenaMark mark;
+    mark.chunk = arena->current;
+    mark.used = arena->current ? arena->current->used : 0;
+    mark.in_use = arena->in_use;
+    return mark;
+}
+
+// Free everything allocated since the mark
+void arena_release(Arena* arena, ArenaMark mark) {
+    if (mark.chunk == NULL) {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark.chunk;
+    mark.chunk->used = mark.used;
+    arena->in_use = mark.in_use;
+}
+
+// Release every chunk of an arena that is no longer used
+void arena_free(Arena* arena) {
+    ArenaChunk* chunk = arena->head;
+    while (chunk) {
+        ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(Arena));
+}
+
+// Grow an array allocated in the arena, doubling its capacity
+void* arena_grow(Arena* arena, void* array, int count, int* cap, size_t elem_size) {
+    if (count < *cap) return array;
+    int new_cap = *cap ? *cap * 2 : 4;
+    void* grown = arena_alloc(arena, new_cap * elem_size);
+    if (count > 0) {
+        memcpy(grown, array, count * elem_size);
+    }
+    *cap = new_cap;
+    return grown;
+}
+
+// Free everything. Chunks are kept for the next command, up to a limit.
+void arena_reset(Arena* arena) {
+    if (arena->head == NULL) return;
+    
+    if (arena->reserved > ARENA_RETAIN_LIMIT) {
+        ArenaChunk* chunk = arena->head->next;
+        while (chunk) {
+            ArenaChunk* next = chunk->next;
+            arena->reserved -= chunk->size;
+            free(chunk);
+            chunk = next;
+        }
+        arena->head->next = NULL;
+    }
+    arena->head->used = 0;
+    arena->current = arena->head;
+    arena->in_use = 0;
+    arena->resets++;
+}
+
+// Built-in: memstat
+int builtin_memstat(char** args) {
+    (void)args;
+    int chunks = 0;
+    for (ArenaChunk* chunk = cmd_arena.head; chunk; chunk = chunk->next) {
+        chunks++;
+    }
     
-    if (!tokens) {
+    printf("Command arena:\n");
+    printf("  allocations:      %lu\n", cmd_arena.allocations);
+    printf("  bytes allocated:  %llu\n", cmd_arena.bytes_allocated);
+    printf("  in use now:       %zu\n", cmd_arena.in_use);
+    printf("  peak per command: %zu\n", cmd_arena.peak);
+    printf("  resets:           %lu\n", cmd_arena.resets);
+    printf("  chunks:           %d (%zu bytes reserved, %lu mallocs)\n",
+           chunks, cmd_arena.reserved, cmd_arena.chunk_mallocs);
+    return 1;
+}
+
+// Variables
+
+// Length of the identifier at the start of s ([A-Za-z_][A-Za-z0-9_]*), or 0
+int var_name_length(const char* s, int len) {
+    if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return 0;
+    int n = 1;
+    while (n < len && (isalnum((unsigned char)s[n]) || s[n] == '_')) n++;
+    return n;
+}
+
+int is_valid_name(const char* s, int len) {
+    return len > 0 && var_name_length(s, len) == len;
+}
+
+// FNV-1a
+unsigned int var_hash(const char* name, int len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The slot holding a name, or the empty slot it would go in
+Var* var_slot(const char* name, int len) {
+    unsigned int mask = var_cap - 1;
+    for (unsigned int i = var_hash(name, len) & mask;; i = (i + 1) & mask) {
+        Var* v = &vars[i];
+        if (v->name == NULL || (strncmp(v->name, name, len) == 0 && v->name[len] == '\0')) {
+            return v;
+        }
+    }
+}
+
+// Double the table. Names that are neither set nor exported are dropped.
+void var_grow() {
+    Var* old = vars;
+    int old_cap = var_cap;
+    var_cap = var_cap ? var_cap * 2 : 64;
+    vars = calloc(var_cap, sizeof(Var));
+    if (!vars) {
         fprintf(stderr, "myshell: allocation error\n");
         exit(1);
     }
-    
-    token = strtok(input, " \t\r\n");
-    while (token != NULL) {
-        tokens[position] = token;
-        position++;
-        
-        if (position >= bufsize) {
-            bufsize += MAX_ARGS;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "myshell: allocation error\n");
-                exit(1);
-            }
+    var_used = 0;
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].name == NULL) continue;
+        if (old[i].entry == NULL && !old[i].exported) {
+            free(old[i].name);
+            continue;
         }
-        
-        token = strtok(NULL, " \t\r\n");
+        *var_slot(old[i].name, strlen(old[i].name)) = old[i];
+        var_used++;
     }
-    tokens[position] = NULL;
-    return tokens;
+    free(old);
 }
 
-// Handle input/output redirection
-void handle_redirection(char** args) {
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) {
-            int fd = open(args[i + 1], O_RDONLY);
-            if (fd < 0) {
-                perror("myshell");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-            args[i] = NULL;
-        } else if (strcmp(args[i], ">") == 0) {
-            int fd = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("myshell");
-                exit(1);
+// Find a variable's slot, adding the name if it is new. The pointer is only
+// valid until the next variable is added.
+Var* var_find_or_add(const char* name, int len) {
+    if ((var_used + 1) * 4 > var_cap * 3) {
+        var_grow();
+    }
+    Var* v = var_slot(name, len);
+    if (v->name == NULL) {
+        v->name = strndup(name, len);
+        var_used++;
+    }
+    return v;
+}
+
+// Look up a variable. Returns its value, or NULL if it is unset.
+char* var_get(const char* name, int len) {
+    if (var_cap == 0) return NULL;
+    Var* v = var_slot(name, len);
+    return v->entry ? v->entry + len + 1 : NULL;
+}
+
+char* var_lookup(const char* name) {
+    return var_get(name, strlen(name));
+}
+
+// Rebuild the cached envp after an exported variable changed. environ points
+// at it as well, so getenv and the PATH search of exec see the same values,
+// and launching a program never has to build an environment.
+void var_update_environ() {
+    int count = 0;
+    for (int i = 0; i < var_cap; i++) {
+        if (vars[i].exported && vars[i].entry) count++;
+    }
+    if (count + 1 > var_envp_cap) {
+        var_envp_cap = (count + 1) * 2;
+        var_envp = realloc(var_envp, var_envp_cap * sizeof(char*));
+        if (!var_envp) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    int n = 0;
+    for (int i = 0; i < var_cap; i++) {
+        if (vars[i].exported && vars[i].entry) var_envp[n++] = vars[i].entry;
+    }
+    var_envp[n] = NULL;
+    environ = var_envp;
+}
+
+// Set a variable. With export set it is also marked for export; otherwise it
+// keeps its export flag. Returns -1 if the name is not an identifier.
+int var_assign(const char* name, int len, const char* value, int export) {
+    if (!is_valid_name(name, len)) return -1;
+    Var* v = var_find_or_add(name, len);
+    int value_len = strlen(value);
+    char* entry = malloc(len + value_len + 2);
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+    free(v->entry);
+    v->entry = entry;
+    if (export) v->exported = 1;
+    if (v->exported) var_update_environ();
+    return 0;
+}
+
+// Mark a variable for export, e.g. "export NAME"
+int var_export(const char* name, int len) {
+    if (!is_valid_name(name, len)) return -1;
+    Var* v = var_find_or_add(name, len);
+    if (!v->exported) {
+        v->exported = 1;
+        if (v->entry) var_update_environ();
+    }
+    return 0;
+}
+
+void var_unset(const char* name, int len) {
+    if (var_cap == 0) return;
+    Var* v = var_slot(name, len);
+    if (v->name == NULL) return;
+    int was_exported = v->exported && v->entry;
+    free(v->entry);
+    v->entry = NULL;
+    v->exported = 0;
+    if (was_exported) var_update_environ();
+}
+
+// Start a scope. Variables made local in it get their old binding back when
+// it ends.
+void var_push_scope() {
+    var_depth++;
+}
+
+// Make a variable local to the current scope. It starts out unset.
+void var_local(const char* name, int len) {
+    for (int i = var_save_count - 1; i >= 0 && var_saves[i].depth == var_depth; i--) {
+        if (strncmp(var_saves[i].name, name, len) == 0 && var_saves[i].name[len] == '\0') return;
+    }
+    if (var_save_count == var_save_cap) {
+        var_save_cap = var_save_cap ? var_save_cap * 2 : 8;
+        var_saves = realloc(var_saves, var_save_cap * sizeof(VarSave));
+        if (!var_saves) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    Var* v = var_find_or_add(name, len);
+    VarSave* save = &var_saves[var_save_count++];
+    save->name = strndup(name, len);
+    save->entry = v->entry;
+    save->exported = v->exported;
+    save->depth = var_depth;
+    v->entry = NULL;
+    if (save->exported && save->entry) var_update_environ();
+}
+
+// End the current scope, restoring the bindings its locals hid
+void var_pop_scope() {
+    int changed = 0;
+    while (var_save_count > 0 && var_saves[var_save_count - 1].depth == var_depth) {
+        VarSave* save = &var_saves[--var_save_count];
+        Var* v = var_find_or_add(save->name, strlen(save->name));
+        if ((v->exported && v->entry) || (save->exported && save->entry)) changed = 1;
+        free(v->entry);
+        v->entry = save->entry;
+        v->exported = save->exported;
+        free(save->name);
+    }
+    var_depth--;
+    if (changed) var_update_environ();
+}
+
+// Load the environment the shell was started with as exported variables
+void var_import_environ() {
+    for (char** env = environ; *env != NULL; env++) {
+        char* eq = strchr(*env, '=');
+        if (eq == NULL || !is_valid_name(*env, eq - *env)) continue;
+        Var* v = var_find_or_add(*env, eq - *env);
+        free(v->entry);
+        v->entry = strdup(*env);
+        v->exported = 1;
+    }
+    var_update_environ();
+}
+
+// Lexer
+
+void lexer_init(Lexer* lex, const char* src, int len) {
+    lex->src = src;
+    lex->len = len;
+    lex->pos = 0;
+    lex->has_peeked = 0;
+    lex->incomplete = 0;
+    lex->prev_end = src;
+    lex->heredocs = NULL;
+    lex->heredoc_tail = &lex->heredocs;
+}
+
+// Characters that end an unquoted word
+int is_word_break(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ';' || c == '&' ||
+           c == '|' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+// Whether a process substitution <(...) or >(...) starts at pos
+int is_subst_start(const char* src, int len, int pos) {
+    return (src[pos] == '<' || src[pos] == '>') && pos + 1 < len && src[pos + 1] == '(';
+}
+
+// Skip a process substitution <(...) or command substitution $(...) starting
+// at pos. Returns the position after the closing parenthesis, or -1 if the
+// input ends before it.
+int scan_subst(const char* src, int len, int pos) {
+    int depth = 0;
+    for (pos++; pos < len; pos++) {
+        char c = src[pos];
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) return pos + 1;
+        } else if (c == '\\') {
+            pos++;
+        } else if (c == '\'') {
+            pos++;
+            while (pos < len && src[pos] != '\'') pos++;
+        } else if (c == '"') {
+            pos++;
+            while (pos < len && src[pos] != '"') {
+                if (src[pos] == '\\') pos++;
+                pos++;
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            args[i] = NULL;
         }
     }
+    return -1;
 }
 
-// Execute piped commands
-int execute_piped_commands(char** args) {
-    int pipe_positions[MAX_PIPES];
-    int pipe_count = 0;
-    
-    // Find all pipe positions
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
-            pipe_positions[pipe_count++] = i;
-            args[i] = NULL;
+// Find the '}' closing the brace at pos, as in ${...}, stepping over nested
+// braces and escapes. Returns -1 if the input ends first.
+int scan_brace(const char* src, int len, int pos) {
+    int depth = 0;
+    for (; pos < len; pos++) {
+        char c = src[pos];
+        if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth == 0) return pos;
+        } else if (c == '\\') {
+            pos++;
         }
     }
-    
-    if (pipe_count == 0) {
-        return -1; // No pipes found
+    return -1;
+}
+
+// Skip a `command` substitution starting at pos. Returns the position after
+// the closing backquote, or -1 if the input ends before it.
+int scan_backquote(const char* src, int len, int pos) {
+    for (pos++; pos < len; pos++) {
+        if (src[pos] == '\\') {
+            pos++;
+        } else if (src[pos] == '`') {
+            return pos + 1;
+        }
     }
-    
-    int pipefds[2 * pipe_count];
-    for (int i = 0; i < pipe_count; i++) {
-        if (pipe(pipefds + i * 2) < 0) {
-            perror("pipe");
-            return 1;
+    return -1;
+}
+
+// Find the end of the word starting at pos, stepping over quotes, escapes,
+// ${...}, command substitutions and process substitutions. Returns -1 if the input ends inside a
+// quote, a brace, a substitution or after a trailing backslash.
+int scan_word(const char* src, int len, int pos) {
+    while (pos < len && (!is_word_break(src[pos]) || is_subst_start(src, len, pos))) {
+        char c = src[pos];
+        if (is_subst_start(src, len, pos)) {
+            pos = scan_subst(src, len, pos);
+            if (pos < 0) return -1;
+        } else if (c == '$' && pos + 1 < len && src[pos + 1] == '{') {
+            pos = scan_brace(src, len, pos + 1);
+            if (pos < 0) return -1;
+            pos++;
+        } else if ((c == '$' && pos + 1 < len && src[pos + 1] == '(') || c == '`') {
+            pos = c == '`' ? scan_backquote(src, len, pos) : scan_subst(src, len, pos);
+            if (pos < 0) return -1;
+        } else if (c == '\\') {
+            if (pos + 1 >= len) return -1;
+            pos += 2;
+        } else if (c == '\'') {
+            pos++;
+            while (pos < len && src[pos] != '\'') pos++;
+            if (pos >= len) return -1;
+            pos++;
+        } else if (c == '"') {
+            pos++;
+            while (pos < len && src[pos] != '"') {
+                if ((src[pos] == '$' && pos + 1 < len && src[pos + 1] == '(') || src[pos] == '`') {
+                    pos = src[pos] == '`' ? scan_backquote(src, len, pos) : scan_subst(src, len, pos);
+                    if (pos < 0) return -1;
+                    continue;
+                }
+                if (src[pos] == '\\') pos++;
+                pos++;
+            }
+            if (pos >= len) return -1;
+            pos++;
+        } else {
+            pos++;
         }
     }
-    
-    int cmd_start = 0;
-    for (int i = 0; i <= pipe_count; i++) {
-        pid_t pid = fork();
+    return pos;
+}
+
+// Scan an operator at pos into tok. Returns its length, or 0 if there is none.
+int scan_operator(const char* src, int len, int pos, Token* tok) {
+    char c = src[pos];
+    char next = pos + 1 < len ? src[pos + 1] : '\0';
+    
+    switch (c) {
+        case '\n': tok->type = TOK_NEWLINE; return 1;
+        case ';':
+            if (next == ';') { tok->type = TOK_DSEMI; return 2; }
+            tok->type = TOK_SEMI;
+            return 1;
+        case '(': tok->type = TOK_LPAREN; return 1;
+        case ')': tok->type = TOK_RPAREN; return 1;
+        case '&':
+            if (next == '&') { tok->type = TOK_AND_IF; return 2; }
+            tok->type = TOK_AMP;
+            return 1;
+        case '|':
+            if (next == '|') { tok->type = TOK_OR_IF; return 2; }
+            tok->type = TOK_PIPE;
+            return 1;
+        case '<':
+            if (next == '<') {
+                char third = pos + 2 < len ? src[pos + 2] : '\0';
+                if (third == '<') { tok->type = TOK_TLESS; return 3; }
+                if (third == '-') { tok->type = TOK_DLESSDASH; return 3; }
+                tok->type = TOK_DLESS;
+                return 2;
+            }
+            if (next == '&') { tok->type = TOK_LESSAND; return 2; }
+            if (next == '>') { tok->type = TOK_LESSGREAT; return 2; }
+            tok->type = TOK_LESS;
+            return 1;
+        case '>':
+            if (next == '>') { tok->type = TOK_DGREAT; return 2; }
+            if (next == '&') { tok->type = TOK_GREATAND; return 2; }
+            if (next == '|') { tok->type = TOK_GREAT; return 2; }
+            tok->type = TOK_GREAT;
+            return 1;
+    }
+    return 0;
+}
+
+// Read the bodies of the here-documents opened on the line just ended. The
+// lexer is positioned after the newline; each body runs up to its delimiter
+// line and stays in the source buffer.
+void lexer_read_heredocs(Lexer* lex) {
+    const char* src = lex->src;
+    int len = lex->len;
+    
+    while (lex->heredocs) {
+        Redirect* r = lex->heredocs;
+        int delim_len = strlen(r->delimiter);
+        int pos = lex->pos;
         
-        if (pid == 0) {
-            // Child process
-            if (i > 0) {
-                dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
+        while (1) {
+            if (pos >= len) {
+                // The delimiter has not been typed yet
+                lex->incomplete = 1;
+                lex->pos = len;
+                return;
             }
-            if (i < pipe_count) {
-                dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
+            int line_end = pos;
+            while (line_end < len && src[line_end] != '\n') line_end++;
+            int text = pos;
+            if (r->op == TOK_DLESSDASH) {
+                while (text < line_end && src[text] == '\t') text++;
             }
-            
-            // Close all pipe fds
-            for (int j = 0; j < 2 * pipe_count; j++) {
-                close(pipefds[j]);
+            int next = line_end < len ? line_end + 1 : len;
+            if (line_end - text == delim_len && strncmp(src + text, r->delimiter, delim_len) == 0) {
+                r->body = src + lex->pos;
+                r->body_len = pos - lex->pos;
+                pos = next;
+                break;
             }
-            
-            handle_redirection(&args[cmd_start]);
-            execvp(args[cmd_start], &args[cmd_start]);
-            perror("myshell");
-            exit(1);
+            pos = next;
+        }
+        lex->pos = pos;
+        lex->heredocs = r->next_heredoc;
+    }
+    lex->heredoc_tail = &lex->heredocs;
+}
+
+// Scan the next token. Whitespace, comments and line continuations are skipped.
+Token lexer_scan(Lexer* lex) {
+    const char* src = lex->src;
+    int len = lex->len;
+    
+    while (lex->pos < len) {
+        char c = src[lex->pos];
+        if (c == ' ' || c == '\t' || c == '\r') {
+            lex->pos++;
+        } else if (c == '\\' && lex->pos + 1 < len && src[lex->pos + 1] == '\n') {
+            lex->pos += 2;
+        } else if (c == '#') {
+            while (lex->pos < len && src[lex->pos] != '\n') lex->pos++;
+        } else {
+            break;
         }
-        
-        cmd_start = pipe_positions[i] + 1;
     }
     
-    // Close all pipe fds in parent
-    for (int i = 0; i < 2 * pipe_count; i++) {
-        close(pipefds[i]);
+    Token tok;
+    tok.type = TOK_EOF;
+    tok.start = src + lex->pos;
+    tok.len = 0;
+    tok.io_number = -1;
+    
+    if (lex->pos >= len) {
+        if (lex->heredocs) {
+            // A here-document was started but its body has not been read
+            lex->incomplete = 1;
+        }
+        return tok;
     }
     
-    // Wait for all children
-    for (int i = 0; i <= pipe_count; i++) {
-        wait(NULL);
+    int op_len = is_subst_start(src, len, lex->pos) ? 0 : scan_operator(src, len, lex->pos, &tok);
+    if (op_len > 0) {
+        tok.len = op_len;
+        lex->pos += op_len;
+        if (tok.type == TOK_NEWLINE && lex->heredocs) {
+            lexer_read_heredocs(lex);
+        }
+        return tok;
     }
     
-    return 1;
-}
-
-// Execute command
-int execute_command(char** args) {
-    if (args[0] == NULL) {
-        return 1;
+    int end = scan_word(src, len, lex->pos);
+    if (end < 0) {
+        // Unterminated quote: the caller must supply more input
+        lex->incomplete = 1;
+        lex->pos = len;
+        tok.start = src + len;
+        return tok;
     }
     
-    // Check for built-in commands
-    for (int i = 0; i < num_builtins(); i++) {
-        if (strcmp(args[0], builtin_names[i]) == 0) {
-            return (*builtin_funcs[i])(args);
+    // A run of digits directly followed by < or > is a file descriptor (2>&1)
+    int all_digits = 1;
+    for (int i = lex->pos; i < end; i++) {
+        if (!isdigit((unsigned char)src[i])) {
+            all_digits = 0;
+            break;
+        }
+    }
+    if (all_digits && end - lex->pos < 4 && end < len && (src[end] == '<' || src[end] == '>')) {
+        int fd = 0;
+        for (int i = lex->pos; i < end; i++) {
+            fd = fd * 10 + (src[i] - '0');
         }
+        op_len = scan_operator(src, len, end, &tok);
+        tok.start = src + end;
+        tok.len = op_len;
+        tok.io_number = fd;
+        lex->pos = end + op_len;
+        return tok;
     }
     
-    // Check for pipes
-    if (execute_piped_commands(args) != -1) {
-        return 1;
+    tok.type = TOK_WORD;
+    tok.len = end - lex->pos;
+    lex->pos = end;
+    return tok;
+}
+
+// Consume the next token
+Token lexer_next(Lexer* lex) {
+    Token tok;
+    if (lex->has_peeked) {
+        lex->has_peeked = 0;
+        tok = lex->peeked;
+    } else {
+        tok = lexer_scan(lex);
+    }
+    lex->prev_end = tok.start + tok.len;
+    return tok;
+}
+
+Token lexer_peek(Lexer* lex) {
+    if (!lex->has_peeked) {
+        lex->peeked = lexer_scan(lex);
+        lex->has_peeked = 1;
     }
+    return lex->peeked;
+}
+
+// Record the source text a node was parsed from, up to the last consumed token
+void parse_set_text(Parser* p, Node* node, const char* start) {
+    node->text = start;
+    node->text_len = p->lex.prev_end > start ? (int)(p->lex.prev_end - start) : 0;
+}
+
+// Parser
+
+// Allocate zeroed memory owned by the parse
+void* parse_alloc(Parser* p, size_t size) {
+    void* ptr = arena_alloc(p->arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+// Grow an array owned by the parse, doubling its capacity
+void* parse_grow(Parser* p, void* array, int count, int* cap, size_t elem_size) {
+    return arena_grow(p->arena, array, count, cap, elem_size);
+}
+
+// Report a syntax error at tok. Running out of input inside a quote is not an
+// error; the caller is expected to read more and try again.
+void parse_error(Parser* p, Token tok) {
+    if (p->status != PARSE_OK) return;
     
-    // Execute external command
-    pid_t pid = fork();
+    if (p->lex.incomplete) {
+        p->status = PARSE_INCOMPLETE;
+        return;
+    }
     
-    if (pid == 0) {
-        // Child process
-        handle_redirection(args);
-        execvp(args[0], args);
-        perror("myshell");
-        exit(1);
-    } else if (pid < 0) {
-        perror("myshell");
+    p->status = PARSE_ERROR;
+    if (parse_quiet) {
+        return;
+    }
+    if (tok.type == TOK_EOF || tok.type == TOK_NEWLINE) {
+        fprintf(stderr, "myshell: syntax error near unexpected token `newline'\n");
     } else {
-        // Parent process
-        int status;
-        waitpid(pid, &status, 0);
+        fprintf(stderr, "myshell: syntax error near unexpected token `%.*s'\n", tok.len, tok.start);
     }
-    
-    return 1;
 }
 
-// Main shell loop
-void shell_loop() {
+// Operators like | and && may be followed by a newline; hitting the end of
+// input there means the command continues on the next line.
+int parse_continuation(Parser* p) {
+    while (lexer_peek(&p->lex).type == TOK_NEWLINE) {
+        lexer_next(&p->lex);
+    }
+    if (lexer_peek(&p->lex).type == TOK_EOF) {
+        p->status = PARSE_INCOMPLETE;
+        return 0;
+    }
+    return 1;
+}
+
+int is_redirect_op(TokenType type) {
+    return type >= TOK_LESS && type <= TOK_TLESS;
+}
+
+// Remove quotes from a here-document delimiter. Quoting any part of it means
+// the body is taken literally.
+void heredoc_delimiter(Parser* p, Redirect* redir) {
+    const char* s = redir->target.start;
+    int len = redir->target.len;
+    char* out = arena_alloc(p->arena, len + 1);
+    int n = 0;
+    char quote = 0;
+    
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (quote == '"' && c == '\\' && i + 1 < len &&
+                       (s[i + 1] == '$' || s[i + 1] == '`' || s[i + 1] == '"' || s[i + 1] == '\\')) {
+                out[n++] = s[++i];
+            } else {
+                out[n++] = c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            redir->quoted = 1;
+        } else if (c == '\\' && i + 1 < len) {
+            out[n++] = s[++i];
+            redir->quoted = 1;
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    redir->delimiter = out;
+}
+
+// NAME=value, with the name unquoted
+int is_assignment(Token tok) {
+    int name_len = var_name_length(tok.start, tok.len);
+    return name_len > 0 && name_len < tok.len && tok.start[name_len] == '=';
+}
+
+// Parse one redirection, starting at its operator, and append it to the list
+// *tail points into. Returns 0 after a syntax error.
+int parse_redirect(Parser* p, Redirect*** tail) {
+    Token tok = lexer_next(&p->lex);
+    Token target = lexer_next(&p->lex);
+    if (target.type != TOK_WORD) {
+        parse_error(p, target);
+        return 0;
+    }
+    
+    Redirect* redir = parse_alloc(p, sizeof(Redirect));
+    redir->op = tok.type;
+    if (tok.io_number >= 0) {
+        redir->fd = tok.io_number;
+    } else if (tok.type == TOK_LESS || tok.type == TOK_LESSAND || tok.type == TOK_LESSGREAT ||
+               tok.type == TOK_DLESS || tok.type == TOK_DLESSDASH || tok.type == TOK_TLESS) {
+        redir->fd = STDIN_FILENO;
+    } else {
+        redir->fd = STDOUT_FILENO;
+    }
+    redir->target.start = target.start;
+    redir->target.len = target.len;
+    if (tok.type == TOK_DLESS || tok.type == TOK_DLESSDASH) {
+        // The body is read when the lexer reaches the end of the line
+        heredoc_delimiter(p, redir);
+        *p->lex.heredoc_tail = redir;
+        p->lex.heredoc_tail = &redir->next_heredoc;
+    }
+    **tail = redir;
+    *tail = &redir->next;
+    return 1;
+}
+
+// simple_command := (WORD | redirect)+
+Node* parse_simple_command(Parser* p) {
+    Node* cmd = parse_alloc(p, sizeof(Node));
+    cmd->type = NODE_COMMAND;
+    const char* start = lexer_peek(&p->lex).start;
+    Redirect** tail = &cmd->redirects;
+    int cap = 0;
+    
+    while (1) {
+        Token tok = lexer_peek(&p->lex);
+        
+        if (tok.type == TOK_WORD) {
+            lexer_next(&p->lex);
+            cmd->words = parse_grow(p, cmd->words, cmd->word_count, &cap, sizeof(Word));
+            cmd->words[cmd->word_count].start = tok.start;
+            cmd->words[cmd->word_count].len = tok.len;
+            if (cmd->assign_count == cmd->word_count && is_assignment(tok)) {
+                cmd->assign_count++;
+            }
+            cmd->word_count++;
+        } else if (is_redirect_op(tok.type)) {
+            if (!parse_redirect(p, &tail)) return NULL;
+        } else {
+            break;
+        }
+    }
+    
+    if (cmd->word_count == 0 && cmd->redirects == NULL) {
+        parse_error(p, lexer_peek(&p->lex));
+        return NULL;
+    }
+    parse_set_text(p, cmd, start);
+    return cmd;
+}
+
+int token_is(Token tok, const char* word) {
+    return tok.type == TOK_WORD && tok.len == (int)strlen(word) &&
+           strncmp(tok.start, word, tok.len) == 0;
+}
+
+// Reserved words that end the list before them
+int is_list_end(Token tok) {
+    static const char* words[] = {"then", "do", "done", "fi", "elif", "else", "esac", "}"};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (token_is(tok, words[i])) return 1;
+    }
+    return tok.type == TOK_EOF || tok.type == TOK_RPAREN || tok.type == TOK_DSEMI;
+}
+
+// A token other than the one a compound command needs next. At the end of
+// the input the command continues on the next line.
+void parse_unexpected(Parser* p, Token tok) {
+    if (tok.type == TOK_EOF && p->status == PARSE_OK) {
+        p->status = PARSE_INCOMPLETE;
+    } else {
+        parse_error(p, tok);
+    }
+}
+
+// Consume the reserved word that must come next
+int parse_keyword(Parser* p, const char* word) {
+    Token tok = lexer_peek(&p->lex);
+    if (!token_is(tok, word)) {
+        parse_unexpected(p, tok);
+        return 0;
+    }
+    lexer_next(&p->lex);
+    return 1;
+}
+
+void parse_skip_newlines(Parser* p) {
+    while (lexer_peek(&p->lex).type == TOK_NEWLINE) {
+        lexer_next(&p->lex);
+    }
+}
+
+// A list inside a compound command, which needs at least one command
+Node* parse_body(Parser* p) {
+    Node* list = parse_list(p);
+    if (p->status != PARSE_OK) return NULL;
+    if (list->child_count == 0) {
+        parse_unexpected(p, lexer_peek(&p->lex));
+        return NULL;
+    }
+    return list;
+}
+
+// if_clause := 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+Node* parse_if(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_IF;
+    int cap = 0;
+    lexer_next(&p->lex);
+    
+    while (1) {
+        Node* cond = parse_body(p);
+        if (!cond || !parse_keyword(p, "then")) return NULL;
+        Node* body = parse_body(p);
+        if (!body) return NULL;
+        node->children = parse_grow(p, node->children, node->child_count, &cap, sizeof(Node*));
+        node->children[node->child_count++] = cond;
+        node->children = parse_grow(p, node->children, node->child_count, &cap, sizeof(Node*));
+        node->children[node->child_count++] = body;
+        if (!token_is(lexer_peek(&p->lex), "elif")) break;
+        lexer_next(&p->lex);
+    }
+    if (token_is(lexer_peek(&p->lex), "else")) {
+        lexer_next(&p->lex);
+        Node* body = parse_body(p);
+        if (!body) return NULL;
+        node->children = parse_grow(p, node->children, node->child_count, &cap, sizeof(Node*));
+        node->children[node->child_count++] = body;
+    }
+    return parse_keyword(p, "fi") ? node : NULL;
+}
+
+// while_clause := ('while' | 'until') list 'do' list 'done'
+Node* parse_while(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = token_is(lexer_next(&p->lex), "while") ? NODE_WHILE : NODE_UNTIL;
+    node->left = parse_body(p);
+    if (!node->left || !parse_keyword(p, "do")) return NULL;
+    node->right = parse_body(p);
+    if (!node->right || !parse_keyword(p, "done")) return NULL;
+    return node;
+}
+
+// for_clause := 'for' NAME linebreak ['in' WORD* (';' | NEWLINE)] linebreak 'do' list 'done'
+Node* parse_for(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_FOR;
+    lexer_next(&p->lex);
+    Token name = lexer_next(&p->lex);
+    if (name.type != TOK_WORD || !is_valid_name(name.start, name.len)) {
+        parse_unexpected(p, name);
+        return NULL;
+    }
+    node->name.start = name.start;
+    node->name.len = name.len;
+    
+    parse_skip_newlines(p);
+    Token tok = lexer_peek(&p->lex);
+    if (token_is(tok, "in")) {
+        lexer_next(&p->lex);
+        node->has_in = 1;
+        int cap = 0;
+        while ((tok = lexer_peek(&p->lex)).type == TOK_WORD) {
+            lexer_next(&p->lex);
+            node->words = parse_grow(p, node->words, node->word_count, &cap, sizeof(Word));
+            node->words[node->word_count].start = tok.start;
+            node->words[node->word_count].len = tok.len;
+            node->word_count++;
+        }
+        if (tok.type != TOK_SEMI && tok.type != TOK_NEWLINE) {
+            parse_unexpected(p, tok);
+            return NULL;
+        }
+        lexer_next(&p->lex);
+    } else if (tok.type == TOK_SEMI) {
+        lexer_next(&p->lex);
+    }
+    parse_skip_newlines(p);
+    if (!parse_keyword(p, "do")) return NULL;
+    node->left = parse_body(p);
+    if (!node->left || !parse_keyword(p, "done")) return NULL;
+    return node;
+}
+
+// case_clause := 'case' WORD linebreak 'in' linebreak
+//                (['('] WORD ('|' WORD)* ')' list [';;'] linebreak)* 'esac'
+Node* parse_case(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_CASE;
+    lexer_next(&p->lex);
+    Token subject = lexer_next(&p->lex);
+    if (subject.type != TOK_WORD) {
+        parse_unexpected(p, subject);
+        return NULL;
+    }
+    node->words = parse_alloc(p, sizeof(Word));
+    node->words[0].start = subject.start;
+    node->words[0].len = subject.len;
+    node->word_count = 1;
+    parse_skip_newlines(p);
+    if (!parse_keyword(p, "in")) return NULL;
+    
+    int cap = 0;
+    while (1) {
+        parse_skip_newlines(p);
+        Token tok = lexer_peek(&p->lex);
+        if (token_is(tok, "esac")) {
+            lexer_next(&p->lex);
+            return node;
+        }
+        if (tok.type == TOK_LPAREN) lexer_next(&p->lex);
+        
+        // The clause is a list whose words are its patterns
+        Node* clause = parse_alloc(p, sizeof(Node));
+        clause->type = NODE_LIST;
+        int word_cap = 0;
+        while (1) {
+            Token pattern = lexer_next(&p->lex);
+            if (pattern.type != TOK_WORD) {
+                parse_unexpected(p, pattern);
+                return NULL;
+            }
+            clause->words = parse_grow(p, clause->words, clause->word_count, &word_cap, sizeof(Word));
+            clause->words[clause->word_count].start = pattern.start;
+            clause->words[clause->word_count].len = pattern.len;
+            clause->word_count++;
+            Token sep = lexer_next(&p->lex);
+            if (sep.type == TOK_RPAREN) break;
+            if (sep.type != TOK_PIPE) {
+                parse_unexpected(p, sep);
+                return NULL;
+            }
+        }
+        Node* body = parse_list(p);
+        if (p->status != PARSE_OK) return NULL;
+        clause->children = body->children;
+        clause->child_count = body->child_count;
+        node->children = parse_grow(p, node->children, node->child_count, &cap, sizeof(Node*));
+        node->children[node->child_count++] = clause;
+        
+        tok = lexer_peek(&p->lex);
+        if (tok.type == TOK_DSEMI) {
+            lexer_next(&p->lex);
+        } else if (!token_is(tok, "esac")) {
+            parse_unexpected(p, tok);
+            return NULL;
+        }
+    }
+}
+
+// brace_group := '{' list '}'
+Node* parse_group(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_GROUP;
+    lexer_next(&p->lex);
+    node->left = parse_body(p);
+    if (!node->left || !parse_keyword(p, "}")) return NULL;
+    return node;
+}
+
+// subshell := '(' list ')'
+Node* parse_subshell(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_SUBSHELL;
+    lexer_next(&p->lex);
+    node->left = parse_body(p);
+    if (!node->left) return NULL;
+    Token tok = lexer_peek(&p->lex);
+    if (tok.type != TOK_RPAREN) {
+        parse_unexpected(p, tok);
+        return NULL;
+    }
+    lexer_next(&p->lex);
+    return node;
+}
+
+// Whether a word token is one the test is true for, like "-f" for test_is_unary
+int token_in(Token tok, int (*test)(const char*)) {
+    char text[4];
+    if (tok.type != TOK_WORD || tok.len >= (int)sizeof(text)) return 0;
+    memcpy(text, tok.start, tok.len);
+    text[tok.len] = '\0';
+    return test(text);
+}
+
+// The regular expression after =~ is one word taken straight from the
+// source, so unquoted ( ) and | in it are not operators. Whitespace outside
+// parentheses ends it, and it cannot go past the end of the line.
+int parse_cond_regex(Parser* p, Word* word) {
+    Lexer* lex = &p->lex;
+    const char* src = lex->src;
+    int len = lex->len;
+    int pos = lex->pos;
+    while (pos < len && (src[pos] == ' ' || src[pos] == '\t')) pos++;
+    int start = pos;
+    int depth = 0;
+    
+    while (pos < len) {
+        char c = src[pos];
+        if (c == '\n' || (depth == 0 && (c == ' ' || c == '\t'))) break;
+        if (c == '\\') {
+            pos += 2;
+            continue;
+        }
+        if (c == '\'' || c == '"') {
+            pos++;
+            while (pos < len && src[pos] != c) {
+                if (c == '"' && src[pos] == '\\') pos++;
+                pos++;
+            }
+            if (pos >= len) {
+                lex->incomplete = 1;
+                break;
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (depth == 0) break;
+            depth--;
+        }
+        pos++;
+    }
+    if (pos > len) pos = len;
+    lex->pos = pos;
+    lex->prev_end = src + pos;
+    if (pos == start || lex->incomplete) {
+        parse_unexpected(p, lexer_peek(lex));
+        return 0;
+    }
+    if (depth > 0) {
+        parse_error(p, lexer_peek(lex));
+        return 0;
+    }
+    word->start = src + start;
+    word->len = pos - start;
+    return 1;
+}
+
+Node* parse_cond_or(Parser* p);
+
+// cond_primary := '(' cond_or ')' | '!' cond_primary | WORD binary_op WORD
+//               | unary_op WORD | WORD
+Node* parse_cond_primary(Parser* p) {
+    parse_skip_newlines(p);
+    Token tok = lexer_next(&p->lex);
+    if (tok.type == TOK_LPAREN) {
+        Node* inner = parse_cond_or(p);
+        if (!inner) return NULL;
+        Token close = lexer_next(&p->lex);
+        if (close.type != TOK_RPAREN) {
+            parse_unexpected(p, close);
+            return NULL;
+        }
+        return inner;
+    }
+    if (tok.type != TOK_WORD || token_is(tok, "]]")) {
+        parse_unexpected(p, tok);
+        return NULL;
+    }
+    
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_COND;
+    if (token_is(tok, "!")) {
+        node->cond_op = COND_NOT;
+        node->left = parse_cond_primary(p);
+        return node->left ? node : NULL;
+    }
+    node->words = parse_alloc(p, 3 * sizeof(Word));
+    node->words[0].start = tok.start;
+    node->words[0].len = tok.len;
+    node->word_count = 1;
+    node->cond_op = COND_WORD;
+    
+    // An operator in second place makes a comparison, as in test
+    Token op = lexer_peek(&p->lex);
+    if (op.type == TOK_LESS || op.type == TOK_GREAT || token_is(op, "=~") || token_in(op, test_is_binary)) {
+        lexer_next(&p->lex);
+        node->cond_op = COND_BINARY;
+        node->words[1].start = op.start;
+        node->words[1].len = op.len;
+        node->word_count = 3;
+        if (token_is(op, "=~")) {
+            return parse_cond_regex(p, &node->words[2]) ? node : NULL;
+        }
+        Token right = lexer_next(&p->lex);
+        if (right.type != TOK_WORD || token_is(right, "]]")) {
+            parse_unexpected(p, right);
+            return NULL;
+        }
+        node->words[2].start = right.start;
+        node->words[2].len = right.len;
+    } else if (token_in(tok, test_is_unary)) {
+        if (op.type != TOK_WORD || token_is(op, "]]")) {
+            parse_unexpected(p, op);
+            return NULL;
+        }
+        lexer_next(&p->lex);
+        node->cond_op = COND_UNARY;
+        node->words[1].start = op.start;
+        node->words[1].len = op.len;
+        node->word_count = 2;
+    }
+    return node;
+}
+
+// cond_and := cond_primary ('&&' cond_primary)*
+Node* parse_cond_and(Parser* p) {
+    Node* left = parse_cond_primary(p);
+    while (left && lexer_peek(&p->lex).type == TOK_AND_IF) {
+        lexer_next(&p->lex);
+        Node* node = parse_alloc(p, sizeof(Node));
+        node->type = NODE_COND;
+        node->cond_op = COND_AND;
+        node->left = left;
+        node->right = parse_cond_primary(p);
+        if (!node->right) return NULL;
+        left = node;
+    }
+    return left;
+}
+
+// cond_or := cond_and ('||' cond_and)*
+Node* parse_cond_or(Parser* p) {
+    Node* left = parse_cond_and(p);
+    while (left && lexer_peek(&p->lex).type == TOK_OR_IF) {
+        lexer_next(&p->lex);
+        Node* node = parse_alloc(p, sizeof(Node));
+        node->type = NODE_COND;
+        node->cond_op = COND_OR;
+        node->left = left;
+        node->right = parse_cond_and(p);
+        if (!node->right) return NULL;
+        left = node;
+    }
+    return left;
+}
+
+// cond_command := '[[' cond_or ']]'. Inside, words are not split or
+// globbed, && || ( ) < > are part of the expression, and == matches a glob.
+Node* parse_cond(Parser* p) {
+    lexer_next(&p->lex);
+    Node* node = parse_cond_or(p);
+    if (!node) return NULL;
+    parse_skip_newlines(p);
+    return parse_keyword(p, "]]") ? node : NULL;
+}
+
+// Function names may use a few characters variable names cannot
+int is_function_name(const char* s, int len) {
+    if (len == 0 || isdigit((unsigned char)s[0])) return 0;
+    for (int i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && !strchr("_-.:", s[i])) return 0;
+    }
+    return 1;
+}
+
+int is_compound_start(Token tok) {
+    return token_is(tok, "if") || token_is(tok, "while") || token_is(tok, "until") ||
+           token_is(tok, "for") || token_is(tok, "case") || token_is(tok, "{") ||
+           tok.type == TOK_LPAREN;
+}
+
+// NAME followed by '(' starts a function definition
+int is_function_start(Parser* p) {
+    Token tok = lexer_peek(&p->lex);
+    if (tok.type != TOK_WORD || !is_function_name(tok.start, tok.len)) return 0;
+    const char* s = tok.start + tok.len;
+    const char* end = p->lex.src + p->lex.len;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    return s < end && *s == '(' && !(s + 1 < end && s[1] == '(');
+}
+
+// function_definition := NAME '(' ')' linebreak compound_command
+//                      | 'function' NAME ['(' ')'] linebreak compound_command
+Node* parse_function(Parser* p) {
+    Node* node = parse_alloc(p, sizeof(Node));
+    node->type = NODE_FUNCTION;
+    if (token_is(lexer_peek(&p->lex), "function")) lexer_next(&p->lex);
+    Token name = lexer_next(&p->lex);
+    if (name.type != TOK_WORD || !is_function_name(name.start, name.len)) {
+        parse_unexpected(p, name);
+        return NULL;
+    }
+    node->name.start = name.start;
+    node->name.len = name.len;
+    if (lexer_peek(&p->lex).type == TOK_LPAREN) {
+        lexer_next(&p->lex);
+        Token tok = lexer_next(&p->lex);
+        if (tok.type != TOK_RPAREN) {
+            parse_unexpected(p, tok);
+            return NULL;
+        }
+    }
+    parse_skip_newlines(p);
+    if (!is_compound_start(lexer_peek(&p->lex))) {
+        parse_unexpected(p, lexer_peek(&p->lex));
+        return NULL;
+    }
+    node->left = parse_command(p);
+    return p->status == PARSE_OK ? node : NULL;
+}
+
+// command := compound_command redirect* | function_definition | simple_command
+Node* parse_command(Parser* p) {
+    Token tok = lexer_peek(&p->lex);
+    const char* start = tok.start;
+    Node* node;
+    if (token_is(tok, "if")) {
+        node = parse_if(p);
+    } else if (token_is(tok, "while") || token_is(tok, "until")) {
+        node = parse_while(p);
+    } else if (token_is(tok, "for")) {
+        node = parse_for(p);
+    } else if (token_is(tok, "case")) {
+        node = parse_case(p);
+    } else if (token_is(tok, "{")) {
+        node = parse_group(p);
+    } else if (tok.type == TOK_LPAREN) {
+        node = parse_subshell(p);
+    } else if (token_is(tok, "[[")) {
+        node = parse_cond(p);
+    } else if (token_is(tok, "function") || is_function_start(p)) {
+        node = parse_function(p);
+        if (node) parse_set_text(p, node, start);
+        return node;
+    } else {
+        return parse_simple_command(p);
+    }
+    if (p->status != PARSE_OK) return NULL;
+    
+    Redirect** tail = &node->redirects;
+    while (is_redirect_op(lexer_peek(&p->lex).type)) {
+        if (!parse_redirect(p, &tail)) return NULL;
+    }
+    parse_set_text(p, node, start);
+    return node;
+}
+
+// pipeline := ['time' ['-p' | '-j']] ['!'] command ('|' linebreak command)*
+Node* parse_pipeline(Parser* p) {
+    int negate = 0;
+    TimeFormat timed = TIME_NONE;
+    Token tok = lexer_peek(&p->lex);
+    const char* start = tok.start;
+    if (token_is(tok, "time")) {
+        lexer_next(&p->lex);
+        timed = TIME_TABLE;
+        while (1) {
+            tok = lexer_peek(&p->lex);
+            if (token_is(tok, "-p")) {
+                timed = TIME_POSIX;
+            } else if (token_is(tok, "-j")) {
+                timed = TIME_JSON;
+            } else {
+                break;
+            }
+            lexer_next(&p->lex);
+        }
+        // The reports and job listings show the command without the prefix
+        start = tok.start;
+    }
+    if (token_is(tok, "!")) {
+        lexer_next(&p->lex);
+        negate = 1;
+    }
+    
+    Node* pipeline = NULL;
+    if (timed) {
+        pipeline = parse_alloc(p, sizeof(Node));
+        pipeline->type = NODE_PIPELINE;
+        pipeline->timed = timed;
+        // A bare "time" times nothing, as in bash
+        tok = lexer_peek(&p->lex);
+        if (!negate && tok.type != TOK_WORD && tok.type != TOK_LPAREN && !is_redirect_op(tok.type)) {
+            parse_set_text(p, pipeline, start);
+            return pipeline;
+        }
+    }
+    
+    Node* first = parse_command(p);
+    if (p->status != PARSE_OK) return NULL;
+    
+    if (!negate && !timed && lexer_peek(&p->lex).type != TOK_PIPE) {
+        return first;
+    }
+    
+    if (pipeline == NULL) {
+        pipeline = parse_alloc(p, sizeof(Node));
+        pipeline->type = NODE_PIPELINE;
+    }
+    pipeline->negate = negate;
+    int cap = 0;
+    pipeline->children = parse_grow(p, NULL, 0, &cap, sizeof(Node*));
+    pipeline->children[pipeline->child_count++] = first;
+    
+    while (lexer_peek(&p->lex).type == TOK_PIPE) {
+        lexer_next(&p->lex);
+        if (!parse_continuation(p)) return NULL;
+        
+        Node* stage = parse_command(p);
+        if (p->status != PARSE_OK) return NULL;
+        pipeline->children = parse_grow(p, pipeline->children, pipeline->child_count, &cap, sizeof(Node*));
+        pipeline->children[pipeline->child_count++] = stage;
+    }
+    parse_set_text(p, pipeline, start);
+    return pipeline;
+}
+
+// and_or := pipeline (('&&' | '||') linebreak pipeline)*
+Node* parse_and_or(Parser* p) {
+    const char* start = lexer_peek(&p->lex).start;
+    Node* left = parse_pipeline(p);
+    
+    while (p->status == PARSE_OK) {
+        Token tok = lexer_peek(&p->lex);
+        if (tok.type != TOK_AND_IF && tok.type != TOK_OR_IF) break;
+        lexer_next(&p->lex);
+        if (!parse_continuation(p)) return NULL;
+        
+        Node* right = parse_pipeline(p);
+        if (p->status != PARSE_OK) return NULL;
+        
+        Node* node = parse_alloc(p, sizeof(Node));
+        node->type = tok.type == TOK_AND_IF ? NODE_AND : NODE_OR;
+        node->left = left;
+        node->right = right;
+        parse_set_text(p, node, start);
+        left = node;
+    }
+    return left;
+}
+
+// list := and_or ((';' | '&' | NEWLINE) and_or)* [';' | '&']
+Node* parse_list(Parser* p) {
+    Node* list = parse_alloc(p, sizeof(Node));
+    list->type = NODE_LIST;
+    int cap = 0;
+    
+    while (p->status == PARSE_OK) {
+        Token tok = lexer_peek(&p->lex);
+        if (tok.type == TOK_NEWLINE) {
+            lexer_next(&p->lex);
+            continue;
+        }
+        if (is_list_end(tok)) break;
+        
+        Node* item = parse_and_or(p);
+        if (p->status != PARSE_OK) return NULL;
+        list->children = parse_grow(p, list->children, list->child_count, &cap, sizeof(Node*));
+        list->children[list->child_count++] = item;
+        
+        tok = lexer_peek(&p->lex);
+        if (tok.type == TOK_SEMI || tok.type == TOK_NEWLINE) {
+            lexer_next(&p->lex);
+        } else if (tok.type == TOK_AMP) {
+            lexer_next(&p->lex);
+            item->background = 1;
+        } else if (tok.type != TOK_EOF && tok.type != TOK_RPAREN && tok.type != TOK_DSEMI) {
+            parse_error(p, tok);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+// Parse a complete program into the arena. The tree points into src, which
+// must outlive it. Returns NULL with p->status set if the input is incomplete
+// or invalid.
+Node* parse_program(Parser* p, Arena* arena, const char* src, int len) {
+    memset(p, 0, sizeof(Parser));
+    p->arena = arena;
+    lexer_init(&p->lex, src, len);
+    
+    Node* program = parse_list(p);
+    if (p->status == PARSE_OK) {
+        Token tok = lexer_peek(&p->lex);
+        if (tok.type != TOK_EOF) {
+            parse_error(p, tok);
+        } else if (p->lex.incomplete) {
+            p->status = PARSE_INCOMPLETE;
+        }
+    }
+    return p->status == PARSE_OK ? program : NULL;
+}
+
+// Parse the next complete command of a script: the commands up to the end
+// of the line the last one ends on, with the bodies of their here-documents.
+// *used is set to the length consumed. Blank lines and comments alone give
+// an empty list.
+Node* parse_line(Parser* p, Arena* arena, const char* src, int len, int* used) {
+    memset(p, 0, sizeof(Parser));
+    p->arena = arena;
+    lexer_init(&p->lex, src, len);
+    Node* line = parse_alloc(p, sizeof(Node));
+    line->type = NODE_LIST;
+    int cap = 0;
+    
+    while (p->status == PARSE_OK) {
+        Token tok = lexer_peek(&p->lex);
+        if (tok.type == TOK_NEWLINE) {
+            lexer_next(&p->lex);
+            if (line->child_count > 0) break;
+            continue;
+        }
+        if (tok.type == TOK_EOF) break;
+        if (is_list_end(tok)) {
+            parse_error(p, tok);
+            break;
+        }
+        
+        Node* item = parse_and_or(p);
+        if (p->status != PARSE_OK) break;
+        line->children = parse_grow(p, line->children, line->child_count, &cap, sizeof(Node*));
+        line->children[line->child_count++] = item;
+        
+        tok = lexer_peek(&p->lex);
+        if (tok.type == TOK_SEMI) {
+            lexer_next(&p->lex);
+        } else if (tok.type == TOK_AMP) {
+            lexer_next(&p->lex);
+            item->background = 1;
+        } else if (tok.type != TOK_NEWLINE && tok.type != TOK_EOF) {
+            parse_error(p, tok);
+        }
+    }
+    if (p->status == PARSE_OK && p->lex.incomplete) {
+        p->status = PARSE_INCOMPLETE;
+    }
+    *used = p->lex.pos;
+    return p->status == PARSE_OK ? line : NULL;
+}
+
+// Check whether input ends in the middle of a command (open quote, trailing |)
+int parse_needs_more(char* input) {
+    Parser p;
+    ArenaMark mark = arena_mark(&cmd_arena);
+    parse_quiet = 1;
+    parse_program(&p, &cmd_arena, input, strlen(input));
+    parse_quiet = 0;
+    arena_release(&cmd_arena, mark);
+    return p.status == PARSE_INCOMPLETE;
+}
+
+// Patterns
+
+// Glob patterns for ${v#pat}, ${v/pat/rep} and similar. A pattern is compiled
+// once into a list of single-character steps and kept in a small cache, so a
+// loop applying the same pattern does not parse it again.
+
+typedef enum {
+    PAT_CHAR,   // one literal character
+    PAT_ANY,    // ?
+    PAT_STAR,   // *
+    PAT_CLASS   // [...]
+} PatOpType;
+
+typedef struct {
+    PatOpType type;
+    unsigned char c;
+    unsigned char set[32];  // PAT_CLASS: bitmap of the bytes it matches
+} PatOp;
+
+typedef struct {
+    char* source;
+    PatOp* ops;
+    int op_count;
+    int min_len;   // characters every match has
+    int has_star;
+    int literal;   // only PAT_CHAR steps; text holds them
+    char* text;
+} Pattern;
+
+#define PATTERN_CACHE_SIZE 64
+
+Pattern* pattern_cache[PATTERN_CACHE_SIZE];
+
+// Parse the bracket expression starting at the '[' at src[i] into set.
+// Returns the index of the closing ']', or -1 if it is not a bracket expression.
+int pattern_class(const char* src, int i, unsigned char* set) {
+    static const struct { const char* name; int (*test)(int); } named[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+        {"lower", islower}, {"space", isspace}, {"punct", ispunct}, {"xdigit", isxdigit},
+    };
+    memset(set, 0, 32);
+    i++;
+    int negate = src[i] == '!' || src[i] == '^';
+    if (negate) i++;
+    
+    int first = 1;
+    while (src[i] != '\0' && (src[i] != ']' || first)) {
+        first = 0;
+        if (src[i] == '[' && src[i + 1] == ':') {
+            const char* end = strstr(src + i + 2, ":]");
+            if (end) {
+                int name_len = end - (src + i + 2);
+                for (size_t k = 0; k < sizeof(named) / sizeof(named[0]); k++) {
+                    if ((int)strlen(named[k].name) == name_len &&
+                        strncmp(named[k].name, src + i + 2, name_len) == 0) {
+                        for (int b = 0; b < 256; b++) {
+                            if (named[k].test(b)) set[b / 8] |= 1 << (b % 8);
+                        }
+                    }
+                }
+                i = end - src + 2;
+                continue;
+            }
+        }
+        unsigned char lo = src[i];
+        if (lo == '\\' && src[i + 1] != '\0') lo = src[++i];
+        unsigned char hi = lo;
+        if (src[i + 1] == '-' && src[i + 2] != ']' && src[i + 2] != '\0') {
+            i += 2;
+            hi = src[i];
+            if (hi == '\\' && src[i + 1] != '\0') hi = src[++i];
+        }
+        for (int b = lo; b <= hi; b++) {
+            set[b / 8] |= 1 << (b % 8);
+        }
+        i++;
+    }
+    if (src[i] != ']') return -1;
+    if (negate) {
+        for (int b = 0; b < 32; b++) set[b] = ~set[b];
+    }
+    return i;
+}
+
+Pattern* pattern_compile(const char* source) {
+    int len = strlen(source);
+    Pattern* pat = calloc(1, sizeof(Pattern));
+    pat->source = strdup(source);
+    pat->ops = malloc((len + 1) * sizeof(PatOp));
+    pat->text = malloc(len + 1);
+    pat->literal = 1;
+    int text_len = 0;
+    
+    for (int i = 0; i < len; i++) {
+        PatOp* op = &pat->ops[pat->op_count];
+        char c = source[i];
+        if (c == '*') {
+            // Consecutive stars match the same as one
+            if (pat->op_count == 0 || pat->ops[pat->op_count - 1].type != PAT_STAR) {
+                op->type = PAT_STAR;
+                pat->op_count++;
+            }
+            pat->has_star = 1;
+            pat->literal = 0;
+            continue;
+        }
+        int class_end = c == '[' ? pattern_class(source, i, op->set) : -1;
+        if (c == '?') {
+            op->type = PAT_ANY;
+            pat->literal = 0;
+        } else if (class_end >= 0) {
+            op->type = PAT_CLASS;
+            pat->literal = 0;
+            i = class_end;
+        } else {
+            if (c == '\\' && i + 1 < len) c = source[++i];
+            op->type = PAT_CHAR;
+            op->c = c;
+            pat->text[text_len++] = c;
+        }
+        pat->op_count++;
+        pat->min_len++;
+    }
+    pat->text[text_len] = '\0';
+    return pat;
+}
+
+void pattern_free(Pattern* pat) {
+    free(pat->source);
+    free(pat->ops);
+    free(pat->text);
+    free(pat);
+}
+
+// Look up a compiled pattern, compiling it on a cache miss
+Pattern* pattern_get(const char* source) {
+    unsigned int slot = var_hash(source, strlen(source)) % PATTERN_CACHE_SIZE;
+    Pattern* pat = pattern_cache[slot];
+    if (pat && strcmp(pat->source, source) == 0) {
+        return pat;
+    }
+    if (pat) pattern_free(pat);
+    pat = pattern_compile(source);
+    pattern_cache[slot] = pat;
+    return pat;
+}
+
+// Whether the pattern matches all of s[0..len)
+int pattern_match(Pattern* pat, const char* s, int len) {
+    if (len < pat->min_len || (!pat->has_star && len != pat->min_len)) return 0;
+    if (pat->literal) return memcmp(s, pat->text, len) == 0;
+    
+    // On a mismatch, let the last star take one more character and retry
+    int p = 0, i = 0, star_p = -1, star_i = 0;
+    while (i < len) {
+        if (p < pat->op_count) {
+            PatOp* op = &pat->ops[p];
+            if (op->type == PAT_STAR) {
+                star_p = p++;
+                star_i = i;
+                continue;
+            }
+            unsigned char c = s[i];
+            if (op->type == PAT_ANY || (op->type == PAT_CHAR && op->c == c) ||
+                (op->type == PAT_CLASS && (op->set[c / 8] & (1 << (c % 8))))) {
+                p++;
+                i++;
+                continue;
+            }
+        }
+        if (star_p < 0) return 0;
+        p = star_p + 1;
+        i = ++star_i;
+    }
+    while (p < pat->op_count && pat->ops[p].type == PAT_STAR) p++;
+    return p == pat->op_count;
+}
+
+// Length of the prefix (or with suffix set, the suffix) of s the pattern
+// matches, the longest or the shortest one. Returns -1 if none does.
+int pattern_match_end(Pattern* pat, const char* s, int len, int suffix, int longest) {
+    if (pat->literal) {
+        int n = pat->min_len;
+        if (n > len) return -1;
+        return memcmp(suffix ? s + len - n : s, pat->text, n) == 0 ? n : -1;
+    }
+    for (int k = 0; k <= len - pat->min_len; k++) {
+        int n = longest ? len - k : pat->min_len + k;
+        if (pattern_match(pat, suffix ? s + len - n : s, n)) return n;
+    }
+    return -1;
+}
+
+// Find the leftmost, longest match of the pattern in s[from..len).
+// Returns its start and sets *match_len, or returns -1.
+int pattern_find(Pattern* pat, const char* s, int len, int from, int* match_len) {
+    if (pat->literal) {
+        if (pat->min_len == 0) return -1;
+        const char* found = memmem(s + from, len - from, pat->text, pat->min_len);
+        if (!found) return -1;
+        *match_len = pat->min_len;
+        return found - s;
+    }
+    for (int i = from; i + pat->min_len <= len; i++) {
+        int n = pattern_match_end(pat, s + i, len - i, 0, 1);
+        if (n > 0) {
+            *match_len = n;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Globbing
+
+// Pathname expansion for *.c, src/*/[a-z]*.h and recursive **. Leading
+// components without glob characters are joined into the starting directory
+// instead of being read, the other components are compiled once per
+// expansion, and directories are read with getdents64 so entry types come
+// from d_type instead of a stat per entry. A ** walk is spread over a pool of
+// threads, each working depth-first on its own queue of directories and
+// stealing the oldest entries of another queue when it runs dry.
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} DirEntry64;
+
+#define DIR_BUF_SIZE (64 * 1024)
+#define GLOB_MAX_THREADS 16
+
+// Paths found by a glob. They are malloc'd, as walker threads add to them.
+typedef struct {
+    char** items;
+    int count;
+    int cap;
+} PathList;
+
+typedef struct {
+    int fd;
+    char* buf;
+    long len;
+    long pos;
+} DirReader;
+
+// Directories waiting to be read by one walker thread
+typedef struct {
+    pthread_mutex_t lock;
+    char** items;
+    int head;
+    int count;
+    int cap;
+} WalkQueue;
+
+typedef struct {
+    Pattern* match;      // names to collect, or NULL for every entry
+    int dirs_only;       // collect directories only
+    int thread_count;
+    WalkQueue* queues;   // one per thread
+    PathList* found;     // one per thread
+    atomic_int pending;  // directories queued or being read
+} Walk;
+
+typedef struct {
+    Walk* walk;
+    int self;
+} WalkWorker;
+
+void path_list_add(PathList* list, char* path) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(char*));
+        if (!list->items) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = path;
+}
+
+void path_list_free(PathList* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    list->items = NULL;
+    list->count = list->cap = 0;
+}
+
+// Join a directory and an entry name. An empty directory is the current one.
+char* path_join(const char* dir, const char* name, int name_len) {
+    int dir_len = strlen(dir);
+    char* path = malloc(dir_len + name_len + 2);
+    if (!path) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    int n = dir_len;
+    memcpy(path, dir, dir_len);
+    if (n > 0 && path[n - 1] != '/') path[n++] = '/';
+    memcpy(path + n, name, name_len);
+    path[n + name_len] = '\0';
+    return path;
+}
+
+// Open a directory for dir_next; buf must hold DIR_BUF_SIZE bytes
+int dir_open(DirReader* dir, const char* path, char* buf) {
+    dir->fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir->buf = buf;
+    dir->len = 0;
+    dir->pos = 0;
+    return dir->fd;
+}
+
+// Next entry other than . and .., or NULL at the end of the directory
+DirEntry64* dir_next(DirReader* dir) {
+    for (;;) {
+        if (dir->pos >= dir->len) {
+            dir->len = syscall(SYS_getdents64, dir->fd, dir->buf, DIR_BUF_SIZE);
+            dir->pos = 0;
+            if (dir->len <= 0) return NULL;
+        }
+        DirEntry64* entry = (DirEntry64*)(dir->buf + dir->pos);
+        dir->pos += entry->d_reclen;
+        const char* name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        return entry;
+    }
+}
+
+// Whether an entry is a directory. Only file systems that leave d_type
+// unset, or a symbolic link with follow set, cost a stat.
+int dir_entry_is_dir(DirReader* dir, DirEntry64* entry, int follow) {
+    if (entry->d_type == DT_DIR) return 1;
+    if (entry->d_type != DT_UNKNOWN && !(follow && entry->d_type == DT_LNK)) return 0;
+    struct stat st;
+    if (fstatat(dir->fd, entry->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0) return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+// Names starting with a dot only match a pattern that starts with one
+int glob_hidden(Pattern* pat, const char* name) {
+    return name[0] == '.' &&
+           !(pat && pat->op_count > 0 && pat->ops[0].type == PAT_CHAR && pat->ops[0].c == '.');
+}
+
+void walk_push(WalkQueue* queue, char* path) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->cap) {
+        int new_cap = queue->cap ? queue->cap * 2 : 64;
+        char** grown = malloc(new_cap * sizeof(char*));
+        if (!grown) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+        for (int i = 0; i < queue->count; i++) {
+            grown[i] = queue->items[(queue->head + i) % queue->cap];
+        }
+        free(queue->items);
+        queue->items = grown;
+        queue->head = 0;
+        queue->cap = new_cap;
+    }
+    queue->items[(queue->head + queue->count) % queue->cap] = path;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the newest directory from a queue, or with steal set the oldest one,
+// which is likely to have the most left below it
+char* walk_take(WalkQueue* queue, int steal) {
+    char* path = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        if (steal) {
+            path = queue->items[queue->head];
+            queue->head = (queue->head + 1) % queue->cap;
+        } else {
+            path = queue->items[(queue->head + queue->count - 1) % queue->cap];
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return path;
+}
+
+// Read one directory: queue its subdirectories and collect matching entries.
+// Hidden directories are not entered.
+void walk_dir(Walk* walk, int self, const char* path, char* buf) {
+    DirReader dir;
+    if (dir_open(&dir, path, buf) < 0) return;
+    DirEntry64* entry;
+    while ((entry = dir_next(&dir))) {
+        const char* name = entry->d_name;
+        int name_len = strlen(name);
+        int is_dir = dir_entry_is_dir(&dir, entry, 0);
+        if (is_dir && name[0] != '.') {
+            atomic_fetch_add(&walk->pending, 1);
+            walk_push(&walk->queues[self], path_join(path, name, name_len));
+        }
+        if ((walk->dirs_only && !is_dir) || glob_hidden(walk->match, name)) continue;
+        if (walk->match && !pattern_match(walk->match, name, name_len)) continue;
+        path_list_add(&walk->found[self], path_join(path, name, name_len));
+    }
+    close(dir.fd);
+}
+
+void* walk_worker(void* arg) {
+    WalkWorker* worker = arg;
+    Walk* walk = worker->walk;
+    char* buf = malloc(DIR_BUF_SIZE);
+    if (!buf) return NULL;
+    while (atomic_load(&walk->pending) > 0) {
+        char* path = walk_take(&walk->queues[worker->self], 0);
+        for (int k = 1; !path && k < walk->thread_count; k++) {
+            path = walk_take(&walk->queues[(worker->self + k) % walk->thread_count], 1);
+        }
+        if (!path) {
+            sched_yield();
+            continue;
+        }
+        walk_dir(walk, worker->self, path, buf);
+        free(path);
+        atomic_fetch_sub(&walk->pending, 1);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Walk the tree below base on the thread pool, adding the entries it
+// collects to out. The calling thread takes part as the first worker.
+void glob_walk(const char* base, Pattern* match, int dirs_only, PathList* out) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : cpus;
+    Walk walk;
+    walk.match = match;
+    walk.dirs_only = dirs_only;
+    walk.thread_count = threads;
+    walk.queues = calloc(threads, sizeof(WalkQueue));
+    walk.found = calloc(threads, sizeof(PathList));
+    if (!walk.queues || !walk.found) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&walk.queues[i].lock, NULL);
+    }
+    atomic_init(&walk.pending, 1);
+    walk_push(&walk.queues[0], strdup(base));
+    
+    // Workers never take signals; SIGCHLD and friends stay with the shell
+    WalkWorker workers[GLOB_MAX_THREADS];
+    pthread_t ids[GLOB_MAX_THREADS];
+    int started = 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < threads; i++) {
+        workers[i].walk = &walk;
+        workers[i].self = i;
+        if (pthread_create(&ids[started], NULL, walk_worker, &workers[i]) == 0) started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    workers[0].walk = &walk;
+    workers[0].self = 0;
+    walk_worker(&workers[0]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    
+    for (int i = 0; i < threads; i++) {
+        for (int k = 0; k < walk.found[i].count; k++) {
+            path_list_add(out, walk.found[i].items[k]);
+        }
+        free(walk.found[i].items);
+        free(walk.queues[i].items);
+        pthread_mutex_destroy(&walk.queues[i].lock);
+    }
+    free(walk.found);
+    free(walk.queues);
+}
+
+// Whether a pattern has an unescaped glob character
+int glob_has_magic(const char* s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            s++;
+        } else if (*s == '*' || *s == '?' || *s == '[') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Remove the escapes from a pattern in place, leaving the text it matches
+void glob_unescape(char* s) {
+    char* out = s;
+    for (; *s; s++) {
+        if (*s == '\\' && s[1] != '\0') s++;
+        *out++ = *s;
+    }
+    *out = '\0';
+}
+
+// Match the components from index i on below dir, adding the paths found to
+// out. names holds each component without its escapes and pats its compiled
+// pattern, NULL for a literal component.
+void glob_components(const char* dir, char** names, Pattern** pats, int i, int count,
+                     PathList* out, char* buf) {
+    if (!pats[i]) {
+        char* path = path_join(dir, names[i], strlen(names[i]));
+        struct stat st;
+        if (i + 1 == count) {
+            if (lstat(path, &st) == 0) {
+                path_list_add(out, path);
+                return;
+            }
+        } else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            glob_components(path, names, pats, i + 1, count, out, buf);
+        }
+        free(path);
+        return;
+    }
+    
+    if (strcmp(names[i], "**") == 0) {
+        if (i + 1 == count) {
+            glob_walk(dir, NULL, 0, out);
+        } else if (i + 2 == count) {
+            // **/last: match the last component while walking
+            Pattern* last = pats[i + 1] ? pats[i + 1] : pattern_compile(names[i + 1]);
+            glob_walk(dir, last, 0, out);
+            if (!pats[i + 1]) pattern_free(last);
+        } else {
+            PathList dirs = {0};
+            path_list_add(&dirs, strdup(dir));
+            glob_walk(dir, NULL, 1, &dirs);
+            for (int k = 0; k < dirs.count; k++) {
+                glob_components(dirs.items[k], names, pats, i + 1, count, out, buf);
+            }
+            path_list_free(&dirs);
+        }
+        return;
+    }
+    
+    // Collect the matches before descending, which reuses buf
+    DirReader reader;
+    if (dir_open(&reader, dir, buf) < 0) return;
+    PathList matches = {0};
+    DirEntry64* entry;
+    while ((entry = dir_next(&reader))) {
+        const char* name = entry->d_name;
+        int name_len = strlen(name);
+        if (glob_hidden(pats[i], name) || !pattern_match(pats[i], name, name_len)) continue;
+        if (i + 1 < count && !dir_entry_is_dir(&reader, entry, 1)) continue;
+        path_list_add(i + 1 == count ? out : &matches, path_join(dir, name, name_len));
+    }
+    close(reader.fd);
+    for (int k = 0; k < matches.count; k++) {
+        glob_components(matches.items[k], names, pats, i + 1, count, out, buf);
+    }
+    path_list_free(&matches);
+}
+
+// Expand a glob pattern into the paths it matches, in sorted order. A
+// trailing slash only matches directories. Returns the number of paths added.
+int glob_expand(const char* pattern, PathList* out) {
+    char* copy = strdup(pattern);
+    int len = strlen(copy);
+    int dirs_only = 0;
+    while (len > 1 && copy[len - 1] == '/') {
+        copy[--len] = '\0';
+        dirs_only = 1;
+    }
+    
+    int count = 0;
+    char* names[len / 2 + 1];
+    char* saveptr = NULL;
+    for (char* part = strtok_r(copy, "/", &saveptr); part; part = strtok_r(NULL, "/", &saveptr)) {
+        names[count++] = part;
+    }
+    
+    // Join the literal leading components into the starting directory
+    char* dir = strdup(pattern[0] == '/' ? "/" : "");
+    int first = 0;
+    while (first < count && !glob_has_magic(names[first])) {
+        glob_unescape(names[first]);
+        char* joined = path_join(dir, names[first], strlen(names[first]));
+        free(dir);
+        dir = joined;
+        first++;
+    }
+    
+    int before = out->count;
+    if (first == count) {
+        struct stat st;
+        if (lstat(dir, &st) == 0) path_list_add(out, strdup(dir));
+    } else {
+        Pattern* pats[count];
+        for (int i = first; i < count; i++) {
+            pats[i] = NULL;
+            if (glob_has_magic(names[i])) {
+                pats[i] = pattern_compile(names[i]);
+            } else {
+                glob_unescape(names[i]);
+            }
+        }
+        char* buf = malloc(DIR_BUF_SIZE);
+        if (buf) glob_components(dir, names, pats, first, count, out, buf);
+        free(buf);
+        for (int i = first; i < count; i++) {
+            if (pats[i]) pattern_free(pats[i]);
+        }
+    }
+    free(dir);
+    free(copy);
+    
+    if (dirs_only) {
+        int kept = before;
+        for (int i = before; i < out->count; i++) {
+            struct stat st;
+            char* path = out->items[i];
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                int n = strlen(path);
+                path = realloc(path, n + 2);
+                if (!path) {
+                    fprintf(stderr, "myshell: allocation error\n");
+                    exit(1);
+                }
+                if (n == 0 || path[n - 1] != '/') strcpy(path + n, "/");
+                out->items[kept++] = path;
+            } else {
+                free(path);
+            }
+        }
+        out->count = kept;
+    }
+    if (out->count > before) {
+        qsort(out->items + before, out->count - before, sizeof(char*), compare_strings);
+    }
+    return out->count - before;
+}
+
+// Word expansion
+
+// Growable output buffer for expansion, allocated in the command arena
+typedef struct {
+    char* data;
+    int len;
+    int cap;
+} ExpandBuf;
+
+// Set while running the command of a $(...): the external command it starts
+// writes into a pipe drained into this buffer
+ExpandBuf* capture_output = NULL;
+
+void expand_reserve(ExpandBuf* buf, int extra) {
+    if (buf->len + extra + 1 <= buf->cap) return;
+    int cap = buf->cap * 2;
+    if (cap < buf->len + extra + 1) cap = buf->len + extra + 1;
+    char* data = arena_alloc(&cmd_arena, cap);
+    memcpy(data, buf->data, buf->len);
+    buf->data = data;
+    buf->cap = cap;
+}
+
+void expand_append(ExpandBuf* buf, const char* str, int len) {
+    expand_reserve(buf, len);
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+void expand_append_int(ExpandBuf* buf, long value) {
+    char num[24];
+    expand_append(buf, num, snprintf(num, sizeof(num), "%ld", value));
+}
+
+// Expand a reference inside ${...} to an array the shell keeps itself:
+// NAME, NAME[n], NAME[@] or NAME[*], #NAME and #NAME[@]. item() appends
+// element i. Returns 0 if the text is not such a reference.
+int expand_shell_array(const char* s, int len, const char* name, int item_count,
+                       void (*item)(ExpandBuf*, int), ExpandBuf* out) {
+    int count = 0;
+    if (len > 0 && s[0] == '#') {
+        count = 1;
+        s++;
+        len--;
+    }
+    int name_len = strlen(name);
+    if (len < name_len || strncmp(s, name, name_len) != 0) return 0;
+    
+    if (len == name_len) {
+        if (item_count == 0) {
+            if (count) expand_append_int(out, 0);
+        } else if (count) {
+            ExpandBuf first = {arena_alloc(&cmd_arena, 32), 0, 32};
+            item(&first, 0);
+            expand_append_int(out, first.len);
+        } else {
+            item(out, 0);
+        }
+        return 1;
+    }
+    if (s[name_len] != '[' || s[len - 1] != ']') return 0;
+    const char* index = s + name_len + 1;
+    int index_len = len - name_len - 2;
+    
+    if (index_len == 1 && (index[0] == '@' || index[0] == '*')) {
+        if (count) {
+            expand_append_int(out, item_count);
+            return 1;
+        }
+        for (int i = 0; i < item_count; i++) {
+            if (i > 0) expand_append(out, " ", 1);
+            item(out, i);
+        }
+        return 1;
+    }
+    if (count || index_len == 0) return 0;
+    for (int i = 0; i < index_len; i++) {
+        if (!isdigit((unsigned char)index[i])) return 0;
+    }
+    int n = atoi(index);
+    if (n < item_count) item(out, n);
+    return 1;
+}
+
+void pipe_status_item(ExpandBuf* out, int i) {
+    expand_append_int(out, pipe_status[i]);
+}
+
+void rematch_item(ExpandBuf* out, int i) {
+    expand_append(out, rematch[i], strlen(rematch[i]));
+}
+
+// ${PIPESTATUS[n]} and the other forms of expand_shell_array
+int expand_pipe_status(const char* s, int len, ExpandBuf* out) {
+    return expand_shell_array(s, len, "PIPESTATUS", pipe_status_count, pipe_status_item, out);
+}
+
+// ${BASH_REMATCH[n]}: what the last [[ =~ ]] matched and its groups
+int expand_rematch(const char* s, int len, ExpandBuf* out) {
+    return expand_shell_array(s, len, "BASH_REMATCH", rematch_count, rematch_item, out);
+}
+
+int expand_parameter(const char* s, int len, int i, ExpandBuf* out);
+void command_subst(const char* command, int len, ExpandBuf* out);
+
+// Index of the first c in s that is not quoted, escaped or inside ${...},
+// or len if there is none
+int find_unquoted(const char* s, int len, char c) {
+    for (int i = 0; i < len; i++) {
+        if (s[i] == c) return i;
+        if (s[i] == '\\') {
+            i++;
+        } else if (s[i] == '\'') {
+            i++;
+            while (i < len && s[i] != '\'') i++;
+        } else if (s[i] == '"') {
+            i++;
+            while (i < len && s[i] != '"') {
+                if (s[i] == '\\') i++;
+                i++;
+            }
+        } else if (s[i] == '$' && i + 1 < len && s[i + 1] == '{') {
+            int end = scan_brace(s, len, i + 1);
+            if (end < 0) return len;
+            i = end;
+        } else if (s[i] == '$' && i + 1 < len && s[i + 1] == '(') {
+            int end = scan_subst(s, len, i);
+            if (end < 0) return len;
+            i = end - 1;
+        }
+    }
+    return len;
+}
+
+// Expand an arithmetic expression and put the values of the variable names
+// in it in their place. Numbers are copied whole, so 0x1f stays a number.
+char* arith_source(const char* s, int len) {
+    Word word = {s, len};
+    char* text = expand_word(&word);
+    int text_len = strlen(text);
+    ExpandBuf expr = {arena_alloc(&cmd_arena, text_len + 1), 0, text_len + 1};
+    for (int i = 0; i < text_len; i++) {
+        if (isdigit((unsigned char)text[i])) {
+            int start = i;
+            while (i + 1 < text_len && (isalnum((unsigned char)text[i + 1]) || text[i + 1] == '_')) i++;
+            expand_append(&expr, text + start, i + 1 - start);
+            continue;
+        }
+        int name_len = var_name_length(text + i, text_len - i);
+        if (name_len == 0) {
+            expand_append(&expr, text + i, 1);
+            continue;
+        }
+        char* value = var_get(text + i, name_len);
+        expand_append(&expr, value && *value ? value : "0", value && *value ? strlen(value) : 1);
+        i += name_len - 1;
+    }
+    expr.data[expr.len] = '\0';
+    return expr.data;
+}
+
+// Integer arithmetic for $((...)) and ${NAME:offset:length}: intmax_t
+// values and C's operators and precedence, without assignment. The
+// calculator above works in floating point and is only for the prompt.
+typedef struct {
+    const char* p;
+    int error;           // ARITH_SYNTAX or ARITH_ZERO once something failed
+    int skip;            // inside the branch && || or ?: does not take
+} Arith;
+
+#define ARITH_SYNTAX 1
+#define ARITH_ZERO 2
+
+// Binary operators, longest first where one is a prefix of another, with
+// their precedence: 1 binds loosest
+static const struct {
+    const char* op;
+    int level;
+} arith_ops[] = {
+    {"**", 11}, {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7},
+    {"<<", 8}, {">>", 8}, {"|", 3}, {"^", 4}, {"&", 5}, {"<", 7}, {">", 7},
+    {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+};
+
+#define ARITH_LEVELS 10
+
+void arith_space(Arith* a) {
+    while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n') a->p++;
+}
+
+intmax_t arith_ternary(Arith* a);
+
+intmax_t arith_unary(Arith* a) {
+    arith_space(a);
+    char c = *a->p;
+    if (c == '(') {
+        a->p++;
+        intmax_t value = arith_ternary(a);
+        arith_space(a);
+        if (*a->p != ')') a->error = ARITH_SYNTAX;
+        else a->p++;
+        return value;
+    }
+    if (c == '-' || c == '+' || c == '!' || c == '~') {
+        a->p++;
+        intmax_t value = arith_unary(a);
+        if (c == '-') return (intmax_t)(0 - (uintmax_t)value);
+        if (c == '!') return !value;
+        if (c == '~') return ~value;
+        return value;
+    }
+    char* end;
+    errno = 0;
+    intmax_t value = strtoimax(a->p, &end, 0);
+    if (end == a->p || !isdigit((unsigned char)*a->p) || isalnum((unsigned char)*end) || *end == '_') {
+        a->error = ARITH_SYNTAX;
+        return 0;
+    }
+    a->p = end;
+    return value;
+}
+
+// a ** b, which groups from the right
+intmax_t arith_power(Arith* a) {
+    intmax_t base = arith_unary(a);
+    arith_space(a);
+    if (a->error || strncmp(a->p, "**", 2) != 0) return base;
+    a->p += 2;
+    intmax_t exponent = arith_power(a);
+    if (exponent < 0) {
+        if (!a->skip) a->error = ARITH_SYNTAX;
+        return 0;
+    }
+    uintmax_t result = 1, square = base;
+    for (; exponent > 0; exponent >>= 1) {
+        if (exponent & 1) result *= square;
+        square *= square;
+    }
+    return (intmax_t)result;
+}
+
+intmax_t arith_binary(Arith* a, int level) {
+    if (level > ARITH_LEVELS) return arith_power(a);
+    intmax_t left = arith_binary(a, level + 1);
+    while (!a->error) {
+        arith_space(a);
+        const char* op = NULL;
+        for (size_t k = 0; k < sizeof(arith_ops) / sizeof(arith_ops[0]); k++) {
+            size_t n = strlen(arith_ops[k].op);
+            if (strncmp(a->p, arith_ops[k].op, n) == 0) {
+                if (arith_ops[k].level == level) op = arith_ops[k].op;
+                break;
+            }
+        }
+        if (op == NULL) break;
+        a->p += strlen(op);
+        int lazy = (op[0] == '&' && op[1] == '&' && !left) || (op[0] == '|' && op[1] == '|' && left);
+        a->skip += lazy;
+        intmax_t right = arith_binary(a, level + 1);
+        a->skip -= lazy;
+        uintmax_t l = left, r = right;
+        switch (op[0] * 256 + op[1]) {
+            case '|' * 256 + '|': left = left || right; break;
+            case '&' * 256 + '&': left = left && right; break;
+            case '=' * 256 + '=': left = left == right; break;
+            case '!' * 256 + '=': left = left != right; break;
+            case '<' * 256 + '=': left = left <= right; break;
+            case '>' * 256 + '=': left = left >= right; break;
+            case '<' * 256 + '<': left = (intmax_t)(l << (r & 63)); break;
+            case '>' * 256 + '>': left = left >> (r & 63); break;
+            case '|' * 256: left = left | right; break;
+            case '^' * 256: left = left ^ right; break;
+            case '&' * 256: left = left & right; break;
+            case '<' * 256: left = left < right; break;
+            case '>' * 256: left = left > right; break;
+            case '+' * 256: left = (intmax_t)(l + r); break;
+            case '-' * 256: left = (intmax_t)(l - r); break;
+            case '*' * 256: left = (intmax_t)(l * r); break;
+            default:
+                if (right == 0) {
+                    if (!a->skip) a->error = ARITH_ZERO;
+                    left = 0;
+                } else if (right == -1) {
+                    // INTMAX_MIN / -1 overflows; wrap as the other operators do
+                    left = op[0] == '/' ? (intmax_t)(0 - l) : 0;
+                } else {
+                    left = op[0] == '/' ? left / right : left % right;
+                }
+        }
+    }
+    return left;
+}
+
+intmax_t arith_ternary(Arith* a) {
+    intmax_t cond = arith_binary(a, 1);
+    arith_space(a);
+    if (a->error || *a->p != '?') return cond;
+    a->p++;
+    a->skip += !cond;
+    intmax_t yes = arith_ternary(a);
+    a->skip -= !cond;
+    arith_space(a);
+    if (*a->p != ':') {
+        a->error = ARITH_SYNTAX;
+        return 0;
+    }
+    a->p++;
+    a->skip += !!cond;
+    intmax_t no = arith_ternary(a);
+    a->skip -= !!cond;
+    return cond ? yes : no;
+}
+
+// Evaluate the arithmetic expression in s. An empty one is 0. Text that
+// does not parse and division by zero are errors that fail the command, as
+// an unset ${NAME?} does; the result is then 0.
+intmax_t arith_evaluate(const char* s, int len) {
+    char* expr = arith_source(s, len);
+    Arith a = {expr, 0, 0};
+    arith_space(&a);
+    if (*a.p == '\0') return 0;
+    intmax_t value = arith_ternary(&a);
+    arith_space(&a);
+    if (!a.error && *a.p != '\0') a.error = ARITH_SYNTAX;
+    if (a.error) {
+        fprintf(stderr, "myshell: %s: %s\n", expr,
+                a.error == ARITH_ZERO ? "division by 0" : "arithmetic syntax error");
+        expand_failed = 1;
+        return 0;
+    }
+    return value;
+}
+
+// Evaluate an offset or length of ${NAME:offset:length}, an arithmetic
+// expression in which variable names stand for their values
+long expand_index(const char* s, int len) {
+    return (long)arith_evaluate(s, len);
+}
+
+// Expand $((expression))
+void expand_arith(const char* s, int len, ExpandBuf* out) {
+    intmax_t value = arith_evaluate(s, len);
+    if (expand_failed) return;
+    char digits[32];
+    expand_append(out, digits, snprintf(digits, sizeof(digits), "%" PRIdMAX, value));
+}
+
+// Append text to a pattern so that it only matches itself
+void pattern_append_literal(ExpandBuf* out, const char* s, int len) {
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == ']' || s[i] == '\\') {
+            expand_append(out, "\\", 1);
+        }
+        expand_append(out, s + i, 1);
+    }
+}
+
+// Append text to a regular expression so that it only matches itself
+void regex_append_literal(ExpandBuf* out, const char* s, int len) {
+    for (int i = 0; i < len; i++) {
+        if (strchr("\\.[]()*+?{}|^$", s[i])) {
+            expand_append(out, "\\", 1);
+        }
+        expand_append(out, s + i, 1);
+    }
+}
+
+// Expand a word that is a pattern of some kind. Quoted text, including
+// quoted expansions, matches literally: literal() appends it escaped.
+char* expand_match_source(const char* s, int len, void (*literal)(ExpandBuf*, const char*, int)) {
+    ExpandBuf out = {arena_alloc(&cmd_arena, len + 1), 0, len + 1};
+    int quoted = 0;
+    
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\'' && !quoted) {
+            int start = ++i;
+            while (i < len && s[i] != '\'') i++;
+            literal(&out, s + start, i - start);
+        } else if (c == '"') {
+            quoted = !quoted;
+        } else if (c == '\\' && i + 1 < len) {
+            char next = s[i + 1];
+            if (quoted && next != '$' && next != '`' && next != '"' && next != '\\') {
+                literal(&out, s + i, 1);
+            }
+            literal(&out, s + i + 1, 1);
+            i++;
+        } else if (c == '$') {
+            ExpandBuf value = {arena_alloc(&cmd_arena, 32), 0, 32};
+            int used = expand_parameter(s, len, i, &value);
+            if (used == 0) {
+                expand_append(&out, s + i, 1);
+                continue;
+            }
+            if (quoted) literal(&out, value.data, value.len);
+            else expand_append(&out, value.data, value.len);
+            i += used - 1;
+        } else if (quoted) {
+            literal(&out, s + i, 1);
+        } else {
+            expand_append(&out, s + i, 1);
+        }
+    }
+    out.data[out.len] = '\0';
+    return out.data;
+}
+
+// Expand the pattern of ${NAME#pattern}, a case clause or [[ == ]]
+char* expand_pattern(const char* s, int len) {
+    return expand_match_source(s, len, pattern_append_literal);
+}
+
+// Expand the regular expression of [[ =~ ]]
+char* expand_regex(const char* s, int len) {
+    return expand_match_source(s, len, regex_append_literal);
+}
+
+// ${NAME:offset} and ${NAME:offset:length}. A negative offset counts from
+// the end, as does a negative length.
+void expand_substring(const char* v, int v_len, const char* s, int len, ExpandBuf* out) {
+    int split = find_unquoted(s, len, ':');
+    long start = expand_index(s, split);
+    if (start < 0) start += v_len;
+    if (start < 0 || start > v_len) return;
+    
+    long end = v_len;
+    if (split < len) {
+        long count = expand_index(s + split + 1, len - split - 1);
+        end = count < 0 ? v_len + count : start + count;
+        if (end > v_len) end = v_len;
+    }
+    if (end > start) expand_append(out, v + start, end - start);
+}
+
+// ${NAME/pattern/string}: the first match is replaced, every match with //,
+// a match at the start with /# and one at the end with /%
+void expand_replace(const char* v, int v_len, const char* s, int len, ExpandBuf* out) {
+    char mode = '\0';
+    if (len > 0 && (s[0] == '/' || s[0] == '#' || s[0] == '%')) {
+        mode = s[0];
+        s++;
+        len--;
+    }
+    int split = find_unquoted(s, len, '/');
+    Pattern* pat = pattern_get(expand_pattern(s, split));
+    char* rep = "";
+    if (split < len) {
+        Word word = {s + split + 1, len - split - 1};
+        rep = expand_word(&word);
+    }
+    int rep_len = strlen(rep);
+    
+    if (mode == '#' || mode == '%') {
+        int n = pattern_match_end(pat, v, v_len, mode == '%', 1);
+        if (n < 0) {
+            expand_append(out, v, v_len);
+        } else if (mode == '#') {
+            expand_append(out, rep, rep_len);
+            expand_append(out, v + n, v_len - n);
+        } else {
+            expand_append(out, v, v_len - n);
+            expand_append(out, rep, rep_len);
+        }
+        return;
+    }
+    
+    int pos = 0;
+    int match_len;
+    int at;
+    while ((at = pattern_find(pat, v, v_len, pos, &match_len)) >= 0) {
+        expand_append(out, v + pos, at - pos);
+        expand_append(out, rep, rep_len);
+        pos = at + match_len;
+        if (mode != '/') break;
+    }
+    expand_append(out, v + pos, v_len - pos);
+}
+
+// ${NAME^}, ${NAME,}: change the case of the first character; ${NAME^^},
+// ${NAME,,} of all of them. A pattern after the operator limits the change
+// to the characters it matches.
+void expand_case(const char* v, int v_len, const char* s, int len, ExpandBuf* out) {
+    int upper = s[0] == '^';
+    int all = len > 1 && s[1] == s[0];
+    Pattern* pat = NULL;
+    if (len > 1 + all) {
+        pat = pattern_get(expand_pattern(s + 1 + all, len - 1 - all));
+    }
+    int start = out->len;
+    expand_append(out, v, v_len);
+    for (int i = start; i < out->len && (all || i == start); i++) {
+        char* c = &out->data[i];
+        if (pat && !pattern_match(pat, c, 1)) continue;
+        *c = upper ? toupper((unsigned char)*c) : tolower((unsigned char)*c);
+    }
+}
+
+// The special parameters $0..$9 (${10} and up inside braces), $#, $@ and $*.
+// Sets *value, NULL for a parameter past the last one, and returns the length
+// of the name, or 0 if s does not start with one.
+int special_param(const char* s, int len, int braced, char** value) {
+    if (len == 0) return 0;
+    if (isdigit((unsigned char)s[0])) {
+        int n = 1;
+        while (braced && n < len && isdigit((unsigned char)s[n])) n++;
+        long index = strtol(arena_strndup(&cmd_arena, s, n), NULL, 10);
+        if (index == 0) {
+            *value = shell_name;
+        } else {
+            *value = index <= positional_count ? positional[index - 1] : NULL;
+        }
+        return n;
+    }
+    if (s[0] == '$') {
+        char num[16];
+        snprintf(num, sizeof(num), "%d", (int)shell_pid);
+        *value = arena_strdup(&cmd_arena, num);
+        return 1;
+    }
+    if (s[0] == '#') {
+        char num[16];
+        snprintf(num, sizeof(num), "%d", positional_count);
+        *value = arena_strdup(&cmd_arena, num);
+        return 1;
+    }
+    if (s[0] == '@' || s[0] == '*') {
+        ExpandBuf joined = {arena_alloc(&cmd_arena, 64), 0, 64};
+        for (int i = 0; i < positional_count; i++) {
+            if (i > 0) expand_append(&joined, " ", 1);
+            expand_append(&joined, positional[i], strlen(positional[i]));
+        }
+        expand_append(&joined, "", 1);
+        *value = joined.data;
+        return 1;
+    }
+    return 0;
+}
+
+// Expand the inside of ${...} when it refers to a variable: ${NAME},
+// ${#NAME}, ${NAME-word} and the other default forms, substrings, pattern
+// removal and replacement, and case conversion. All of it runs in the
+// shell, so scripts need no sed, cut or basename for string slicing.
+// Returns 0 if it is not such a reference.
+int expand_braced_var(const char* s, int len, ExpandBuf* out) {
+    char* value;
+    if (len > 1 && s[0] == '#') {
+        if (special_param(s + 1, len - 1, 1, &value) != len - 1) {
+            if (!is_valid_name(s + 1, len - 1)) return 0;
+            value = var_get(s + 1, len - 1);
+        }
+        expand_append_int(out, value ? (long)strlen(value) : 0);
+        return 1;
+    }
+    
+    int name_len = special_param(s, len, 1, &value);
+    if (name_len == 0) {
+        name_len = var_name_length(s, len);
+        if (name_len == 0) return 0;
+        value = var_get(s, name_len);
+    }
+    const char* v = value ? value : "";
+    int v_len = strlen(v);
+    if (name_len == len) {
+        expand_append(out, v, v_len);
+        return 1;
+    }
+    
+    const char* op = s + name_len;
+    int rest = len - name_len;
+    int colon = op[0] == ':' && rest > 1 && (op[1] == '-' || op[1] == '=' || op[1] == '+' || op[1] == '?');
+    char kind = op[colon];
+    
+    switch (kind) {
+        case '-':
+        case '=':
+        case '+': {
+            // ${NAME-word} uses word if NAME is unset, ${NAME=word} also
+            // assigns it and ${NAME+word} uses it if NAME is set. With ':'
+            // an empty value counts as unset.
+            int set = value && (!colon || *value);
+            Word word = {op + colon + 1, rest - colon - 1};
+            if (kind == '+') {
+                if (set) {
+                    char* text = expand_word(&word);
+                    expand_append(out, text, strlen(text));
+                }
+            } else if (set) {
+                expand_append(out, v, v_len);
+            } else {
+                char* text = expand_word(&word);
+                if (kind == '=') var_assign(s, name_len, text, 0);
+                expand_append(out, text, strlen(text));
+            }
+            return 1;
+        }
+        case '?': {
+            // ${NAME?message} fails the command if NAME is unset, ${NAME:?}
+            // also if it is empty
+            if (value && (!colon || *value)) {
+                expand_append(out, v, v_len);
+                return 1;
+            }
+            Word word = {op + colon + 1, rest - colon - 1};
+            char* text = word.len > 0 ? expand_word(&word) : colon ? "parameter null or not set" : "parameter not set";
+            fprintf(stderr, "myshell: %.*s: %s\n", name_len, s, text);
+            expand_failed = 1;
+            return 1;
+        }
+        case ':':
+            expand_substring(v, v_len, op + 1, rest - 1, out);
+            return 1;
+        case '#':
+        case '%': {
+            // # removes the shortest matching prefix, ## the longest; % and
+            // %% do the same for suffixes
+            int longest = rest > 1 && op[1] == kind;
+            Pattern* pat = pattern_get(expand_pattern(op + 1 + longest, rest - 1 - longest));
+            int n = pattern_match_end(pat, v, v_len, kind == '%', longest);
+            if (n < 0) n = 0;
+            expand_append(out, kind == '#' ? v + n : v, v_len - n);
+            return 1;
+        }
+        case '/':
+            expand_replace(v, v_len, op + 1, rest - 1, out);
+            return 1;
+        case '^':
+        case ',':
+            expand_case(v, v_len, op, rest, out);
+            return 1;
+    }
+    return 0;
+}
+
+// Expand a parameter reference starting at the '$' at s[i]. Returns the
+// number of characters consumed, or 0 if the '$' is to be kept literally.
+int expand_parameter(const char* s, int len, int i, ExpandBuf* out) {
+    if (i + 1 >= len) return 0;
+    char c = s[i + 1];
+    
+    char* param;
+    if (special_param(s + i + 1, len - i - 1, 0, &param)) {
+        if (param) expand_append(out, param, strlen(param));
+        return 2;
+    }
+    if (c == '?') {
+        expand_append_int(out, last_status);
+        return 2;
+    }
+    if (c == '!') {
+        if (last_background_pid > 0) expand_append_int(out, last_background_pid);
+        return 2;
+    }
+    if (c == '(') {
+        int end = scan_subst(s, len, i);
+        if (end < 0) return 0;
+        // $((...)) is arithmetic when its inner parentheses close just
+        // before the outer one; $( (list) ) is a subshell
+        if (s[i + 2] == '(' && scan_subst(s, len, i + 1) == end - 1) {
+            expand_arith(s + i + 3, end - i - 5, out);
+            return end - i;
+        }
+        command_subst(s + i + 2, end - i - 3, out);
+        return end - i;
+    }
+    if (c == '{') {
+        int end = scan_brace(s, len, i + 1);
+        if (end < 0) return 0;
+        const char* name = s + i + 2;
+        int name_len = end - (i + 2);
+        if (name_len == 1 && (name[0] == '?' || name[0] == '!')) {
+            return expand_parameter(s, len, end - 2, out) ? end + 1 - i : 0;
+        }
+        if (expand_pipe_status(name, name_len, out) || expand_rematch(name, name_len, out) ||
+            expand_braced_var(name, name_len, out)) {
+            return end + 1 - i;
+        }
+        return 0;
+    }
+    
+    int name_len = var_name_length(s + i + 1, len - i - 1);
+    if (name_len == 0) return 0;
+    if (name_len == 10 && strncmp(s + i + 1, "PIPESTATUS", 10) == 0) {
+        expand_pipe_status(s + i + 1, 10, out);
+    } else if (name_len == 12 && strncmp(s + i + 1, "BASH_REMATCH", 12) == 0) {
+        expand_rematch(s + i + 1, 12, out);
+    } else {
+        char* value = var_get(s + i + 1, name_len);
+        if (value) expand_append(out, value, strlen(value));
+    }
+    return name_len + 1;
+}
+
+// Expand a `command` substitution starting at s[i]. Inside the backquotes a
+// backslash only escapes $, ` and \. Returns the number of characters
+// consumed, or 0 if there is no closing backquote.
+int expand_backquote(const char* s, int len, int i, ExpandBuf* out) {
+    int end = scan_backquote(s, len, i);
+    if (end < 0) return 0;
+    char* command = arena_alloc(&cmd_arena, end - i);
+    int n = 0;
+    for (int j = i + 1; j < end - 1; j++) {
+        if (s[j] == '\\' && j + 1 < end - 1 && (s[j + 1] == '$' || s[j + 1] == '`' || s[j + 1] == '\\')) {
+            j++;
+        }
+        command[n++] = s[j];
+    }
+    command_subst(command, n, out);
+    return end - i;
+}
+
+// Set up a process substitution: create its pipe and queue the command.
+// Returns the descriptor the word refers to, or -1 after printing an error.
+int proc_subst_new(const char* command, int len, int output) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "myshell: pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    if (proc_subst_count == proc_subst_cap) {
+        proc_subst_cap = proc_subst_cap ? proc_subst_cap * 2 : 4;
+        proc_substs = realloc(proc_substs, proc_subst_cap * sizeof(ProcSubst));
+        if (!proc_substs) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    ProcSubst* subst = &proc_substs[proc_subst_count++];
+    subst->command = arena_strndup(&cmd_arena, command, len);
+    subst->output = output;
+    subst->other = output ? fds[0] : fds[1];
+    // Keep the user's end away from low numbers a redirection like 3>file
+    // might name, as bash does
+    subst->fd = fcntl(output ? fds[1] : fds[0], F_DUPFD_CLOEXEC, 63);
+    close(output ? fds[1] : fds[0]);
+    return subst->fd;
+}
+
+// Append text taken literally; in pattern form its glob characters are escaped
+void expand_literal(ExpandBuf* out, const char* s, int len, int* glob) {
+    if (glob) {
+        pattern_append_literal(out, s, len);
+    } else {
+        expand_append(out, s, len);
+    }
+}
+
+// Put the expansion result in out->data[from..len) into pattern form. Quoted
+// results match literally. In unquoted ones only backslashes are escaped, so
+// their glob characters stay active and set *glob.
+void expand_protect(ExpandBuf* out, int from, int quoted, int* glob) {
+    int special = 0;
+    for (int i = from; i < out->len; i++) {
+        char c = out->data[i];
+        if (c == '*' || c == '?' || c == '[' || c == ']') {
+            if (quoted) special = 1;
+            else if (c != ']') *glob = 1;
+        } else if (c == '\\') {
+            special = 1;
+        }
+    }
+    if (!special) return;
+    int len = out->len - from;
+    char* text = arena_strndup(&cmd_arena, out->data + from, len);
+    out->len = from;
+    if (quoted) {
+        pattern_append_literal(out, text, len);
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        if (text[i] == '\\') expand_append(out, "\\", 1);
+        expand_append(out, text + i, 1);
+    }
+}
+
+// Where field splitting cuts an expanded word: the separators found in the
+// results of unquoted substitutions, as ranges of the output
+typedef struct {
+    int start;
+    int end;
+    int keep;           // the field before the cut stays even if it is empty
+} FieldCut;
+
+typedef struct {
+    FieldCut* items;
+    int count;
+    int cap;
+    int quoted;         // the current field has quotes, so it is never dropped
+} FieldCuts;
+
+// Find the IFS separators in the substitution result in out->data[from..len).
+// A run of IFS whitespace is one separator; any other IFS character is a
+// separator of its own with the whitespace around it, and delimits a field
+// even when that field is empty. In pattern form backslashes come in escape
+// pairs and never separate.
+void field_cut(ExpandBuf* out, int from, int pattern, FieldCuts* cuts) {
+    char* ifs = var_lookup("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+    if (*ifs == '\0') return;
+    #define FIELD_IS_IFS(c) ((c) != '\0' && (c) != '\\' && strchr(ifs, (c)))
+    #define FIELD_IS_SPACE(c) (FIELD_IS_IFS(c) && isspace((unsigned char)(c)))
+    const char* s = out->data;
+    for (int i = from; i < out->len; i++) {
+        if (pattern && s[i] == '\\') {
+            i++;
+            continue;
+        }
+        if (!FIELD_IS_IFS(s[i])) continue;
+        int start = i;
+        while (i < out->len && FIELD_IS_SPACE(s[i])) i++;
+        int hard = i < out->len && FIELD_IS_IFS(s[i]);
+        if (hard) {
+            i++;
+            while (i < out->len && FIELD_IS_SPACE(s[i])) i++;
+        }
+        cuts->items = arena_grow(&cmd_arena, cuts->items, cuts->count, &cuts->cap, sizeof(FieldCut));
+        cuts->items[cuts->count++] = (FieldCut){start, i, hard || cuts->quoted};
+        cuts->quoted = 0;
+        i--;
+    }
+    #undef FIELD_IS_IFS
+    #undef FIELD_IS_SPACE
+}
+
+// Expand a word into out: quotes are removed, escapes resolved, variables,
+// $?, $! and PIPESTATUS substituted and $(...) and `...` replaced by the
+// output of their commands. <(cmd) and >(cmd) become /dev/fd/N.
+// With glob set the text is left in pattern form for pathname expansion:
+// quoted glob characters and backslashes are escaped, and *glob is set if an
+// unquoted glob character remains. With cuts set, the results of unquoted
+// substitutions are scanned for where field splitting divides the word.
+void expand_word_into(Word* word, ExpandBuf* out, int* glob, FieldCuts* cuts) {
+    const char* s = word->start;
+    int len = word->len;
+    
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\'') {
+            i++;
+            int start = i;
+            while (i < len && s[i] != '\'') i++;
+            expand_literal(out, s + start, i - start, glob);
+            if (cuts) cuts->quoted = 1;
+        } else if (c == '"') {
+            if (cuts) cuts->quoted = 1;
+            i++;
+            while (i < len && s[i] != '"') {
+                // Inside double quotes a backslash only escapes $ ` " \ and newline
+                if (s[i] == '\\' && i + 1 < len &&
+                    (s[i + 1] == '$' || s[i + 1] == '`' || s[i + 1] == '"' ||
+                     s[i + 1] == '\\' || s[i + 1] == '\n')) {
+                    if (s[i + 1] != '\n') expand_literal(out, s + i + 1, 1, glob);
+                    i += 2;
+                } else if (s[i] == '$' || s[i] == '`') {
+                    int before = out->len;
+                    int used = s[i] == '$' ? expand_parameter(s, len, i, out)
+                                           : expand_backquote(s, len, i, out);
+                    if (used == 0) expand_append(out, s + i, 1);
+                    else if (glob) expand_protect(out, before, 1, glob);
+                    i += used ? used : 1;
+                } else {
+                    expand_literal(out, s + i, 1, glob);
+                    i++;
+                }
+            }
+        } else if (c == '\\' && i + 1 < len) {
+            i++;
+            if (s[i] != '\n') expand_literal(out, s + i, 1, glob);
+        } else if (c == '$' || c == '`') {
+            int before = out->len;
+            int used = c == '$' ? expand_parameter(s, len, i, out) : expand_backquote(s, len, i, out);
+            if (used == 0) {
+                expand_append(out, s + i, 1);
+            } else {
+                if (glob) expand_protect(out, before, 0, glob);
+                if (cuts) field_cut(out, before, glob != NULL, cuts);
+                i += used - 1;
+            }
+        } else if (is_subst_start(s, len, i)) {
+            int end = scan_subst(s, len, i);
+            int fd = proc_subst_new(s + i + 2, end - i - 3, c == '>');
+            if (fd >= 0) {
+                char path[32];
+                expand_append(out, path, snprintf(path, sizeof(path), "/dev/fd/%d", fd));
+            }
+            i = end - 1;
+        } else {
+            if (glob && (c == '*' || c == '?' || c == '[')) *glob = 1;
+            expand_append(out, s + i, 1);
+        }
+    }
+}
+
+// Expand a word into its final text, which lives in the command arena
+char* expand_word(Word* word) {
+    ExpandBuf out = {arena_alloc(&cmd_arena, word->len + 1), 0, word->len + 1};
+    expand_word_into(word, &out, NULL, NULL);
+    out.data[out.len] = '\0';
+    return out.data;
+}
+
+// Growable argv in the command arena
+typedef struct {
+    char** items;
+    int count;
+    int cap;
+} ArgList;
+
+void arg_list_add(ArgList* list, char* arg) {
+    if (list->count == list->cap) {
+        int new_cap = list->cap ? list->cap * 2 : 8;
+        char** grown = arena_alloc(&cmd_arena, new_cap * sizeof(char*));
+        if (list->count > 0) {
+            memcpy(grown, list->items, list->count * sizeof(char*));
+        }
+        list->items = grown;
+        list->cap = new_cap;
+    }
+    list->items[list->count++] = arg;
+}
+
+// Step over a quoted string, an escape or a substitution starting at s[i],
+// which brace expansion leaves alone. Returns the index of its last
+// character, or i if nothing starts there.
+int brace_skip(const char* s, int len, int i) {
+    char c = s[i];
+    int end = i;
+    if (c == '\\') {
+        end = i + 1;
+    } else if (c == '\'') {
+        end = i + 1;
+        while (end < len && s[end] != '\'') end++;
+    } else if (c == '"') {
+        end = i + 1;
+        while (end < len && s[end] != '"') {
+            if (s[end] == '\\') end++;
+            end++;
+        }
+    } else if (c == '$' && i + 1 < len && s[i + 1] == '{') {
+        end = scan_brace(s, len, i + 1);
+    } else if ((c == '$' && i + 1 < len && s[i + 1] == '(') || is_subst_start(s, len, i)) {
+        end = scan_subst(s, len, i) - 1;
+    } else if (c == '`') {
+        end = scan_backquote(s, len, i) - 1;
+    }
+    if (end < i) return len - 1;
+    return end < len ? end : len - 1;
+}
+
+// Parse one end of a {x..y} sequence: an integer or a single character.
+// Sets *width when the number is written with leading zeros.
+int brace_endpoint(const char* s, int len, long* value, int* is_char, int* width) {
+    if (len == 1 && !isdigit((unsigned char)s[0])) {
+        *value = (unsigned char)s[0];
+        *is_char = 1;
+        return 1;
+    }
+    char* end;
+    char* text = arena_strndup(&cmd_arena, s, len);
+    *value = strtol(text, &end, 10);
+    if (len == 0 || *end != '\0' || !isdigit((unsigned char)text[len - 1])) return 0;
+    *is_char = 0;
+    int digits = text[0] == '-' || text[0] == '+' ? 1 : 0;
+    if (text[digits] == '0' && len - digits > 1 && len > *width) *width = len;
+    return 1;
+}
+
+// Generate the items of a sequence body x..y or x..y..step. Returns 0 if the
+// body is not a sequence.
+int brace_sequence(const char* s, int len, ArgList* items) {
+    const char* dots = memmem(s, len, "..", 2);
+    if (!dots) return 0;
+    const char* second = memmem(dots + 2, s + len - dots - 2, "..", 2);
+    const char* end = second ? second : s + len;
+    long first, last, step = 1;
+    int first_char, last_char, width = 0;
+    if (!brace_endpoint(s, dots - s, &first, &first_char, &width) ||
+        !brace_endpoint(dots + 2, end - dots - 2, &last, &last_char, &width) ||
+        first_char != last_char) {
+        return 0;
+    }
+    if (second) {
+        int step_char, step_width = 0;
+        if (!brace_endpoint(second + 2, s + len - second - 2, &step, &step_char, &step_width) ||
+            step_char) {
+            return 0;
+        }
+        if (step < 0) step = -step;
+        if (step == 0) step = 1;
+    }
+    if (first > last) step = -step;
+    if (width > 20) width = 20;
+    for (long v = first; step > 0 ? v <= last : v >= last; v += step) {
+        char item[32];
+        int n;
+        if (first_char) {
+            n = snprintf(item, sizeof(item), "%c", (int)v);
+        } else if (width > 0 && v < 0) {
+            n = snprintf(item, sizeof(item), "-%0*ld", width - 1, -v);
+        } else {
+            n = snprintf(item, sizeof(item), "%0*ld", width, v);
+        }
+        arg_list_add(items, arena_strndup(&cmd_arena, item, n));
+    }
+    return 1;
+}
+
+// Brace expansion: a{b,c}d becomes abd acd and x{1..3} x1 x2 x3, before any
+// other expansion. The words produced are added to out as raw text.
+void brace_expand(const char* s, int len, ArgList* out) {
+    for (int open = 0; open < len; open++) {
+        if (s[open] != '{') {
+            open = brace_skip(s, len, open);
+            continue;
+        }
+        // Find the matching brace and split at the commas at its level
+        ArgList items = {0};
+        int depth = 0, close = -1, item_start = open + 1;
+        for (int i = open + 1; i < len && close < 0; i++) {
+            if (s[i] == '{') {
+                depth++;
+            } else if (s[i] == '}') {
+                if (depth-- == 0) close = i;
+            } else if (s[i] == ',' && depth == 0) {
+                arg_list_add(&items, arena_strndup(&cmd_arena, s + item_start, i - item_start));
+                item_start = i + 1;
+            } else {
+                i = brace_skip(s, len, i);
+            }
+        }
+        if (close < 0) break;
+        if (items.count > 0) {
+            arg_list_add(&items, arena_strndup(&cmd_arena, s + item_start, close - item_start));
+        } else if (!brace_sequence(s + open + 1, close - open - 1, &items)) {
+            continue;
+        }
+        
+        // Expand each alternative in place; later braces are handled by the
+        // recursive call
+        for (int k = 0; k < items.count; k++) {
+            int item_len = strlen(items.items[k]);
+            int word_len = open + item_len + len - close - 1;
+            char* word = arena_alloc(&cmd_arena, word_len + 1);
+            memcpy(word, s, open);
+            memcpy(word + open, items.items[k], item_len);
+            memcpy(word + open + item_len, s + close + 1, len - close - 1);
+            word[word_len] = '\0';
+            brace_expand(word, word_len, out);
+        }
+        return;
+    }
+    arg_list_add(out, arena_strndup(&cmd_arena, s, len));
+}
+
+// Add one field of an expanded word: with unquoted glob characters it
+// becomes the paths it matches, or stays as it is if none do
+void expand_field(char* field, int glob, ArgList* args) {
+    if (glob) {
+        PathList paths = {0};
+        if (glob_expand(field, &paths) > 0) {
+            for (int i = 0; i < paths.count; i++) {
+                arg_list_add(args, arena_strdup(&cmd_arena, paths.items[i]));
+            }
+            path_list_free(&paths);
+            return;
+        }
+        free(paths.items);
+    }
+    glob_unescape(field);
+    arg_list_add(args, field);
+}
+
+// Expand one command word into arguments. The results of unquoted
+// substitutions are split into fields on IFS, and an unquoted word that
+// expands to nothing is dropped.
+void expand_argument(Word* word, ArgList* args) {
+    // "$@" is one argument per positional parameter
+    if ((word->len == 2 && strncmp(word->start, "$@", 2) == 0) ||
+        (word->len == 4 && strncmp(word->start, "\"$@\"", 4) == 0)) {
+        for (int i = 0; i < positional_count; i++) {
+            arg_list_add(args, positional[i]);
+        }
+        return;
+    }
+    
+    int glob = 0;
+    FieldCuts cuts = {0};
+    ExpandBuf out = {arena_alloc(&cmd_arena, word->len + 1), 0, word->len + 1};
+    expand_word_into(word, &out, &glob, &cuts);
+    out.data[out.len] = '\0';
+    if (cuts.count == 0) {
+        if (out.len > 0 || cuts.quoted) expand_field(out.data, glob, args);
+        return;
+    }
+    int start = 0;
+    for (int k = 0; k <= cuts.count; k++) {
+        int end = k < cuts.count ? cuts.items[k].start : out.len;
+        int keep = k < cuts.count ? cuts.items[k].keep : cuts.quoted;
+        if (end > start || keep) {
+            expand_field(arena_strndup(&cmd_arena, out.data + start, end - start), glob, args);
+        }
+        if (k < cuts.count) start = cuts.items[k].end;
+    }
+}
+
+// Expand a list of words into arguments, with brace and pathname expansion
+void expand_word_list(Word* words, int count, ArgList* args) {
+    for (int i = 0; i < count; i++) {
+        Word* word = &words[i];
+        if (!memchr(word->start, '{', word->len)) {
+            expand_argument(word, args);
+            continue;
+        }
+        ArgList pieces = {0};
+        brace_expand(word->start, word->len, &pieces);
+        for (int k = 0; k < pieces.count; k++) {
+            Word piece = {pieces.items[k], strlen(pieces.items[k])};
+            expand_argument(&piece, args);
+        }
+    }
+}
+
+// Expand the words of a simple command after its assignments into a
+// NULL-terminated argv
+char** expand_words(Node* cmd) {
+    ArgList args = {0};
+    expand_word_list(cmd->words + cmd->assign_count, cmd->word_count - cmd->assign_count, &args);
+    arg_list_add(&args, NULL);
+    return args.items;
+}
+
+// Perform a command's NAME=value assignments. Scoped assignments belong to
+// the command they precede: they are exported to it and last until the
+// caller ends the scope it opened.
+void assign_variables(Node* cmd, int scoped) {
+    for (int i = 0; i < cmd->assign_count; i++) {
+        Word* word = &cmd->words[i];
+        int name_len = var_name_length(word->start, word->len);
+        Word value = {word->start + name_len + 1, word->len - name_len - 1};
+        char* text = expand_word(&value);
+        if (scoped) var_local(word->start, name_len);
+        var_assign(word->start, name_len, text, scoped);
+    }
+}
+
+// Execution
+
+// Add a descriptor move to the plan
+void io_plan_add(IoPlan* plan, int fd, int source) {
+    if (plan->count == plan->cap) {
+        int new_cap = plan->cap ? plan->cap * 2 : 8;
+        FdMove* grown = arena_alloc(&cmd_arena, new_cap * sizeof(FdMove));
+        if (plan->count > 0) {
+            memcpy(grown, plan->moves, plan->count * sizeof(FdMove));
+        }
+        plan->moves = grown;
+        plan->cap = new_cap;
+    }
+    plan->moves[plan->count].fd = fd;
+    plan->moves[plan->count].source = source;
+    plan->count++;
+}
+
+// Remember a descriptor the shell opened for the child, closed after launch
+void io_plan_track(IoPlan* plan, int fd) {
+    if (plan->opened_count == plan->opened_cap) {
+        int new_cap = plan->opened_cap ? plan->opened_cap * 2 : 4;
+        int* grown = arena_alloc(&cmd_arena, new_cap * sizeof(int));
+        if (plan->opened_count > 0) {
+            memcpy(grown, plan->opened, plan->opened_count * sizeof(int));
+        }
+        plan->opened = grown;
+        plan->opened_cap = new_cap;
+    }
+    plan->opened[plan->opened_count++] = fd;
+}
+
+// Give the command the descriptors of the process substitutions queued from
+// index from on. They keep their numbers (the words name /dev/fd/N) and are
+// closed in the shell once the command is launched.
+void io_plan_take_substs(IoPlan* plan, int from, int to) {
+    for (int i = from; i < to; i++) {
+        if (proc_substs[i].fd < 0) continue;
+        io_plan_add(plan, proc_substs[i].fd, proc_substs[i].fd);
+        io_plan_track(plan, proc_substs[i].fd);
+        proc_substs[i].fd = -1;  // the plan closes it now
+    }
+}
+
+// Send every file output move of fd through one pipe whose contents a helper
+// copies to all the files (cmd > a > b)
+int io_plan_fan_out(IoPlan* plan, int fd, int* move_index, int output_count) {
+    int count = 0;
+    for (int i = 0; i < output_count; i++) {
+        if (plan->moves[move_index[i]].fd == fd) count++;
+    }
+    if (count < 2) return 0;
+    
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "myshell: pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    io_plan_track(plan, fds[0]);
+    io_plan_track(plan, fds[1]);
+    apply_pipe_size(fds[1]);
+    
+    if (plan->fanout_count == plan->fanout_cap) {
+        int new_cap = plan->fanout_cap ? plan->fanout_cap * 2 : 2;
+        Fanout* grown = arena_alloc(&cmd_arena, new_cap * sizeof(Fanout));
+        if (plan->fanout_count > 0) {
+            memcpy(grown, plan->fanouts, plan->fanout_count * sizeof(Fanout));
+        }
+        plan->fanouts = grown;
+        plan->fanout_cap = new_cap;
+    }
+    Fanout* fanout = &plan->fanouts[plan->fanout_count++];
+    fanout->source = fds[0];
+    fanout->targets = arena_alloc(&cmd_arena, count * sizeof(int));
+    fanout->target_count = 0;
+    for (int i = 0; i < output_count; i++) {
+        FdMove* move = &plan->moves[move_index[i]];
+        if (move->fd == fd) {
+            fanout->targets[fanout->target_count++] = move->source;
+            move->source = fds[1];
+        }
+    }
+    return 0;
+}
+
+// Build the text a here-document or here-string feeds to its command.
+// Here-document bodies expand like double-quoted text, without treating "
+// specially, unless the delimiter was quoted; <<- strips leading tabs.
+void heredoc_text(Redirect* r, ExpandBuf* out) {
+    if (r->op == TOK_TLESS) {
+        char* word = expand_word(&r->target);
+        expand_append(out, word, strlen(word));
+        expand_append(out, "\n", 1);
+        return;
+    }
+    
+    const char* s = r->body;
+    int len = r->body_len;
+    int line_start = 1;
+    for (int i = 0; i < len; i++) {
+        if (line_start && r->op == TOK_DLESSDASH) {
+            while (i < len && s[i] == '\t') i++;
+            if (i >= len) break;
+        }
+        char c = s[i];
+        line_start = c == '\n';
+        if (r->quoted) {
+            expand_append(out, s + i, 1);
+        } else if (c == '\\' && i + 1 < len &&
+                   (s[i + 1] == '$' || s[i + 1] == '`' || s[i + 1] == '\\' || s[i + 1] == '\n')) {
+            i++;
+            if (s[i] == '\n') line_start = 1;
+            else expand_append(out, s + i, 1);
+        } else if (c == '$' || c == '`') {
+            int used = c == '$' ? expand_parameter(s, len, i, out) : expand_backquote(s, len, i, out);
+            if (used == 0) expand_append(out, s + i, 1);
+            else i += used - 1;
+        } else {
+            expand_append(out, s + i, 1);
+        }
+    }
+}
+
+// Put a here-document or here-string in a sealed memory file positioned at
+// its start. Unlike a pipe it never blocks however large the body is, and
+// no temporary file or writer process is needed. Returns -1 after printing
+// an error.
+int open_heredoc(Redirect* r) {
+    ExpandBuf text = {arena_alloc(&cmd_arena, 256), 0, 256};
+    heredoc_text(r, &text);
+    
+    int fd = memfd_create("myshell-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        fprintf(stderr, "myshell: here-document: %s\n", strerror(errno));
+        return -1;
+    }
+    if (write_all(fd, text.data, text.len) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+        lseek(fd, 0, SEEK_SET) < 0) {
+        fprintf(stderr, "myshell: here-document: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Open the files named by redirections in the shell and record the descriptor
+// moves the child needs. Files are opened close-on-exec, so only the moved
+// copies reach the new program. Several file outputs for one descriptor are
+// combined into a fan-out. Returns -1 after printing an error.
+int open_redirections(Redirect* redirects, IoPlan* plan) {
+    int redirect_count = 0;
+    for (Redirect* r = redirects; r != NULL; r = r->next) redirect_count++;
+    int* outputs = arena_alloc(&cmd_arena, (redirect_count + 1) * sizeof(int));
+    int output_count = 0;
+    
+    for (Redirect* r = redirects; r != NULL; r = r->next) {
+        if (r->op == TOK_DLESS || r->op == TOK_DLESSDASH || r->op == TOK_TLESS) {
+            int fd = open_heredoc(r);
+            if (fd < 0) return -1;
+            io_plan_track(plan, fd);
+            io_plan_add(plan, r->fd, fd);
+            continue;
+        }
+        
+        char* target = expand_word(&r->target);
+        int flags = O_CLOEXEC;
+        int both = 0;
+        
+        switch (r->op) {
+            case TOK_LESS:
+                flags |= O_RDONLY;
+                break;
+            case TOK_GREAT:
+                flags |= O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+            case TOK_DGREAT:
+                flags |= O_WRONLY | O_CREAT | O_APPEND;
+                break;
+            case TOK_LESSGREAT:
+                flags |= O_RDWR | O_CREAT;
+                break;
+            case TOK_LESSAND:
+            case TOK_GREATAND: {
+                if (strcmp(target, "-") == 0) {
+                    io_plan_add(plan, r->fd, -1);
+                    continue;
+                }
+                char* end;
+                long src_fd = strtol(target, &end, 10);
+                if (*target != '\0' && *end == '\0') {
+                    io_plan_add(plan, r->fd, (int)src_fd);
+                    continue;
+                }
+                if (r->op == TOK_GREATAND && r->fd == STDOUT_FILENO) {
+                    // >&file sends both stdout and stderr to file
+                    flags |= O_WRONLY | O_CREAT | O_TRUNC;
+                    both = 1;
+                    break;
+                }
+                fprintf(stderr, "myshell: %s: ambiguous redirect\n", target);
+                return -1;
+            }
+            default:
+                break;
+        }
+        
+        int fd = open(target, flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "myshell: %s: %s\n", target, strerror(errno));
+            return -1;
+        }
+        io_plan_track(plan, fd);
+        if (r->op == TOK_GREAT || r->op == TOK_DGREAT) {
+            outputs[output_count++] = plan->count;
+        }
+        io_plan_add(plan, r->fd, fd);
+        if (both) {
+            io_plan_add(plan, STDERR_FILENO, r->fd);
+        }
+    }
+    
+    for (int i = 0; i < output_count; i++) {
+        int fd = plan->moves[outputs[i]].fd;
+        int seen = 0;
+        for (int j = 0; j < i; j++) {
+            if (plan->moves[outputs[j]].fd == fd) seen = 1;
+        }
+        if (!seen && io_plan_fan_out(plan, fd, outputs, output_count) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close the descriptors the shell opened for a child
+void close_io_plan(IoPlan* plan) {
+    for (int i = 0; i < plan->opened_count; i++) {
+        close(plan->opened[i]);
+    }
+    plan->opened_count = 0;
+}
+
+// Apply the descriptor moves in the current process (a forked child)
+void apply_io_plan(IoPlan* plan) {
+    for (int i = 0; i < plan->count; i++) {
+        FdMove* move = &plan->moves[i];
+        if (move->source < 0) {
+            close(move->fd);
+        } else if (move->source == move->fd) {
+            // Passed through under its own number; dup2 would leave it close-on-exec
+            fcntl(move->fd, F_SETFD, 0);
+        } else if (dup2(move->source, move->fd) < 0) {
+            fprintf(stderr, "myshell: %d: %s\n", move->source, strerror(errno));
+            _exit(1);
+        }
+    }
+}
+
+// Kernel-side copies. splice moves pages between a pipe and a file or another
+// pipe, tee duplicates a pipe's pages into a second pipe, so copies the shell
+// makes itself (the tee builtin, "cmd > a > b", "< file |") never pass the
+// data through userspace. Descriptors splice refuses (terminals, O_APPEND
+// files on older kernels) fall back to read/write.
+
+char copy_buffer[COPY_BUFFER_SIZE];
+int pipe_size_warned = 0;
+
+int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Append everything that can be read from fd to buf. The buffer grows
+// geometrically and each read fills as much of it as the kernel has ready.
+void read_all(int fd, ExpandBuf* buf) {
+    while (1) {
+        expand_reserve(buf, COPY_BUFFER_SIZE);
+        ssize_t n = read(fd, buf->data + buf->len, buf->cap - buf->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf->len += n;
+    }
+}
+
+// Parse a size such as 65536, 256K or 1M. Returns -1 if invalid.
+long parse_size(const char* str) {
+    char* end;
+    long size = strtol(str, &end, 10);
+    if (end == str || size < 0) return -1;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': size <<= 10; end++; break;
+        case 'M': size <<= 20; end++; break;
+        case 'G': size <<= 30; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// Resize a pipe the shell creates to PIPESIZE bytes, if set. It is a shell
+// variable like any other and takes effect without being exported.
+void apply_pipe_size(int fd) {
+    char* value = var_lookup("PIPESIZE");
+    if (value == NULL || *value == '\0') return;
+    
+    long size = parse_size(value);
+    if (size <= 0 || size > INT32_MAX) {
+        if (!pipe_size_warned) {
+            fprintf(stderr, "myshell: PIPESIZE: invalid size `%s'\n", value);
+            pipe_size_warned = 1;
+        }
+        return;
+    }
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0 && !pipe_size_warned) {
+        // Unprivileged users are limited by /proc/sys/fs/pipe-max-size
+        fprintf(stderr, "myshell: PIPESIZE: %s\n", strerror(errno));
+        pipe_size_warned = 1;
+    }
+}
+
+// Copy in to out until end of input. Needs one side to be a pipe for splice.
+int splice_stream(int in, int out) {
+    int use_copy = 0;
+    while (1) {
+        ssize_t moved;
+        if (!use_copy) {
+            moved = splice(in, NULL, out, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved < 0 && errno == EINVAL) {
+                use_copy = 1;
+                continue;
+            }
+        } else {
+            moved = read(in, copy_buffer, COPY_BUFFER_SIZE);
+            if (moved > 0 && write_all(out, copy_buffer, moved) < 0) return -1;
+        }
+        if (moved == 0) return 0;
+        if (moved < 0 && errno != EINTR) return -1;
+    }
+}
+
+// One output of a fan-out, fed through a private pipe
+typedef struct {
+    int fd;
+    int pipe[2];
+    int use_copy;  // splice refused this output: drain with read/write
+    int active;    // cleared when the output fails (e.g. its reader exited)
+} FanoutTarget;
+
+// Move exactly len bytes from a target's pipe to its output
+int fanout_drain(FanoutTarget* target, size_t len) {
+    while (len > 0) {
+        ssize_t moved;
+        if (!target->use_copy) {
+            moved = splice(target->pipe[0], NULL, target->fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved < 0 && errno == EINVAL) {
+                target->use_copy = 1;
+                continue;
+            }
+        } else {
+            moved = read(target->pipe[0], copy_buffer, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE);
+            if (moved > 0 && write_all(target->fd, copy_buffer, moved) < 0) return -1;
+        }
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (moved == 0) return -1;
+        len -= moved;
+    }
+    return 0;
+}
+
+// Copy everything from in to each of the outputs. Each round tees the
+// pending pages of the source pipe into one private pipe per output, splices
+// them out, then drops the pages from the source. The private pipes start
+// empty and are at least as large as the source, so every tee of a round
+// takes the same bytes. A non-pipe input is first spliced into a pipe.
+// Returns 0, or -1 if the copy could not be done.
+int fanout_copy(int in, int* outs, int count) {
+    if (count == 1) {
+        return splice_stream(in, outs[0]);
+    }
+    
+    int result = -1;
+    int source = in;
+    int input_pipe[2] = {-1, -1};
+    int input_copy = 0;
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    FanoutTarget* targets = calloc(count, sizeof(FanoutTarget));
+    struct stat st;
+    if (devnull < 0 || targets == NULL) goto done;
+    for (int i = 0; i < count; i++) {
+        targets[i].pipe[0] = targets[i].pipe[1] = -1;
+    }
+    
+    if (fstat(in, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        if (pipe2(input_pipe, O_CLOEXEC) < 0) goto done;
+        source = input_pipe[0];
+    }
+    int chunk = fcntl(source, F_GETPIPE_SZ);
+    if (chunk <= 0) goto done;
+    
+    for (int i = 0; i < count; i++) {
+        targets[i].fd = outs[i];
+        targets[i].active = 1;
+        if (pipe2(targets[i].pipe, O_CLOEXEC) < 0) goto done;
+        if (fcntl(targets[i].pipe[1], F_SETPIPE_SZ, chunk) < chunk) goto done;
+    }
+    
+    int active = count;
+    while (active > 0) {
+        if (input_pipe[1] >= 0) {
+            // Refill the source pipe from a file or terminal
+            ssize_t got;
+            if (!input_copy) {
+                got = splice(in, NULL, input_pipe[1], NULL, chunk, SPLICE_F_MOVE);
+                if (got < 0 && errno == EINVAL) {
+                    input_copy = 1;
+                    continue;
+                }
+            } else {
+                got = read(in, copy_buffer, chunk < COPY_BUFFER_SIZE ? chunk : COPY_BUFFER_SIZE);
+                if (got > 0 && write_all(input_pipe[1], copy_buffer, got) < 0) goto done;
+            }
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) goto done;
+            if (got == 0) break;
+        }
+        
+        ssize_t len = -1;
+        for (int i = 0; i < count; i++) {
+            if (!targets[i].active) continue;
+            ssize_t teed;
+            do {
+                teed = tee(source, targets[i].pipe[1], len < 0 ? (size_t)chunk : (size_t)len, 0);
+            } while (teed < 0 && errno == EINTR);
+            if (teed < 0) goto done;
+            if (len < 0) {
+                len = teed;
+            } else if (teed != len) {
+                errno = EIO;
+                goto done;
+            }
+            if (len == 0) break;
+        }
+        if (len == 0) {
+            result = 0;
+            goto done;
+        }
+        
+        for (int i = 0; i < count; i++) {
+            if (targets[i].active && fanout_drain(&targets[i], len) < 0) {
+                // Stop feeding this output; its pipe is never teed into again
+                targets[i].active = 0;
+                active--;
+            }
+        }
+        ssize_t dropped = 0;
+        while (dropped < len) {
+            ssize_t n = splice(source, NULL, devnull, NULL, len - dropped, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto done;
+            dropped += n;
+        }
+    }
+    result = 0;
+    
+done:
+    if (result < 0) {
+        fprintf(stderr, "myshell: copy: %s\n", strerror(errno));
+    }
+    if (targets) {
+        for (int i = 0; i < count; i++) {
+            if (targets[i].pipe[0] >= 0) close(targets[i].pipe[0]);
+            if (targets[i].pipe[1] >= 0) close(targets[i].pipe[1]);
+        }
+        free(targets);
+    }
+    if (input_pipe[0] >= 0) {
+        close(input_pipe[0]);
+        close(input_pipe[1]);
+    }
+    if (devnull >= 0) close(devnull);
+    return result;
+}
+
+// Built-in: tee [-a] [file...]
+int builtin_tee(char** args) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int first = 1;
+    for (; args[first] != NULL && args[first][0] == '-' && args[first][1] != '\0'; first++) {
+        if (strcmp(args[first], "-a") == 0) {
+            flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        } else if (strcmp(args[first], "-i") == 0) {
+            // Interrupts already stop the whole pipeline, not just tee
+        } else if (strcmp(args[first], "--") == 0) {
+            first++;
+            break;
+        } else {
+            fprintf(stderr, "myshell: tee: %s: invalid option\n", args[first]);
+            fprintf(stderr, "Usage: tee [-a] [file...]\n");
+            last_status = 2;
+            return 1;
+        }
+    }
+    
+    int count = 1;
+    for (int i = first; args[i] != NULL; i++) count++;
+    int* outs = arena_alloc(&cmd_arena, count * sizeof(int));
+    int opened = 1;
+    outs[0] = STDOUT_FILENO;
+    for (int i = first; args[i] != NULL; i++) {
+        int fd = open(args[i], flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "myshell: tee: %s: %s\n", args[i], strerror(errno));
+            last_status = 1;
+            continue;
+        }
+        outs[opened++] = fd;
+    }
+    
+    fflush(stdout);
+    if (fanout_copy(STDIN_FILENO, outs, opened) < 0) {
+        last_status = 1;
+    }
+    for (int i = 1; i < opened; i++) {
+        close(outs[i]);
+    }
+    return 1;
+}
+
+// Close every descriptor except the given ones
+void close_other_fds(int* keep, int count) {
+    // Sort the few descriptors to keep, then close the gaps between them
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+            int tmp = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = tmp;
+        }
+    }
+    unsigned int low = 0;
+    for (int i = 0; i < count; i++) {
+        if ((unsigned int)keep[i] > low) close_range(low, keep[i] - 1, 0);
+        if ((unsigned int)keep[i] + 1 > low) low = keep[i] + 1;
+    }
+    close_range(low, ~0U, 0);
+}
+
+// Start a helper process for each fan-out in the plan. The helpers belong to
+// the job but are not pipeline stages. Must be called with SIGCHLD blocked.
+void start_fanouts(IoPlan* plan, Job* job) {
+    for (int f = 0; f < plan->fanout_count; f++) {
+        Fanout* fanout = &plan->fanouts[f];
+        pid_t pid = fork_in_job(job);
+        if (pid == 0) {
+            // A forked copy of the shell holds every pipe it had open; keep
+            // only what the copy needs, or readers would never see EOF
+            int* keep = malloc((fanout->target_count + 2) * sizeof(int));
+            int keep_count = 0;
+            keep[keep_count++] = STDERR_FILENO;
+            keep[keep_count++] = fanout->source;
+            for (int i = 0; i < fanout->target_count; i++) {
+                keep[keep_count++] = fanout->targets[i];
+            }
+            close_other_fds(keep, keep_count);
+            // A target whose reader went away is dropped, not fatal
+            signal(SIGPIPE, SIG_IGN);
+            _exit(fanout_copy(fanout->source, fanout->targets, fanout->target_count) < 0 ? 1 : 0);
+        }
+        if (pid > 0) {
+            job->procs[job->proc_count - 1].helper = 1;
+        }
+    }
+}
+
+// Start the commands of all queued process substitutions as helpers of the
+// job, or with no job, drop them. They run concurrently with the command that
+// uses them. Must be called with SIGCHLD blocked.
+void start_substitutions(Job* job) {
+    for (int i = 0; i < proc_subst_count; i++) {
+        ProcSubst* subst = &proc_substs[i];
+        if (job != NULL) {
+            pid_t pid = fork_in_job(job);
+            if (pid == 0) {
+                dup2(subst->other, subst->output ? STDIN_FILENO : STDOUT_FILENO);
+                // Holding other pipes open would keep their readers waiting
+                int keep[] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+                close_other_fds(keep, 3);
+                proc_subst_count = 0;
+                run_command_line(subst->command);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            if (pid > 0) {
+                job->procs[job->proc_count - 1].helper = 1;
+            }
+        } else if (subst->fd >= 0) {
+            close(subst->fd);
+        }
+        close(subst->other);
+    }
+    proc_subst_count = 0;
+}
+
+// Turn a wait status into a shell exit status
+int status_from_wait(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+// Find the builtin with the given name, FUNCTION_CALL for a shell function,
+// or -1. Functions take precedence, as in other shells.
+int find_builtin(char* name) {
+    if (function_count > 0 && function_find(name)) {
+        return FUNCTION_CALL;
+    }
+    for (int i = 0; i < num_builtins(); i++) {
+        if (strcmp(name, builtin_names[i]) == 0) {
+            return builtin_disabled[i] ? -1 : i;
+        }
+    }
+    return -1;
+}
+
+void report_exec_error(char* name, int err) {
+    if (err == ENOENT) {
+        fprintf(stderr, "myshell: %s: command not found\n", name);
+    } else {
+        fprintf(stderr, "myshell: %s: %s\n", name, strerror(err));
+    }
+}
+
+// The status of a command that could not be run: 127 if it was not found,
+// 126 if it was but could not be executed
+int exec_status(int err) {
+    return err == ENOENT ? 127 : 126;
+}
+
+// Job control
+
+void block_sigchld(sigset_t* prev) {
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, prev);
+}
+
+void restore_sigmask(sigset_t* prev) {
+    sigprocmask(SIG_SETMASK, prev, NULL);
+}
+
+// Timing for the time keyword
+
+double elapsed_seconds(struct timespec* from, struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(struct timeval* tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Add the usage between two snapshots to a running total
+void rusage_add_delta(struct rusage* total, struct rusage* before, struct rusage* after) {
+    struct timeval delta;
+    timersub(&after->ru_utime, &before->ru_utime, &delta);
+    timeradd(&total->ru_utime, &delta, &total->ru_utime);
+    timersub(&after->ru_stime, &before->ru_stime, &delta);
+    timeradd(&total->ru_stime, &delta, &total->ru_stime);
+    total->ru_nvcsw += after->ru_nvcsw - before->ru_nvcsw;
+    total->ru_nivcsw += after->ru_nivcsw - before->ru_nivcsw;
+    total->ru_inblock += after->ru_inblock - before->ru_inblock;
+    total->ru_oublock += after->ru_oublock - before->ru_oublock;
+    if (after->ru_maxrss > total->ru_maxrss) total->ru_maxrss = after->ru_maxrss;
+}
+
+void usage_mark(UsageMark* mark) {
+    clock_gettime(CLOCK_MONOTONIC, &mark->wall);
+    getrusage(RUSAGE_SELF, &mark->self);
+    getrusage(RUSAGE_CHILDREN, &mark->children);
+}
+
+// Fill in a stage that ran inside the shell with what the shell and the
+// children it reaped used since the mark
+void usage_since(UsageMark* mark, Process* proc) {
+    UsageMark now;
+    usage_mark(&now);
+    proc->started = mark->wall;
+    proc->finished = now.wall;
+    memset(&proc->usage, 0, sizeof(proc->usage));
+    rusage_add_delta(&proc->usage, &mark->self, &now.self);
+    rusage_add_delta(&proc->usage, &mark->children, &now.children);
+    // Peak RSS is a lifetime maximum; report the shell's own
+    proc->usage.ru_maxrss = now.self.ru_maxrss;
+}
+
+void time_start(TimeCapture* capture, TimeFormat format) {
+    memset(capture, 0, sizeof(*capture));
+    capture->format = format;
+    clock_gettime(CLOCK_MONOTONIC, &capture->started);
+}
+
+// Keep a copy of a timed job's processes; the job itself is about to go away
+void time_capture_job(Job* job) {
+    TimeCapture* capture = job->timing;
+    if (capture == NULL) return;
+    job->timing = NULL;
+    
+    free(capture->procs);
+    capture->procs = NULL;
+    capture->proc_count = 0;
+    if (job->proc_count == 0) return;
+    capture->procs = malloc(job->proc_count * sizeof(Process));
+    if (!capture->procs) return;
+    memcpy(capture->procs, job->procs, job->proc_count * sizeof(Process));
+    capture->proc_count = job->proc_count;
+}
+
+// Record a builtin that ran inside the shell as the only stage
+void time_capture_builtin(TimeCapture* capture, UsageMark* mark) {
+    free(capture->procs);
+    capture->proc_count = 0;
+    capture->procs = calloc(1, sizeof(Process));
+    if (!capture->procs) return;
+    usage_since(mark, &capture->procs[0]);
+    capture->procs[0].completed = 1;
+    capture->procs[0].status = W_EXITCODE(last_status, 0);
+    capture->proc_count = 1;
+}
+
+void json_write_string(FILE* out, const char* str, int len) {
+    fputc('"', out);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c == '\t') {
+            fputs("\\t", out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void json_write_usage(FILE* out, double real, struct rusage* usage) {
+    fprintf(out, "\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+            "\"vcsw\":%ld,\"ivcsw\":%ld,\"inblock\":%ld,\"oublock\":%ld",
+            real, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+            usage->ru_inblock, usage->ru_oublock);
+}
+
+void time_print_row(char* label, double real, struct rusage* usage, const char* text, int text_len) {
+    fprintf(stderr, "%-6s %9.3fs %9.3fs %9.3fs %9ldK %7ld %7ld %7ld %7ld%s%.*s\n",
+            label, real, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw,
+            usage->ru_inblock, usage->ru_oublock, text_len > 0 ? "  " : "", text_len, text);
+}
+
+// Print the report for a timed pipeline to stderr and release the capture.
+// Stage rows come from wait4's rusage for processes and from getrusage
+// deltas for builtins that ran inside the shell.
+void time_report(TimeCapture* capture, Node* pipeline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double real = elapsed_seconds(&capture->started, &now);
+    
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    struct rusage zero;
+    memset(&zero, 0, sizeof(zero));
+    double* stage_real = calloc(capture->proc_count + 1, sizeof(double));
+    for (int i = 0; i < capture->proc_count; i++) {
+        Process* proc = &capture->procs[i];
+        rusage_add_delta(&total, &zero, &proc->usage);
+        stage_real[i] = elapsed_seconds(&proc->started, proc->completed ? &proc->finished : &now);
+    }
+    
+    // Stage commands line up with the processes unless the pipeline never
+    // got that far. Fan-out helpers count towards the totals only.
+    int stage_count = 0;
+    for (int i = 0; i < capture->proc_count; i++) {
+        if (!capture->procs[i].helper) stage_count++;
+    }
+    int per_stage_text = pipeline->child_count == stage_count;
+    
+    fflush(stdout);
+    if (capture->format == TIME_POSIX) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real,
+                timeval_seconds(&total.ru_utime), timeval_seconds(&total.ru_stime));
+    } else if (capture->format == TIME_JSON) {
+        fputc('{', stderr);
+        fputs("\"command\":", stderr);
+        json_write_string(stderr, pipeline->text, pipeline->text_len);
+        fprintf(stderr, ",\"status\":%d,", last_status);
+        json_write_usage(stderr, real, &total);
+        fputs(",\"stages\":[", stderr);
+        for (int i = 0, n = 0; i < capture->proc_count; i++) {
+            Process* proc = &capture->procs[i];
+            if (proc->helper) continue;
+            Node* stage = per_stage_text ? pipeline->children[n] : pipeline;
+            fputs(n++ > 0 ? ",{\"command\":" : "{\"command\":", stderr);
+            json_write_string(stderr, stage->text, stage->text_len);
+            if (proc->pid > 0) {
+                fprintf(stderr, ",\"pid\":%d", (int)proc->pid);
+            } else {
+                fputs(",\"pid\":null", stderr);
+            }
+            fprintf(stderr, ",\"status\":%d,", status_from_wait(proc->status));
+            json_write_usage(stderr, stage_real[i], &proc->usage);
+            fputc('}', stderr);
+        }
+        fputs("]}\n", stderr);
+    } else {
+        fprintf(stderr, "%-6s %10s %10s %10s %10s %7s %7s %7s %7s\n",
+                "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "inblk", "oublk");
+        if (stage_count > 1) {
+            for (int i = 0, n = 0; i < capture->proc_count; i++) {
+                if (capture->procs[i].helper) continue;
+                Node* stage = per_stage_text ? pipeline->children[n] : pipeline;
+                char label[16];
+                snprintf(label, sizeof(label), "%d", ++n);
+                time_print_row(label, stage_real[i], &capture->procs[i].usage, stage->text, stage->text_len);
+            }
+        }
+        time_print_row("total", real, &total, "", 0);
+    }
+    
+    free(stage_real);
+    free(capture->procs);
+    capture->procs = NULL;
+    capture->proc_count = 0;
+}
+
+// Collect status changes of our own children without blocking. Only pids in
+// the job table are waited for, so children owned by other code (popen in the
+// prompt) are left alone. Runs from the SIGCHLD handler and with SIGCHLD
+// blocked from the main program.
+void reap_children() {
+    for (Job* job = job_list; job != NULL; job = job->next) {
+        for (int i = 0; i < job->proc_count; i++) {
+            Process* proc = &job->procs[i];
+            if (proc->completed) continue;
+            
+            int status;
+            struct rusage usage;
+            pid_t pid = wait4(proc->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+            if (pid != proc->pid) continue;
+            
+            if (WIFSTOPPED(status)) {
+                proc->stopped = 1;
+                proc->status = status;
+            } else if (WIFCONTINUED(status)) {
+                proc->stopped = 0;
+            } else {
+                proc->completed = 1;
+                proc->stopped = 0;
+                proc->status = status;
+                proc->usage = usage;
+                clock_gettime(CLOCK_MONOTONIC, &proc->finished);
+            }
+            job->notified = 0;
+        }
+    }
+}
+
+void sigint_handler(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+void sigchld_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    reap_children();
+    errno = saved_errno;
+}
+
+int job_is_completed(Job* job) {
+    for (int i = 0; i < job->proc_count; i++) {
+        if (!job->procs[i].completed) return 0;
+    }
+    return 1;
+}
+
+int job_is_stopped(Job* job) {
+    int stopped = 0;
+    for (int i = 0; i < job->proc_count; i++) {
+        if (!job->procs[i].completed && !job->procs[i].stopped) return 0;
+        if (job->procs[i].stopped) stopped = 1;
+    }
+    return stopped;
+}
+
+// The process of the job's last pipeline stage, skipping fan-out helpers
+Process* job_last_stage(Job* job) {
+    for (int i = job->proc_count - 1; i >= 0; i--) {
+        if (!job->procs[i].helper) return &job->procs[i];
+    }
+    return NULL;
+}
+
+// Exit status of a finished or stopped job: that of its last process, or
+// with pipefail that of the last process that failed
+int job_status(Job* job) {
+    Process* last = job_last_stage(job);
+    if (last == NULL) return 0;
+    if (pipefail) {
+        for (int i = job->proc_count - 1; i >= 0; i--) {
+            if (job->procs[i].helper) continue;
+            int status = status_from_wait(job->procs[i].status);
+            if (status != 0) return status;
+        }
+        return 0;
+    }
+    return status_from_wait(last->status);
+}
+
+// Whether any stage of the job became a real process
+int job_has_processes(Job* job) {
+    for (int i = 0; i < job->proc_count; i++) {
+        if (job->procs[i].pid > 0) return 1;
+    }
+    return 0;
+}
+
+// Record PIPESTATUS for a command that ran without a job
+void set_pipe_status(int status) {
+    if (pipe_status_cap == 0) {
+        pipe_status_cap = 8;
+        pipe_status = malloc(pipe_status_cap * sizeof(int));
+        if (!pipe_status) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    pipe_status[0] = status;
+    pipe_status_count = 1;
+}
+
+// Record PIPESTATUS from every stage of a job
+void set_pipe_status_from_job(Job* job) {
+    if (job_last_stage(job) == NULL) {
+        set_pipe_status(0);
+        return;
+    }
+    if (job->proc_count > pipe_status_cap) {
+        pipe_status_cap = job->proc_count;
+        pipe_status = realloc(pipe_status, pipe_status_cap * sizeof(int));
+    }
+    if (!pipe_status) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    pipe_status_count = 0;
+    for (int i = 0; i < job->proc_count; i++) {
+        if (job->procs[i].helper) continue;
+        pipe_status[pipe_status_count++] = status_from_wait(job->procs[i].status);
+    }
+}
+
+// Create a job for a command. It is not visible to the reaper until registered.
+Job* job_new(const char* text, int len, int background) {
+    Job* job = calloc(1, sizeof(Job));
+    if (!job) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    while (len > 0 && isspace((unsigned char)text[len - 1])) len--;
+    job->command = strndup(text, len);
+    job->background = background;
+    job->foreground = !background;
+    if (job_control) {
+        tcgetattr(shell_terminal, &job->tmodes);
+    }
+    return job;
+}
+
+// Add a job to the table. Must be called with SIGCHLD blocked.
+void job_register(Job* job) {
+    int max_id = 0;
+    Job** tail = &job_list;
+    while (*tail) {
+        if ((*tail)->id > max_id) max_id = (*tail)->id;
+        tail = &(*tail)->next;
+    }
+    job->id = max_id + 1;
+    *tail = job;
+}
+
+// Record a started process. Must be called with SIGCHLD blocked.
+void job_add_process(Job* job, pid_t pid) {
+    if (job->proc_count == job->proc_cap) {
+        job->proc_cap = job->proc_cap ? job->proc_cap * 2 : 4;
+        job->procs = realloc(job->procs, job->proc_cap * sizeof(Process));
+        if (!job->procs) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    memset(&job->procs[job->proc_count], 0, sizeof(Process));
+    job->procs[job->proc_count].pid = pid;
+    clock_gettime(CLOCK_MONOTONIC, &job->procs[job->proc_count].started);
+    job->proc_count++;
+}
+
+// Record a pipeline stage that never became a process (a failed redirection,
+// a launch error, or a builtin run inside the shell) so that it still has a
+// place in PIPESTATUS. Returns its index so the status can be filled in later.
+int job_add_status(Job* job, int status) {
+    job_add_process(job, 0);
+    Process* proc = &job->procs[job->proc_count - 1];
+    proc->completed = 1;
+    proc->status = W_EXITCODE(status, 0);
+    proc->finished = proc->started;
+    return job->proc_count - 1;
+}
+
+// Put a new child into the job's process group and, for foreground jobs, hand
+// it the terminal. Both parent and child do this, so neither order can race.
+void job_place_process(Job* job, pid_t pid) {
+    if (!job_control) return;
+    if (job->pgid == 0) job->pgid = pid;
+    setpgid(pid, job->pgid);
+    if (job->foreground) {
+        tcsetpgrp(shell_terminal, job->pgid);
+    }
+}
+
+void job_free(Job* job) {
+    free(job->command);
+    free(job->procs);
+    free(job);
+}
+
+// Remove a job from the table and free it
+void job_remove(Job* job) {
+    sigset_t prev;
+    block_sigchld(&prev);
+    for (Job** link = &job_list; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    restore_sigmask(&prev);
+    job_free(job);
+}
+
+// Most recent job (+) and the one before it (-)
+Job* current_job(int previous) {
+    Job* last = NULL;
+    Job* before = NULL;
+    for (Job* job = job_list; job != NULL; job = job->next) {
+        before = last;
+        last = job;
+    }
+    return previous ? before : last;
+}
+
+char job_marker(Job* job) {
+    if (job == current_job(0)) return '+';
+    if (job == current_job(1)) return '-';
+    return ' ';
+}
+
+// Describe how a job's last process ended, like bash: Done, Exit 2, Killed...
+void describe_job_state(Job* job, char* buf, size_t size) {
+    if (job_is_stopped(job)) {
+        snprintf(buf, size, "Stopped");
+    } else if (!job_is_completed(job)) {
+        snprintf(buf, size, "Running");
+    } else {
+        Process* last = job_last_stage(job);
+        int status = last ? last->status : 0;
+        if (WIFSIGNALED(status)) {
+            snprintf(buf, size, "%s", strsignal(WTERMSIG(status)));
+        } else if (job_status(job) != 0) {
+            snprintf(buf, size, "Exit %d", job_status(job));
+        } else {
+            snprintf(buf, size, "Done");
+        }
+    }
+}
+
+void print_job(Job* job) {
+    char state[64];
+    describe_job_state(job, state, sizeof(state));
+    printf("[%d]%c  %-24s%s%s\n", job->id, job_marker(job), state, job->command,
+           !job_is_completed(job) && !job_is_stopped(job) ? " &" : "");
+}
+
+// Report background jobs that finished or stopped since the last prompt
+void notify_jobs() {
+    sigset_t prev;
+    block_sigchld(&prev);
+    reap_children();
+    restore_sigmask(&prev);
+    
+    Job* job = job_list;
+    while (job != NULL) {
+        Job* next = job->next;
+        if (job_is_completed(job)) {
+            if (job->background) {
+                print_job(job);
+            }
+            job_remove(job);
+        } else if (job_is_stopped(job) && !job->notified) {
+            print_job(job);
+            job->notified = 1;
+        }
+        job = next;
+    }
+    fflush(stdout);
+}
+
+// Wait until a foreground job finishes or stops, then take the terminal back.
+// Returns the job's exit status; finished jobs are removed from the table.
+int wait_for_job(Job* job) {
+    sigset_t prev;
+    block_sigchld(&prev);
+    sigset_t wait_mask = prev;
+    sigdelset(&wait_mask, SIGCHLD);
+    
+    reap_children();
+    while (!job_is_completed(job) && !job_is_stopped(job)) {
+        sigsuspend(&wait_mask);
+    }
+    restore_sigmask(&prev);
+    
+    if (job_control) {
+        tcsetpgrp(shell_terminal, shell_pgid);
+        tcgetattr(shell_terminal, &job->tmodes);
+        tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    }
+    
+    int status = job_status(job);
+    set_pipe_status_from_job(job);
+    time_capture_job(job);
+    if (job_is_stopped(job)) {
+        job->foreground = 0;
+        job->background = 1;
+        job->notified = 1;
+        printf("\n");
+        print_job(job);
+    } else {
+        Process* stage = job_last_stage(job);
+        int last = stage ? stage->status : 0;
+        if (WIFSIGNALED(last) && WTERMSIG(last) != SIGINT && WTERMSIG(last) != SIGPIPE) {
+            fprintf(stderr, "%s%s\n", strsignal(WTERMSIG(last)), WCOREDUMP(last) ? " (core dumped)" : "");
+        } else if (WIFSIGNALED(last) && WTERMSIG(last) == SIGINT) {
+            printf("\n");
+            interrupted = 1;
+        }
+        job_remove(job);
+    }
+    return status;
+}
+
+// Finish launching a job: background jobs are announced and left running,
+// foreground jobs are waited for. Called with SIGCHLD blocked (prev is the
+// mask to restore). Sets last_status for foreground jobs.
+void finish_job(Job* job, sigset_t* prev) {
+    if (!job_has_processes(job)) {
+        // Nothing to wait for: every stage failed to start or ran in the shell
+        restore_sigmask(prev);
+        if (!job->background) {
+            set_pipe_status_from_job(job);
+            time_capture_job(job);
+            last_status = job_status(job);
+        } else {
+            set_pipe_status(0);
+            last_status = 0;
+        }
+        job_remove(job);
+        return;
+    }
+    
+    if (job->background) {
+        for (int i = job->proc_count - 1; i >= 0; i--) {
+            if (job->procs[i].pid > 0 && !job->procs[i].helper) {
+                last_background_pid = job->procs[i].pid;
+                break;
+            }
+        }
+        restore_sigmask(prev);
+        if (interactive) {
+            printf("[%d] %d\n", job->id, (int)last_background_pid);
+        }
+        set_pipe_status(0);
+        last_status = 0;
+        return;
+    }
+    
+    restore_sigmask(prev);
+    last_status = wait_for_job(job);
+}
+
+// Find a job from a job spec: %n, %%, %+, %-, %prefix, or the current job
+Job* find_job(char* spec, char* builtin) {
+    sigset_t prev;
+    block_sigchld(&prev);
+    reap_children();
+    restore_sigmask(&prev);
+    
+    Job* found = NULL;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0) {
+        found = current_job(0);
+    } else if (strcmp(spec, "%-") == 0) {
+        found = current_job(1);
+    } else if (spec[0] == '%' && isdigit((unsigned char)spec[1])) {
+        int id = atoi(spec + 1);
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if (job->id == id) found = job;
+        }
+    } else {
+        char* prefix = spec[0] == '%' ? spec + 1 : spec;
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if (strncmp(job->command, prefix, strlen(prefix)) == 0) found = job;
+        }
+    }
+    
+    if (found == NULL) {
+        fprintf(stderr, "myshell: %s: %s: no such job\n", builtin, spec ? spec : "current");
+    }
+    return found;
+}
+
+// Mark a stopped job as running again and send it SIGCONT
+void continue_job(Job* job) {
+    sigset_t prev;
+    block_sigchld(&prev);
+    for (int i = 0; i < job->proc_count; i++) {
+        job->procs[i].stopped = 0;
+    }
+    job->notified = 0;
+    restore_sigmask(&prev);
+    
+    if (job->pgid > 0) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (int i = 0; i < job->proc_count; i++) {
+            if (!job->procs[i].completed) kill(job->procs[i].pid, SIGCONT);
+        }
+    }
+}
+
+// Built-in: jobs
+int builtin_jobs(char** args) {
+    (void)args;
+    sigset_t prev;
+    block_sigchld(&prev);
+    reap_children();
+    restore_sigmask(&prev);
+    
+    Job* job = job_list;
+    while (job != NULL) {
+        Job* next = job->next;
+        print_job(job);
+        if (job_is_completed(job)) {
+            job_remove(job);
+        } else if (job_is_stopped(job)) {
+            job->notified = 1;
+        }
+        job = next;
+    }
+    return 1;
+}
+
+// Built-in: fg
+int builtin_fg(char** args) {
+    if (!job_control) {
+        fprintf(stderr, "myshell: fg: no job control\n");
+        last_status = 1;
+        return 1;
+    }
+    
+    Job* job = find_job(args[1], "fg");
+    if (job == NULL) {
+        last_status = 1;
+        return 1;
+    }
+    
+    printf("%s\n", job->command);
+    fflush(stdout);
+    job->foreground = 1;
+    job->background = 0;
+    tcsetpgrp(shell_terminal, job->pgid);
+    tcsetattr(shell_terminal, TCSADRAIN, &job->tmodes);
+    continue_job(job);
+    last_status = wait_for_job(job);
+    return 1;
+}
+
+// Built-in: bg
+int builtin_bg(char** args) {
+    if (!job_control) {
+        fprintf(stderr, "myshell: bg: no job control\n");
+        last_status = 1;
+        return 1;
+    }
+    
+    Job* job = find_job(args[1], "bg");
+    if (job == NULL) {
+        last_status = 1;
+        return 1;
+    }
+    
+    job->foreground = 0;
+    job->background = 1;
+    continue_job(job);
+    printf("[%d]%c %s &\n", job->id, job_marker(job), job->command);
+    return 1;
+}
+
+// Built-in: wait
+int builtin_wait(char** args) {
+    if (args[1] != NULL) {
+        for (int i = 1; args[i] != NULL; i++) {
+            Job* job = NULL;
+            if (args[i][0] == '%') {
+                job = find_job(args[i], "wait");
+            } else {
+                pid_t pid = atoi(args[i]);
+                for (Job* j = job_list; j != NULL && job == NULL && pid > 0; j = j->next) {
+                    for (int k = 0; k < j->proc_count; k++) {
+                        if (j->procs[k].pid == pid) job = j;
+                    }
+                }
+                if (job == NULL) {
+                    fprintf(stderr, "myshell: wait: pid %s is not a child of this shell\n", args[i]);
+                }
+            }
+            if (job == NULL) {
+                last_status = 127;
+                continue;
+            }
+            job->foreground = 0;
+            last_status = wait_for_job(job);
+        }
+        return 1;
+    }
+    
+    // Wait for every running job; stopped jobs would never finish
+    last_status = 0;
+    Job* job = job_list;
+    while (job != NULL) {
+        Job* next = job->next;
+        if (!job_is_stopped(job)) {
+            job->foreground = 0;
+            wait_for_job(job);
+        }
+        job = next;
+    }
+    return 1;
+}
+
+// Built-in: set -o name / set +o name. Without a name, list the options.
+int builtin_set(char** args) {
+    int count = sizeof(shell_options) / sizeof(shell_options[0]);
+    
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+        for (int i = 0; i < count; i++) {
+            printf("%-15s%s\n", shell_options[i].name, *shell_options[i].flag ? "on" : "off");
+        }
+        return 1;
+    }
+    if (strcmp(args[1], "+o") == 0 && args[2] == NULL) {
+        for (int i = 0; i < count; i++) {
+            printf("set %co %s\n", *shell_options[i].flag ? '-' : '+', shell_options[i].name);
+        }
+        return 1;
+    }
+    
+    for (int a = 1; args[a] != NULL; a += 2) {
+        int enable = strcmp(args[a], "-o") == 0;
+        if ((!enable && strcmp(args[a], "+o") != 0) || args[a + 1] == NULL) {
+            fprintf(stderr, "myshell: set: usage: set [-o|+o] [option]\n");
+            last_status = 2;
+            return 1;
+        }
+        int found = 0;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(args[a + 1], shell_options[i].name) == 0) {
+                *shell_options[i].flag = enable;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "myshell: set: %s: invalid option name\n", args[a + 1]);
+            last_status = 1;
+            return 1;
+        }
+    }
+    return 1;
+}
+
+int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Built-in: export [NAME[=value]...]. Without arguments, list the exported
+// variables.
+int builtin_export(char** args) {
+    if (args[1] == NULL) {
+        int count = 0;
+        while (var_envp[count] != NULL) count++;
+        char** sorted = arena_alloc(&cmd_arena, (count + 1) * sizeof(char*));
+        memcpy(sorted, var_envp, (count + 1) * sizeof(char*));
+        qsort(sorted, count, sizeof(char*), compare_strings);
+        for (int i = 0; i < count; i++) {
+            printf("export %s\n", sorted[i]);
+        }
+        return 1;
+    }
+    
+    for (int i = 1; args[i] != NULL; i++) {
+        char* eq = strchr(args[i], '=');
+        int failed = eq ? var_assign(args[i], eq - args[i], eq + 1, 1)
+                        : var_export(args[i], strlen(args[i]));
+        if (failed) {
+            fprintf(stderr, "myshell: export: `%s': not a valid identifier\n", args[i]);
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+// Built-in: unset [-f | -v] NAME...
+int builtin_unset(char** args) {
+    int i = 1;
+    int functions_only = 0;
+    for (; args[i] != NULL && (strcmp(args[i], "-f") == 0 || strcmp(args[i], "-v") == 0); i++) {
+        functions_only = args[i][1] == 'f';
+    }
+    for (; args[i] != NULL; i++) {
+        if (functions_only) {
+            function_unset(args[i]);
+            continue;
+        }
+        int len = strlen(args[i]);
+        if (!is_valid_name(args[i], len)) {
+            fprintf(stderr, "myshell: unset: `%s': not a valid identifier\n", args[i]);
+            last_status = 1;
+            continue;
+        }
+        var_unset(args[i], len);
+    }
+    return 1;
+}
+
+// Take control of the terminal and start handling SIGCHLD. Job control is
+// only enabled when the shell is interactive on a terminal; scripts leave
+// the terminal and Ctrl+C alone.
+void init_job_control(int want_interactive) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    
+    if (!want_interactive || !isatty(shell_terminal)) {
+        return;
+    }
+    interactive = 1;
+    
+    // Keep the terminal on a descriptor of our own: the shell may redirect
+    // its stdin while the jobs it starts meanwhile still need the terminal
+    int tty = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, TERMINAL_FD);
+    if (tty >= 0) shell_terminal = tty;
+    
+    // Wait until we are in the foreground
+    while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    
+    // Ctrl+C, Ctrl+Z and background tty access are for the foreground job.
+    // Ctrl+C while the shell itself runs a loop stops the loop.
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    
+    // Put ourselves in our own process group (fails harmlessly for a session leader)
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(shell_pgid, shell_pgid) < 0) {
+        shell_pgid = getpgrp();
+    }
+    tcsetpgrp(shell_terminal, shell_pgid);
+    tcgetattr(shell_terminal, &shell_tmodes);
+    job_control = 1;
+}
+
+// Set up signals in a child that is about to exec or run shell code
+void child_signal_setup(Job* job) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    if (job && job->background && !job_control) {
+        // Without job control, background commands must not see Ctrl+C
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+    }
+    
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+// fork() for a child that runs shell code as part of a job. The child leaves
+// the parent's jobs alone and does not do job control itself.
+pid_t fork_in_job(Job* job) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        if (job_control) {
+            setpgid(0, job->pgid ? job->pgid : getpid());
+            if (job->foreground) {
+                tcsetpgrp(shell_terminal, job->pgid ? job->pgid : getpid());
+            }
+        }
+        child_signal_setup(job);
+        job_list = NULL;
+        job_control = 0;
+        interactive = 0;
+    } else if (pid > 0) {
+        job_place_process(job, pid);
+        job_add_process(job, pid);
+    } else {
+        perror("myshell");
+    }
+    return pid;
+}
+
+// Start an external program as part of a job. posix_spawn lets the C library
+// use vfork/CLONE_VM, so the cost does not grow with the size of the shell's
+// memory. Must be called with SIGCHLD blocked.
+// Returns the pid, or -1 after printing an error.
+pid_t launch_process(char** args, IoPlan* plan, Job* job) {
+    fflush(stdout);
+    fflush(stderr);
+    
+    // A myshell script runs in a copy of this shell instead of a new one.
+    // The path found here is the one spawned, so $PATH is searched once.
+    char path_buf[PATH_MAX];
+    struct stat st;
+    char* path = command_path(args[0], path_buf, sizeof(path_buf), &st);
+    if (path && is_own_script(path, &st)) {
+        pid_t pid = fork_in_job(job);
+        if (pid == 0) {
+            apply_io_plan(plan);
+            script_run_forked(path, args);
+        }
+        return pid;
+    }
+    if (path == NULL) path = args[0];
+    
+    if (use_posix_spawn) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+        // Let the child take the terminal itself before exec, so a program
+        // that reads the tty at once cannot beat our tcsetpgrp. This goes
+        // first: the terminal may be stdin, which the plan can replace.
+        if (job_control && job->foreground && job->pgid == 0) {
+            posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+        }
+#endif
+        for (int i = 0; i < plan->count; i++) {
+            FdMove* move = &plan->moves[i];
+            if (move->source < 0) {
+                posix_spawn_file_actions_addclose(&actions, move->fd);
+            } else {
+                posix_spawn_file_actions_adddup2(&actions, move->source, move->fd);
+            }
+        }
+        
+        // Signals the shell ignores go back to their defaults, and SIGCHLD
+        // (blocked while we launch) is unblocked
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        sigset_t defaults;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGPIPE);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+        if (job_control || !job->background) {
+            sigaddset(&defaults, SIGINT);
+            sigaddset(&defaults, SIGQUIT);
+        }
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        sigset_t empty;
+        sigemptyset(&empty);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+        
+        if (job_control) {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            posix_spawnattr_setpgroup(&attr, job->pgid);
+        }
+        posix_spawnattr_setflags(&attr, flags);
+        
+        pid_t pid;
+        int err = posix_spawnp(&pid, path, &actions, &attr, args, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (err != 0) {
+            // The child may have taken the terminal before exec failed
+            if (job_control && job->foreground && job->pgid == 0) {
+                tcsetpgrp(shell_terminal, shell_pgid);
+            }
+            report_exec_error(args[0], err);
+            errno = err;
+            return -1;
+        }
+        job_place_process(job, pid);
+        job_add_process(job, pid);
+        return pid;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        if (job_control) {
+            setpgid(0, job->pgid ? job->pgid : getpid());
+            if (job->foreground) {
+                tcsetpgrp(shell_terminal, job->pgid ? job->pgid : getpid());
+            }
+        }
+        child_signal_setup(job);
+        apply_io_plan(plan);
+        execvp(path, args);
+        int err = errno;
+        report_exec_error(args[0], err);
+        _exit(exec_status(err));
+    } else if (pid < 0) {
+        int err = errno;
+        perror("myshell");
+        errno = err;
+        return -1;
+    }
+    job_place_process(job, pid);
+    job_add_process(job, pid);
+    return pid;
+}
+
+// Run a builtin or a shell function in the current process
+int run_builtin(int builtin, char** args) {
+    if (builtin == FUNCTION_CALL) {
+        return function_call(args);
+    }
+    int result = (*builtin_funcs[builtin])(args);
+    builtin_check_output(args[0]);
+    return result;
+}
+
+// The shell's own descriptors that a plan replaced while a builtin or a
+// compound command runs in the shell
+typedef struct {
+    int* saved;  // -1 where the descriptor was not open before
+    int applied;
+    int touched_stdin;
+} FdSave;
+
+// Apply the plan to the shell's descriptors, keeping copies of the ones it
+// replaces. Returns -1 if a move failed; io_plan_restore undoes the moves
+// made either way.
+int io_plan_apply_saved(IoPlan* plan, FdSave* save) {
+    fflush(stdout);
+    fflush(stderr);
+    
+    save->saved = arena_alloc(&cmd_arena, plan->count * sizeof(int));
+    save->applied = 0;
+    save->touched_stdin = 0;
+    
+    for (; save->applied < plan->count; save->applied++) {
+        FdMove* move = &plan->moves[save->applied];
+        save->saved[save->applied] = fcntl(move->fd, F_DUPFD_CLOEXEC, 10);
+        if (move->fd == STDIN_FILENO) save->touched_stdin = 1;
+        
+        if (move->source < 0) {
+            close(move->fd);
+        } else if (dup2(move->source, move->fd) < 0) {
+            fprintf(stderr, "myshell: %d: %s\n", move->source, strerror(errno));
+            if (save->saved[save->applied] >= 0) close(save->saved[save->applied]);
+            last_status = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Put back the descriptors io_plan_apply_saved replaced
+void io_plan_restore(IoPlan* plan, FdSave* save) {
+    // What is still buffered belongs to the redirected descriptor
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        if (errno != EPIPE) fprintf(stderr, "myshell: write error: %s\n", strerror(errno));
+        last_status = 1;
+    }
+    fflush(stderr);
+    for (int i = save->applied - 1; i >= 0; i--) {
+        if (save->saved[i] >= 0) {
+            dup2(save->saved[i], plan->moves[i].fd);
+            close(save->saved[i]);
+        } else {
+            close(plan->moves[i].fd);
+        }
+    }
+    if (save->touched_stdin) {
+        // Drop anything stdio buffered from the redirected input
+        __fpurge(stdin);
+        clearerr(stdin);
+    }
+    clearerr(stdout);
+}
+
+// Run a builtin in the shell process with its descriptors temporarily moved
+// according to the plan. The original descriptors are restored afterwards.
+int run_builtin_redirected(int builtin, char** args, IoPlan* plan) {
+    if (plan->count == 0) {
+        return run_builtin(builtin, args);
+    }
+    
+    FdSave save;
+    int result = 1;
+    if (io_plan_apply_saved(plan, &save) == 0) {
+        result = run_builtin(builtin, args);
+    }
+    io_plan_restore(plan, &save);
+    return result;
+}
+
+// Execute piped commands. External stages are spawned; one builtin stage (the
+// last one in the pipeline) runs inside the shell after all other stages are
+// running, so it never has to wait on a stage that has not started. Any other
+// builtin stages need concurrency and are forked, as are compound commands
+// and everything in a background pipeline. All stages share one job and
+// process group.
+int execute_piped_commands(Node* pipeline, int background) {
+    TimeCapture* timing = time_capture;
+    time_capture = NULL;
+    int stage_count = pipeline->child_count;
+    int pipe_count = stage_count - 1;
+    int* pipefds = arena_alloc(&cmd_arena, 2 * pipe_count * sizeof(int));
+    char*** stage_args = arena_alloc(&cmd_arena, stage_count * sizeof(char**));
+    int* builtins = arena_alloc(&cmd_arena, stage_count * sizeof(int));
+    int* subst_from = arena_alloc(&cmd_arena, stage_count * sizeof(int));
+    int* subst_to = arena_alloc(&cmd_arena, stage_count * sizeof(int));
+    int inline_stage = -1;
+    
+    for (int i = 0; i < stage_count; i++) {
+        subst_from[i] = proc_subst_count;
+        if (pipeline->children[i]->type != NODE_COMMAND) {
+            // A compound command expands its words as it runs
+            stage_args[i] = NULL;
+            builtins[i] = -1;
+            subst_to[i] = proc_subst_count;
+            continue;
+        }
+        stage_args[i] = expand_words(pipeline->children[i]);
+        subst_to[i] = proc_subst_count;
+        builtins[i] = stage_args[i][0] ? find_builtin(stage_args[i][0]) : -1;
+        if (builtins[i] >= 0 && !background && i == stage_count - 1) {
+            inline_stage = i;
+        }
+    }
+    if (expand_failed) return expand_abort();
+    
+    // Close-on-exec pipes: each child only keeps the ends moved onto 0 and 1
+    for (int i = 0; i < pipe_count; i++) {
+        if (pipe2(pipefds + i * 2, O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int j = 0; j < i * 2; j++) close(pipefds[j]);
+            start_substitutions(NULL);
+            last_status = 1;
+            return 1;
+        }
+        apply_pipe_size(pipefds[i * 2 + 1]);
+    }
+    
+    Job* job = job_new(pipeline->text, pipeline->text_len, background);
+    job->timing = timing;
+    sigset_t prev;
+    block_sigchld(&prev);
+    job_register(job);
+    
+    IoPlan inline_plan = {0};
+    int inline_ok = 0;
+    int inline_slot = -1;
+    
+    // Every stage adds exactly one entry to the job, in order, so the job's
+    // process list doubles as PIPESTATUS
+    for (int i = 0; i < stage_count; i++) {
+        Node* stage = pipeline->children[i];
+        char** args = stage_args[i];
+        IoPlan plan = {0};
+        
+        if (i > 0) {
+            io_plan_add(&plan, STDIN_FILENO, pipefds[(i - 1) * 2]);
+        }
+        if (i < pipe_count) {
+            io_plan_add(&plan, STDOUT_FILENO, pipefds[i * 2 + 1]);
+        }
+        
+        int before = proc_subst_count;
+        int redirected = open_redirections(stage->redirects, &plan);
+        io_plan_take_substs(&plan, subst_from[i], subst_to[i]);
+        io_plan_take_substs(&plan, before, proc_subst_count);
+        if (redirected < 0) {
+            close_io_plan(&plan);
+            job_add_status(job, 1);
+            continue;
+        }
+        if (args == NULL) {
+            pid_t pid = fork_in_job(job);
+            if (pid == 0) {
+                apply_io_plan(&plan);
+                for (int j = 0; j < 2 * pipe_count; j++) {
+                    close(pipefds[j]);
+                }
+                // The plan already holds the command's own redirections
+                stage->redirects = NULL;
+                last_status = 0;
+                vm_run_node(stage);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            if (pid < 0) job_add_status(job, 1);
+            start_fanouts(&plan, job);
+            close_io_plan(&plan);
+            continue;
+        }
+        if (args[0] == NULL) {
+            // A "< file" stage feeds the file into the pipeline
+            int has_input = 0;
+            for (Redirect* r = stage->redirects; r != NULL; r = r->next) {
+                if (r->op == TOK_LESS) has_input = 1;
+            }
+            if (!has_input) {
+                job_add_status(job, 0);
+            } else {
+                pid_t pid = fork_in_job(job);
+                if (pid == 0) {
+                    apply_io_plan(&plan);
+                    for (int j = 0; j < 2 * pipe_count; j++) {
+                        close(pipefds[j]);
+                    }
+                    _exit(splice_stream(STDIN_FILENO, STDOUT_FILENO) < 0 ? 1 : 0);
+                }
+                if (pid < 0) job_add_status(job, 1);
+                start_fanouts(&plan, job);
+            }
+            close_io_plan(&plan);
+            continue;
+        }
+        
+        if (i == inline_stage) {
+            inline_plan = plan;
+            inline_ok = 1;
+            inline_slot = job_add_status(job, 0);
+            start_fanouts(&plan, job);
+            continue;
+        }
+        
+        if (builtins[i] >= 0) {
+            pid_t pid = fork_in_job(job);
+            if (pid == 0) {
+                apply_io_plan(&plan);
+                for (int j = 0; j < 2 * pipe_count; j++) {
+                    close(pipefds[j]);
+                }
+                assign_variables(stage, 1);
+                last_status = 0;
+                run_builtin(builtins[i], args);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            if (pid < 0) job_add_status(job, 1);
+        } else {
+            var_push_scope();
+            assign_variables(stage, 1);
+            if (launch_process(args, &plan, job) < 0) {
+                job_add_status(job, exec_status(errno));
+            }
+            var_pop_scope();
+        }
+        start_fanouts(&plan, job);
+        close_io_plan(&plan);
+    }
+    
+    start_substitutions(job);
+    
+    // Close all pipe fds in parent, except the ends the inline builtin uses
+    for (int i = 0; i < 2 * pipe_count; i++) {
+        int keep = inline_ok && ((inline_stage > 0 && i == (inline_stage - 1) * 2) ||
+                                 (inline_stage < pipe_count && i == inline_stage * 2 + 1));
+        if (!keep) {
+            close(pipefds[i]);
+            pipefds[i] = -1;
+        }
+    }
+    
+    if (inline_ok) {
+        // The other stages are running; let them make progress while the
+        // builtin runs. The status of an exit inside a pipeline is ignored,
+        // as in a subshell.
+        restore_sigmask(&prev);
+        UsageMark mark;
+        usage_mark(&mark);
+        var_push_scope();
+        assign_variables(pipeline->children[inline_stage], 1);
+        last_status = 0;
+        run_builtin_redirected(builtins[inline_stage], stage_args[inline_stage], &inline_plan);
+        var_pop_scope();
+        close_io_plan(&inline_plan);
+        for (int i = 0; i < 2 * pipe_count; i++) {
+            if (pipefds[i] >= 0) close(pipefds[i]);
+        }
+        block_sigchld(&prev);
+        job->procs[inline_slot].status = W_EXITCODE(last_status, 0);
+        usage_since(&mark, &job->procs[inline_slot]);
+    }
+    
+    finish_job(job, &prev);
+    return 1;
+}
+
+// Give up on a command whose expansion failed (${NAME?message}). A shell
+// that is not interactive exits, as POSIX asks; an interactive one drops the
+// rest of the command line. Returns 0 if the shell should exit.
+int expand_abort() {
+    expand_failed = 0;
+    start_substitutions(NULL);
+    last_status = 1;
+    if (!interactive) return 0;
+    interrupted = 1;
+    return 1;
+}
+
+// Execute a simple command
+int execute_command(Node* cmd, int background) {
+    TimeCapture* timing = time_capture;
+    time_capture = NULL;
+    char** args = expand_words(cmd);
+    if (expand_failed) return expand_abort();
+    
+    if (args[0] == NULL) {
+        // Only assignments and redirections, e.g. "x=1" or "> file". The
+        // status is that of the last command substitution, if any.
+        last_status = 0;
+        assign_variables(cmd, 0);
+        if (expand_failed) return expand_abort();
+        IoPlan plan = {0};
+        if (open_redirections(cmd->redirects, &plan) < 0) last_status = 1;
+        close_io_plan(&plan);
+        start_substitutions(NULL);
+        set_pipe_status(last_status);
+        return 1;
+    }
+    if (cmd->assign_count == 0) {
+        return execute_simple(cmd, args, background, timing);
+    }
+    
+    // NAME=value before a command only applies to that command
+    var_push_scope();
+    assign_variables(cmd, 1);
+    if (expand_failed) {
+        var_pop_scope();
+        return expand_abort();
+    }
+    int result = execute_simple(cmd, args, background, timing);
+    var_pop_scope();
+    return result;
+}
+
+// Run a simple command with its words expanded
+int execute_simple(Node* cmd, char** args, int background, TimeCapture* timing) {
+    ExpandBuf* capture = capture_output;
+    capture_output = NULL;
+    int builtin = find_builtin(args[0]);
+    IoPlan plan = {0};
+    
+    // For $(cmd) the program's output goes through a large pipe that the
+    // shell reads in bulk; redirections of the command still apply after it
+    int capture_fds[2] = {-1, -1};
+    if (capture && builtin < 0 && pipe2(capture_fds, O_CLOEXEC) == 0) {
+        fcntl(capture_fds[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+        io_plan_track(&plan, capture_fds[1]);
+        io_plan_add(&plan, STDOUT_FILENO, capture_fds[1]);
+    }
+    
+    int redirected = open_redirections(cmd->redirects, &plan);
+    io_plan_take_substs(&plan, 0, proc_subst_count);
+    if (redirected < 0) {
+        close_io_plan(&plan);
+        if (capture_fds[0] >= 0) close(capture_fds[0]);
+        start_substitutions(NULL);
+        last_status = 1;
+        set_pipe_status(last_status);
+        return 1;
+    }
+    
+    // Check for built-in commands
+    if (builtin >= 0 && !background) {
+        UsageMark mark;
+        if (timing) usage_mark(&mark);
+        
+        // Fan-out helpers and substituted commands run as a job of their
+        // own while the builtin runs
+        Job* helpers = NULL;
+        if (plan.fanout_count > 0 || proc_subst_count > 0) {
+            helpers = job_new(cmd->text, cmd->text_len, 1);
+            sigset_t prev;
+            block_sigchld(&prev);
+            job_register(helpers);
+            start_fanouts(&plan, helpers);
+            start_substitutions(helpers);
+            restore_sigmask(&prev);
+        }
+        
+        // A function starts out with the caller's $?
+        previous_status = last_status;
+        if (builtin != FUNCTION_CALL) last_status = 0;
+        int result = run_builtin_redirected(builtin, args, &plan);
+        close_io_plan(&plan);
+        if (helpers) {
+            int status = last_status;
+            wait_for_job(helpers);
+            last_status = status;
+        }
+        set_pipe_status(last_status);
+        if (timing) time_capture_builtin(timing, &mark);
+        return result;
+    }
+    
+    // Execute external command (or a builtin in the background) as a job
+    Job* job = job_new(cmd->text, cmd->text_len, background);
+    job->timing = timing;
+    sigset_t prev;
+    block_sigchld(&prev);
+    job_register(job);
+    
+    pid_t pid;
+    if (builtin >= 0) {
+        pid = fork_in_job(job);
+        if (pid == 0) {
+            apply_io_plan(&plan);
+            last_status = 0;
+            run_builtin(builtin, args);
+            fflush(stdout);
+            _exit(last_status);
+        }
+        if (pid < 0) job_add_status(job, 1);
+    } else if (launch_process(args, &plan, job) < 0) {
+        job_add_status(job, exec_status(errno));
+    }
+    start_fanouts(&plan, job);
+    start_substitutions(job);
+    close_io_plan(&plan);
+    if (capture_fds[0] >= 0) {
+        read_all(capture_fds[0], capture);
+        close(capture_fds[0]);
+    }
+    
+    finish_job(job, &prev);
+    return 1;
+}
+
+// Run a list in a forked copy of the shell as one background job
+void execute_in_background(Node* node) {
+    Job* job = job_new(node->text, node->text_len, 1);
+    sigset_t prev;
+    block_sigchld(&prev);
+    job_register(job);
+    
+    pid_t pid = fork_in_job(job);
+    if (pid == 0) {
+        node->background = 0;
+        if (node->type == NODE_SUBSHELL) {
+            // Already in a copy of the shell
+            vm_run_node(node);
+        } else {
+            execute_node(node);
+        }
+        fflush(stdout);
+        _exit(last_status);
+    }
+    finish_job(job, &prev);
+}
+
+// Run ( list ) in a forked copy of the shell, as a foreground job of its
+// own, so nothing it changes reaches the shell
+int subshell_run(Node* node) {
+    Job* job = job_new(node->text, node->text_len, 0);
+    job->timing = time_capture;
+    time_capture = NULL;
+    sigset_t prev;
+    block_sigchld(&prev);
+    job_register(job);
+    
+    pid_t pid = fork_in_job(job);
+    if (pid == 0) {
+        last_status = 0;
+        vm_run_node(node);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0) job_add_status(job, 1);
+    finish_job(job, &prev);
+    return 1;
+}
+
+// Builtins that change the state of the shell. In a command substitution
+// they run in a subshell, so the change does not leak out.
+char* subshell_builtins[] = {
+    "cd", "exit", "exec", "source", "alias", "mark", "unmark", "jump",
+    "fg", "bg", "wait", "set", "export", "unset", "local", "return",
+    "break", "continue", "read", "enable", NULL
+};
+
+// The only simple command of a program, or NULL if it has more to it
+Node* single_command(Node* node) {
+    while (node->type == NODE_LIST && node->child_count == 1 && !node->children[0]->background) {
+        node = node->children[0];
+    }
+    return node->type == NODE_COMMAND && !node->background ? node : NULL;
+}
+
+// How a command substitution runs
+typedef enum {
+    SUBST_SUBSHELL,  // in a forked copy of the shell
+    SUBST_BUILTIN,   // in the shell, output in a memory file
+    SUBST_EXTERNAL,  // started directly, output through a pipe
+    SUBST_FILE       // $(< file): just read the file
+} SubstMode;
+
+SubstMode subst_mode(Node* cmd) {
+    if (cmd == NULL) return SUBST_SUBSHELL;
+    if (cmd->word_count == 0) {
+        Redirect* r = cmd->redirects;
+        return r && r->next == NULL && r->op == TOK_LESS && r->fd == STDIN_FILENO ? SUBST_FILE : SUBST_SUBSHELL;
+    }
+    if (cmd->word_count == cmd->assign_count) return SUBST_SUBSHELL;
+    
+    // Decide from the command name as written; names that need expanding
+    // take the general path
+    Word* first = &cmd->words[cmd->assign_count];
+    for (int i = 0; i < first->len; i++) {
+        if (strchr("$`'\"\\", first->start[i])) return SUBST_SUBSHELL;
+    }
+    char* name = arena_strndup(&cmd_arena, first->start, first->len);
+    int builtin = find_builtin(name);
+    if (builtin < 0) return SUBST_EXTERNAL;
+    if (builtin == FUNCTION_CALL) return SUBST_SUBSHELL;
+    for (int i = 0; subshell_builtins[i] != NULL; i++) {
+        if (strcmp(name, subshell_builtins[i]) == 0) return SUBST_SUBSHELL;
+    }
+    return SUBST_BUILTIN;
+}
+
+// Append the contents of a file, read with one pread where possible
+void read_file_into(int fd, ExpandBuf* out) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        expand_reserve(out, st.st_size);
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            ssize_t n = pread(fd, out->data + out->len, st.st_size - offset, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            out->len += n;
+            offset += n;
+        }
+        return;
+    }
+    read_all(fd, out);
+}
+
+// Run the command of $(...) or `...` and append its output, without trailing
+// newlines, to out. Builtins run in the shell with their output going to a
+// memory file, and a single external command is started directly with its
+// output read from a pipe; only other programs need a forked subshell.
+void command_subst(const char* command, int len, ExpandBuf* out) {
+    // Process substitutions and output capture of the substitution are its own
+    ProcSubst* outer_substs = proc_substs;
+    int outer_subst_count = proc_subst_count;
+    int outer_subst_cap = proc_subst_cap;
+    ExpandBuf* outer_capture = capture_output;
+    proc_substs = NULL;
+    proc_subst_count = 0;
+    proc_subst_cap = 0;
+    capture_output = NULL;
+    int start = out->len;
+    
+    Parser parser;
+    Node* program = parse_program(&parser, &cmd_arena, arena_strndup(&cmd_arena, command, len), len);
+    if (parser.status == PARSE_INCOMPLETE) {
+        fprintf(stderr, "myshell: command substitution: unexpected end of file\n");
+        last_status = 2;
+    } else if (parser.status == PARSE_ERROR) {
+        last_status = 2;
+    } else {
+        Node* cmd = single_command(program);
+        switch (subst_mode(cmd)) {
+            case SUBST_FILE: {
+                char* path = expand_word(&cmd->redirects->target);
+                int fd = open(path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                    fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+                    last_status = 1;
+                    break;
+                }
+                read_file_into(fd, out);
+                close(fd);
+                last_status = 0;
+                break;
+            }
+            case SUBST_EXTERNAL:
+                capture_output = out;
+                execute_node(program);
+                break;
+            case SUBST_BUILTIN: {
+                int fd = memfd_create("myshell-subst", MFD_CLOEXEC);
+                if (fd < 0) {
+                    fprintf(stderr, "myshell: command substitution: %s\n", strerror(errno));
+                    last_status = 1;
+                    break;
+                }
+                fflush(stdout);
+                int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+                dup2(fd, STDOUT_FILENO);
+                execute_node(program);
+                fflush(stdout);
+                if (saved >= 0) {
+                    dup2(saved, STDOUT_FILENO);
+                    close(saved);
+                } else {
+                    close(STDOUT_FILENO);
+                }
+                clearerr(stdout);
+                read_file_into(fd, out);
+                close(fd);
+                break;
+            }
+            case SUBST_SUBSHELL: {
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC) < 0) {
+                    fprintf(stderr, "myshell: pipe: %s\n", strerror(errno));
+                    last_status = 1;
+                    break;
+                }
+                fcntl(fds[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+                Job* job = job_new(command, len, 0);
+                sigset_t prev;
+                block_sigchld(&prev);
+                job_register(job);
+                pid_t pid = fork_in_job(job);
+                if (pid == 0) {
+                    dup2(fds[1], STDOUT_FILENO);
+                    execute_node(program);
+                    fflush(stdout);
+                    _exit(last_status);
+                }
+                if (pid < 0) job_add_status(job, 1);
+                close(fds[1]);
+                read_all(fds[0], out);
+                close(fds[0]);
+                finish_job(job, &prev);
+                break;
+            }
+        }
+    }
+    
+    // Anything the program did not start is closed
+    start_substitutions(NULL);
+    free(proc_substs);
+    proc_substs = outer_substs;
+    proc_subst_count = outer_subst_count;
+    proc_subst_cap = outer_subst_cap;
+    capture_output = outer_capture;
+    
+    while (out->len > start && out->data[out->len - 1] == '\n') {
+        out->len--;
+    }
+}
+
+// Execute a parse tree. Returns 0 if the shell should exit.
+int execute_node(Node* node) {
+    if (node == NULL) {
+        return 1;
+    }
+    
+    switch (node->type) {
+        case NODE_COMMAND:
+            return execute_command(node, node->background);
+        case NODE_PIPELINE: {
+            if (node->background && (node->negate || node->timed)) {
+                execute_in_background(node);
+                return 1;
+            }
+            TimeCapture capture;
+            if (node->timed) {
+                time_start(&capture, node->timed);
+                time_capture = &capture;
+            }
+            int result = 1;
+            if (node->child_count == 0) {
+                last_status = 0;
+                set_pipe_status(0);
+            } else if (node->child_count == 1 && node->children[0]->type == NODE_SUBSHELL) {
+                result = subshell_run(node->children[0]);
+            } else if (node->child_count == 1 && node->children[0]->type != NODE_COMMAND) {
+                // A compound command counts as one stage run by the shell
+                UsageMark mark;
+                usage_mark(&mark);
+                time_capture = NULL;
+                result = vm_run_node(node->children[0]);
+                if (node->timed) time_capture_builtin(&capture, &mark);
+            } else if (node->child_count == 1) {
+                result = execute_command(node->children[0], node->background);
+            } else {
+                result = execute_piped_commands(node, node->background);
+            }
+            if (node->timed) {
+                time_capture = NULL;
+                time_report(&capture, node);
+            }
+            if (node->negate) {
+                last_status = !last_status;
+            }
+            return result;
+        }
+        case NODE_AND:
+            if (node->background) {
+                execute_in_background(node);
+                return 1;
+            }
+            if (!execute_node(node->left)) return 0;
+            if (last_status == 0 && !control_pending()) return execute_node(node->right);
+            return 1;
+        case NODE_OR:
+            if (node->background) {
+                execute_in_background(node);
+                return 1;
+            }
+            if (!execute_node(node->left)) return 0;
+            if (last_status != 0 && !control_pending()) return execute_node(node->right);
+            return 1;
+        case NODE_LIST:
+            for (int i = 0; i < node->child_count; i++) {
+                if (!execute_node(node->children[i])) return 0;
+                if (control_pending()) break;
+            }
+            return 1;
+        case NODE_IF:
+        case NODE_WHILE:
+        case NODE_UNTIL:
+        case NODE_FOR:
+        case NODE_CASE:
+        case NODE_GROUP:
+        case NODE_COND:
+            if (node->background) {
+                execute_in_background(node);
+                return 1;
+            }
+            return vm_run_node(node);
+        case NODE_SUBSHELL:
+            if (node->background) {
+                execute_in_background(node);
+                return 1;
+            }
+            return subshell_run(node);
+        case NODE_FUNCTION:
+            function_define(node);
+            last_status = 0;
+            return 1;
+    }
+    return 1;
+}
+
+// Core utilities
+
+// echo, printf, test and friends run inside the shell instead of as
+// programs, so a script loop made of them starts no processes. Output goes
+// through stdio and is written out when the builtin returns, before the
+// shell writes anything else, such as the next command's error on stderr.
+// "enable -n name" turns a builtin off to use the program.
+
+// Write out what a builtin left in stdout's buffer and report a failed
+// write. A reader that has gone away (EPIPE) is not reported, just as a
+// program writing to it would die of SIGPIPE quietly.
+void builtin_check_output(const char* name) {
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        if (errno != EPIPE) fprintf(stderr, "myshell: %s: write error: %s\n", name, strerror(errno));
+        clearerr(stdout);
+        last_status = 1;
+    }
+}
+
+// Append what the backslash escape at s[*i] (the character after the
+// backslash) stands for and move *i to its last character. Octal escapes
+// are \nnn in printf formats and \0nnn in echo -e and printf %b.
+// Returns 1 for \c, which ends the output.
+int append_escape(ExpandBuf* out, const char* s, int* i, int echo_form) {
+    char c = s[*i];
+    char value;
+    switch (c) {
+        case 'a': value = '\a'; break;
+        case 'b': value = '\b'; break;
+        case 'e': value = 27; break;
+        case 'f': value = '\f'; break;
+        case 'n': value = '\n'; break;
+        case 'r': value = '\r'; break;
+        case 't': value = '\t'; break;
+        case 'v': value = '\v'; break;
+        case '\\': value = '\\'; break;
+        case 'c': return 1;
+        case 'x': {
+            int n = 0, digits = 0;
+            while (digits < 2 && isxdigit((unsigned char)s[*i + 1])) {
+                char d = s[++*i];
+                n = n * 16 + (isdigit((unsigned char)d) ? d - '0' : tolower((unsigned char)d) - 'a' + 10);
+                digits++;
+            }
+            if (digits == 0) {
+                expand_append(out, "\\x", 2);
+                return 0;
+            }
+            value = n;
+            break;
+        }
+        default:
+            if (c >= '0' && c <= '7' && (!echo_form || c == '0')) {
+                int n = echo_form ? 0 : c - '0';
+                int digits = echo_form ? 0 : 1;
+                while (digits < 3 && s[*i + 1] >= '0' && s[*i + 1] <= '7') {
+                    n = n * 8 + (s[++*i] - '0');
+                    digits++;
+                }
+                value = n;
+                break;
+            }
+            // Not an escape: both characters stay
+            expand_append(out, s + *i - 1, c ? 2 : 1);
+            if (c == '\0') (*i)--;
+            return 0;
+    }
+    expand_append(out, &value, 1);
+    return 0;
+}
+
+// Built-in: echo [-neE] [arg...]
+int builtin_echo(char** args) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+    // An argument is only taken as options if every letter is one
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char* opt = args[i] + 1;
+        if (strspn(opt, "neE") != strlen(opt)) break;
+        for (; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            if (*opt == 'e') escapes = 1;
+            if (*opt == 'E') escapes = 0;
+        }
+    }
+    
+    if (!escapes) {
+        for (int first = i; args[i] != NULL; i++) {
+            if (i > first) putchar(' ');
+            fputs(args[i], stdout);
+        }
+        if (newline) putchar('\n');
+        return 1;
+    }
+    
+    ExpandBuf out = {arena_alloc(&cmd_arena, 256), 0, 256};
+    int stopped = 0;
+    for (int first = i; args[i] != NULL && !stopped; i++) {
+        if (i > first) expand_append(&out, " ", 1);
+        const char* s = args[i];
+        for (int k = 0; s[k] != '\0'; k++) {
+            if (s[k] != '\\') {
+                expand_append(&out, s + k, 1);
+                continue;
+            }
+            k++;
+            if (append_escape(&out, s, &k, 1)) {
+                stopped = 1;
+                break;
+            }
+        }
+    }
+    if (newline && !stopped) expand_append(&out, "\n", 1);
+    fwrite(out.data, 1, out.len, stdout);
+    return 1;
+}
+
+// Numeric printf argument: a number in C syntax, or 'c for the code of c.
+// A bad number is reported and the status becomes 1.
+long long printf_integer(const char* s, int is_unsigned) {
+    if (s[0] == '\'' || s[0] == '"') {
+        return (unsigned char)s[1];
+    }
+    char* end;
+    errno = 0;
+    long long value = is_unsigned && s[0] != '-' ? (long long)strtoull(s, &end, 0) : strtoll(s, &end, 0);
+    if (end == s || *end != '\0' || errno) {
+        fprintf(stderr, "myshell: printf: %s: invalid number\n", s);
+        last_status = 1;
+    }
+    return value;
+}
+
+double printf_double(const char* s) {
+    if (s[0] == '\'' || s[0] == '"') {
+        return (unsigned char)s[1];
+    }
+    char* end;
+    double value = strtod(s, &end);
+    if (end == s || *end != '\0') {
+        fprintf(stderr, "myshell: printf: %s: invalid number\n", s);
+        last_status = 1;
+    }
+    return value;
+}
+
+// Format one conversion with the C library into out
+void printf_convert(ExpandBuf* out, const char* spec, ...) {
+    va_list ap;
+    va_start(ap, spec);
+    char small[128];
+    int n = vsnprintf(small, sizeof(small), spec, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n < (int)sizeof(small)) {
+        expand_append(out, small, n);
+        return;
+    }
+    expand_reserve(out, n + 1);
+    va_start(ap, spec);
+    vsnprintf(out->data + out->len, n + 1, spec, ap);
+    va_end(ap);
+    out->len += n;
+}
+
+// Built-in: printf [-v NAME] format [arg...]. The format is reused while
+// arguments are left; missing arguments count as empty or 0.
+int builtin_printf(char** args) {
+    int i = 1;
+    char* target = NULL;
+    if (args[i] != NULL && strcmp(args[i], "-v") == 0) {
+        target = args[i + 1];
+        if (target == NULL || !is_valid_name(target, strlen(target))) {
+            fprintf(stderr, "myshell: printf: `%s': not a valid identifier\n", target ? target : "");
+            last_status = 2;
+            return 1;
+        }
+        i += 2;
+    }
+    if (args[i] != NULL && strcmp(args[i], "--") == 0) i++;
+    if (args[i] == NULL) {
+        fprintf(stderr, "printf: usage: printf [-v var] format [arguments]\n");
+        last_status = 2;
+        return 1;
+    }
+    
+    const char* format = args[i];
+    char** params = args + i + 1;
+    int param_count = 0;
+    while (params[param_count] != NULL) param_count++;
+    int next = 0;
+    
+    ExpandBuf out = {arena_alloc(&cmd_arena, 256), 0, 256};
+    int stopped = 0;
+    do {
+        int consumed = next;
+        for (int k = 0; format[k] != '\0' && !stopped; k++) {
+            if (format[k] == '\\') {
+                k++;
+                stopped = append_escape(&out, format, &k, 0);
+                continue;
+            }
+            if (format[k] != '%') {
+                expand_append(&out, format + k, 1);
+                continue;
+            }
+            if (format[k + 1] == '%') {
+                expand_append(&out, "%", 1);
+                k++;
+                continue;
+            }
+            
+            // %[flags][width][.precision]conversion, rebuilt for snprintf
+            // with * taken from the arguments
+            char spec[64];
+            int len = 0;
+            spec[len++] = '%';
+            k++;
+            while (format[k] && strchr("-+ #0", format[k]) && len < 16) spec[len++] = format[k++];
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (format[k] != '.') break;
+                    spec[len++] = format[k++];
+                }
+                if (format[k] == '*') {
+                    long long n = next < param_count ? printf_integer(params[next++], 0) : 0;
+                    len += snprintf(spec + len, 24, "%d", (int)n);
+                    k++;
+                } else {
+                    while (isdigit((unsigned char)format[k]) && len < 40) spec[len++] = format[k++];
+                }
+            }
+            char conv = format[k];
+            const char* arg = next < param_count ? params[next++] : NULL;
+            switch (conv) {
+                case 'd':
+                case 'i':
+                    strcpy(spec + len, "lld");
+                    printf_convert(&out, spec, arg ? printf_integer(arg, 0) : 0LL);
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    spec[len++] = 'l';
+                    spec[len++] = 'l';
+                    spec[len++] = conv;
+                    spec[len] = '\0';
+                    printf_convert(&out, spec, arg ? (unsigned long long)printf_integer(arg, 1) : 0ULL);
+                    break;
+                case 'f':
+                case 'F':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G':
+                case 'a':
+                case 'A':
+                    spec[len++] = conv;
+                    spec[len] = '\0';
+                    printf_convert(&out, spec, arg ? printf_double(arg) : 0.0);
+                    break;
+                case 'c':
+                    strcpy(spec + len, "c");
+                    printf_convert(&out, spec, arg && arg[0] ? arg[0] : '\0');
+                    break;
+                case 's':
+                    strcpy(spec + len, "s");
+                    printf_convert(&out, spec, arg ? arg : "");
+                    break;
+                case 'b': {
+                    // The argument with echo -e escapes, padded as a string
+                    ExpandBuf text = {arena_alloc(&cmd_arena, 64), 0, 64};
+                    for (int m = 0; arg && arg[m] != '\0' && !stopped; m++) {
+                        if (arg[m] != '\\') {
+                            expand_append(&text, arg + m, 1);
+                            continue;
+                        }
+                        m++;
+                        stopped = append_escape(&text, arg, &m, 1);
+                    }
+                    expand_append(&text, "", 1);
+                    strcpy(spec + len, "s");
+                    printf_convert(&out, spec, text.data);
+                    break;
+                }
+                default:
+                    fprintf(stderr, "myshell: printf: `%c': invalid format character\n", conv ? conv : '%');
+                    last_status = 1;
+                    stopped = 1;
+                    break;
+            }
+        }
+        if (next == consumed) break;  // no conversions take arguments
+    } while (next < param_count && !stopped);
+    
+    if (target) {
+        expand_append(&out, "", 1);
+        var_assign(target, strlen(target), out.data, 0);
+        return 1;
+    }
+    fwrite(out.data, 1, out.len, stdout);
+    return 1;
+}
+
+// test and [ parse their arguments as an expression:
+//   or := and ('-o' and)*    and := not ('-a' not)*    not := '!' not | primary
+//   primary := '(' or ')' | unary-op arg | arg binary-op arg | arg
+// A binary operator in second place wins, so [ "$a" = -f ] compares strings.
+typedef struct {
+    char** args;
+    int count;
+    int pos;
+    int error;         // the expression is invalid: status 2
+    const char* name;  // "test" or "["
+} TestParser;
+
+int test_is_binary(const char* s) {
+    static const char* ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef"
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(s, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+int test_is_unary(const char* s) {
+    return s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr("bcdefghknprstuwxzGLNOS", s[1]);
+}
+
+int test_integer(TestParser* t, const char* s, long long* value) {
+    char* end;
+    errno = 0;
+    *value = strtoll(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == s || *end != '\0' || errno) {
+        fprintf(stderr, "myshell: %s: %s: integer expression expected\n", t->name, s);
+        t->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+// File tests take what they need from one statx call per file. Access
+// tests ask the kernel instead, which also knows about ACLs and read-only
+// mounts.
+int file_statx(const char* path, int follow, unsigned int mask, struct statx* st) {
+    return statx(AT_FDCWD, path, follow ? 0 : AT_SYMLINK_NOFOLLOW, mask, st) == 0;
+}
+
+int statx_time_compare(struct statx_timestamp a, struct statx_timestamp b) {
+    if (a.tv_sec != b.tv_sec) return a.tv_sec > b.tv_sec ? 1 : -1;
+    if (a.tv_nsec != b.tv_nsec) return a.tv_nsec > b.tv_nsec ? 1 : -1;
+    return 0;
+}
+
+int test_unary(TestParser* t, char op, const char* arg) {
+    if (op == 'z') return arg[0] == '\0';
+    if (op == 'n') return arg[0] != '\0';
+    if (op == 't') {
+        long long fd;
+        return test_integer(t, arg, &fd) && isatty(fd);
+    }
+    if (op == 'r') return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    if (op == 'w') return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    if (op == 'x') return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    
+    struct statx st;
+    if (!file_statx(arg, op != 'L' && op != 'h', STATX_BASIC_STATS, &st)) return 0;
+    switch (op) {
+        case 'L':
+        case 'h': return S_ISLNK(st.stx_mode);
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.stx_mode);
+        case 'd': return S_ISDIR(st.stx_mode);
+        case 'b': return S_ISBLK(st.stx_mode);
+        case 'c': return S_ISCHR(st.stx_mode);
+        case 'p': return S_ISFIFO(st.stx_mode);
+        case 'S': return S_ISSOCK(st.stx_mode);
+        case 's': return st.stx_size > 0;
+        case 'g': return (st.stx_mode & S_ISGID) != 0;
+        case 'u': return (st.stx_mode & S_ISUID) != 0;
+        case 'k': return (st.stx_mode & S_ISVTX) != 0;
+        case 'O': return st.stx_uid == geteuid();
+        case 'G': return st.stx_gid == getegid();
+        case 'N': return statx_time_compare(st.stx_mtime, st.stx_atime) > 0;
+    }
+    return 0;
+}
+
+// Compare modification times: 1 if a is newer, -1 if older, 0 if the same.
+// A file that exists is newer than one that does not.
+int test_mtime_order(const char* a, const char* b) {
+    struct statx sa, sb;
+    int has_a = file_statx(a, 1, STATX_MTIME, &sa);
+    int has_b = file_statx(b, 1, STATX_MTIME, &sb);
+    if (!has_a || !has_b) return has_a - has_b;
+    return statx_time_compare(sa.stx_mtime, sb.stx_mtime);
+}
+
+int test_binary(TestParser* t, const char* a, const char* op, const char* b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+    if (strcmp(op, "-nt") == 0) return test_mtime_order(a, b) > 0;
+    if (strcmp(op, "-ot") == 0) return test_mtime_order(a, b) < 0;
+    if (strcmp(op, "-ef") == 0) {
+        struct statx sa, sb;
+        return file_statx(a, 1, STATX_INO, &sa) && file_statx(b, 1, STATX_INO, &sb) &&
+               sa.stx_dev_major == sb.stx_dev_major && sa.stx_dev_minor == sb.stx_dev_minor &&
+               sa.stx_ino == sb.stx_ino;
+    }
+    
+    long long x, y;
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) return 0;
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+int test_or(TestParser* t);
+
+int test_primary(TestParser* t) {
+    int left = t->count - t->pos;
+    if (left <= 0) {
+        fprintf(stderr, "myshell: %s: argument expected\n", t->name);
+        t->error = 1;
+        return 0;
+    }
+    char** a = t->args + t->pos;
+    if (left >= 3 && test_is_binary(a[1])) {
+        t->pos += 3;
+        return test_binary(t, a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "(") == 0 && left >= 2) {
+        t->pos++;
+        int result = test_or(t);
+        if (t->pos >= t->count || strcmp(t->args[t->pos], ")") != 0) {
+            if (!t->error) fprintf(stderr, "myshell: %s: `)' expected\n", t->name);
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return result;
+    }
+    if (left >= 2 && test_is_unary(a[0])) {
+        t->pos += 2;
+        return test_unary(t, a[0][1], a[1]);
+    }
+    t->pos++;
+    return a[0][0] != '\0';
+}
+
+int test_not(TestParser* t) {
+    int left = t->count - t->pos;
+    if (left >= 2 && strcmp(t->args[t->pos], "!") == 0 &&
+        !(left >= 3 && test_is_binary(t->args[t->pos + 1]))) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+int test_and(TestParser* t) {
+    int result = test_not(t);
+    while (!t->error && t->pos < t->count && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        int right = test_not(t);
+        result = result && right;
+    }
+    return result;
+}
+
+int test_or(TestParser* t) {
+    int result = test_and(t);
+    while (!t->error && t->pos < t->count && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        int right = test_and(t);
+        result = result || right;
+    }
+    return result;
+}
+
+// Built-in: test expr, or [ expr ]
+int builtin_test(char** args) {
+    TestParser t = {args + 1, 0, 0, 0, args[0]};
+    while (t.args[t.count] != NULL) t.count++;
+    if (strcmp(args[0], "[") == 0) {
+        if (t.count == 0 || strcmp(t.args[t.count - 1], "]") != 0) {
+            fprintf(stderr, "myshell: [: missing `]'\n");
+            last_status = 2;
+            return 1;
+        }
+        t.count--;
+    }
+    if (t.count == 0) {
+        last_status = 1;
+        return 1;
+    }
+    
+    int result = test_or(&t);
+    if (!t.error && t.pos < t.count) {
+        fprintf(stderr, "myshell: %s: %s: unexpected argument\n", t.name, t.args[t.pos]);
+        t.error = 1;
+    }
+    last_status = t.error ? 2 : !result;
+    return 1;
+}
+
+// [[ ]] evaluates its expression tree with the operators of test, except
+// that == and != match a glob pattern and =~ a regular expression. Operands
+// are expanded only when they are needed.
+
+// Compiled regular expressions in most recently used order. A loop matching
+// the same expression again and again finds it first.
+#define REGEX_CACHE_SIZE 32
+
+typedef struct {
+    char* source;
+    regex_t compiled;
+} CachedRegex;
+
+CachedRegex* regex_cache[REGEX_CACHE_SIZE];
+int regex_cache_count = 0;
+
+// Look up a compiled regular expression, compiling it on a miss and dropping
+// the least recently used one when the cache is full. Returns NULL after
+// reporting an invalid expression.
+regex_t* regex_get(const char* source) {
+    for (int i = 0; i < regex_cache_count; i++) {
+        CachedRegex* entry = regex_cache[i];
+        if (strcmp(entry->source, source) == 0) {
+            memmove(regex_cache + 1, regex_cache, i * sizeof(CachedRegex*));
+            regex_cache[0] = entry;
+            return &entry->compiled;
+        }
+    }
+    
+    CachedRegex* entry = malloc(sizeof(CachedRegex));
+    if (!entry) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    int err = regcomp(&entry->compiled, source, REG_EXTENDED);
+    if (err != 0) {
+        char message[256];
+        regerror(err, &entry->compiled, message, sizeof(message));
+        fprintf(stderr, "myshell: [[: %s: %s\n", source, message);
+        free(entry);
+        return NULL;
+    }
+    entry->source = strdup(source);
+    if (regex_cache_count == REGEX_CACHE_SIZE) {
+        CachedRegex* old = regex_cache[--regex_cache_count];
+        regfree(&old->compiled);
+        free(old->source);
+        free(old);
+    }
+    memmove(regex_cache + 1, regex_cache, regex_cache_count * sizeof(CachedRegex*));
+    regex_cache[0] = entry;
+    regex_cache_count++;
+    return &entry->compiled;
+}
+
+// Replace BASH_REMATCH with the match and groups of a successful =~, or
+// empty it
+void rematch_set(const char* subject, regmatch_t* groups, int count) {
+    for (int i = 0; i < rematch_count; i++) {
+        free(rematch[i]);
+    }
+    free(rematch);
+    rematch = NULL;
+    rematch_count = 0;
+    if (count == 0) return;
+    
+    rematch = malloc(count * sizeof(char*));
+    if (!rematch) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        // A group that did not take part in the match is empty
+        regoff_t start = groups[i].rm_so;
+        regoff_t len = start < 0 ? 0 : groups[i].rm_eo - start;
+        rematch[i] = strndup(start < 0 ? "" : subject + start, len);
+    }
+    rematch_count = count;
+}
+
+int cond_regex(TestParser* t, const char* subject, Word* word) {
+    regex_t* re = regex_get(expand_regex(word->start, word->len));
+    if (re == NULL) {
+        t->error = 1;
+        return 0;
+    }
+    int count = re->re_nsub + 1;
+    regmatch_t* groups = arena_alloc(&cmd_arena, count * sizeof(regmatch_t));
+    if (regexec(re, subject, count, groups, 0) != 0) {
+        rematch_set(NULL, NULL, 0);
+        return 0;
+    }
+    rematch_set(subject, groups, count);
+    return 1;
+}
+
+int cond_eval(TestParser* t, Node* node) {
+    if (t->error) return 0;
+    switch (node->cond_op) {
+        case COND_WORD:
+            return expand_word(&node->words[0])[0] != '\0';
+        case COND_UNARY:
+            return test_unary(t, node->words[0].start[1], expand_word(&node->words[1]));
+        case COND_BINARY: {
+            char* left = expand_word(&node->words[0]);
+            char* op = arena_strndup(&cmd_arena, node->words[1].start, node->words[1].len);
+            Word* right = &node->words[2];
+            if (strcmp(op, "=~") == 0) {
+                return cond_regex(t, left, right);
+            }
+            if (strcmp(op, "==") == 0 || strcmp(op, "=") == 0 || strcmp(op, "!=") == 0) {
+                Pattern* pat = pattern_get(expand_pattern(right->start, right->len));
+                return pattern_match(pat, left, strlen(left)) == (op[0] != '!');
+            }
+            return test_binary(t, left, op, expand_word(right));
+        }
+        case COND_NOT:
+            return !cond_eval(t, node->left);
+        case COND_AND:
+            return cond_eval(t, node->left) && cond_eval(t, node->right);
+        case COND_OR:
+            return cond_eval(t, node->left) || cond_eval(t, node->right);
+    }
+    return 0;
+}
+
+// Run a [[ ]] command: status 0 if true, 1 if false, 2 after an error
+int cond_execute(Node* node) {
+    TestParser t = {NULL, 0, 0, 0, "[["};
+    ArenaMark mark = arena_mark(&cmd_arena);
+    int result = cond_eval(&t, node);
+    arena_release(&cmd_arena, mark);
+    last_status = t.error ? 2 : !result;
+    return expand_failed ? expand_abort() : 1;
+}
+
+// Built-in: true, and its POSIX spelling :
+int builtin_true(char** args) {
+    (void)args;
+    return 1;
+}
+
+// Built-in: false
+int builtin_false(char** args) {
+    (void)args;
+    last_status = 1;
+    return 1;
+}
+
+// Built-in: pwd [-L | -P]. -L prints $PWD while it still names the current
+// directory; -P and the default print the physical path.
+int builtin_pwd(char** args) {
+    int logical = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-L") == 0) {
+            logical = 1;
+        } else if (strcmp(args[i], "-P") == 0) {
+            logical = 0;
+        } else {
+            fprintf(stderr, "myshell: pwd: %s: invalid option\n", args[i]);
+            last_status = 2;
+            return 1;
+        }
+    }
+    
+    char* pwd = var_lookup("PWD");
+    struct stat here, named;
+    if (logical && pwd && pwd[0] == '/' && stat(".", &here) == 0 && stat(pwd, &named) == 0 &&
+        here.st_dev == named.st_dev && here.st_ino == named.st_ino) {
+        puts(pwd);
+    } else {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            fprintf(stderr, "myshell: pwd: %s\n", strerror(errno));
+            last_status = 1;
+            return 1;
+        }
+        puts(cwd);
+    }
+    return 1;
+}
+
+// Input for read. A seekable file is read in blocks and the offset put back
+// after the line, so the next command starts where read stopped; pipes and
+// terminals have to be read a byte at a time.
+typedef struct {
+    int fd;
+    int seekable;
+    char buf[4096];
+    int pos;
+    int len;
+} ReadInput;
+
+// Next byte, or -1 at end of input or on an error
+int read_input_byte(ReadInput* in) {
+    if (in->pos == in->len) {
+        ssize_t n;
+        do {
+            n = read(in->fd, in->buf, in->seekable ? sizeof(in->buf) : 1);
+        } while (n < 0 && errno == EINTR && !interrupted);
+        if (n <= 0) return -1;
+        in->pos = 0;
+        in->len = n;
+    }
+    return (unsigned char)in->buf[in->pos++];
+}
+
+// Split a line read by read into fields by IFS and assign them. Escaped
+// characters (flagged in escaped) never separate fields.
+void read_assign(char** names, int name_count, ExpandBuf* line, const char* escaped) {
+    char* ifs = var_lookup("IFS");
+    if (ifs == NULL) ifs = " \t\n";
+    const char* s = line->data;
+    int len = line->len;
+    int i = 0;
+    
+    #define READ_IS_IFS(k) (!escaped[k] && s[k] != '\0' && strchr(ifs, s[k]))
+    #define READ_IS_SPACE(k) (READ_IS_IFS(k) && isspace((unsigned char)s[k]))
+    while (i < len && READ_IS_SPACE(i)) i++;
+    for (int n = 0; n < name_count; n++) {
+        int start = i;
+        int end;
+        if (n == name_count - 1) {
+            // The last name takes the rest, less trailing IFS white space
+            end = len;
+            while (end > start && READ_IS_SPACE(end - 1)) end--;
+            i = len;
+        } else {
+            while (i < len && !READ_IS_IFS(i)) i++;
+            end = i;
+            while (i < len && READ_IS_SPACE(i)) i++;
+            if (i < len && READ_IS_IFS(i)) {
+                i++;
+                while (i < len && READ_IS_SPACE(i)) i++;
+            }
+        }
+        char* value = arena_strndup(&cmd_arena, s + start, end - start);
+        var_assign(names[n], strlen(names[n]), value, 0);
+    }
+    #undef READ_IS_IFS
+    #undef READ_IS_SPACE
+}
+
+// Built-in: read [-rs] [-p prompt] [-d delim] [-n count] [-u fd] [name...]
+// Reads a line and splits it into the named variables, or REPLY.
+int builtin_read(char** args) {
+    int raw = 0, silent = 0, fd = STDIN_FILENO;
+    int delim = '\n';
+    long count = -1;
+    char* prompt = NULL;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (char* opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'r') {
+                raw = 1;
+                continue;
+            }
+            if (*opt == 's') {
+                silent = 1;
+                continue;
+            }
+            // The other options take a value: the rest of this argument or the next one
+            char* value = opt[1] ? opt + 1 : args[i + 1];
+            if (!strchr("pdnu", *opt) || value == NULL) {
+                fprintf(stderr, "myshell: read: -%c: %s\n", *opt,
+                        strchr("pdnu", *opt) ? "option requires an argument" : "invalid option");
+                last_status = 2;
+                return 1;
+            }
+            if (*opt == 'p') prompt = value;
+            if (*opt == 'd') delim = (unsigned char)value[0];
+            if (*opt == 'n') count = strtol(value, NULL, 10);
+            if (*opt == 'u') fd = strtol(value, NULL, 10);
+            if (!opt[1]) i++;
+            break;
+        }
+    }
+    char** names = args + i;
+    int name_count = 0;
+    for (; names[name_count] != NULL; name_count++) {
+        if (!is_valid_name(names[name_count], strlen(names[name_count]))) {
+            fprintf(stderr, "myshell: read: `%s': not a valid identifier\n", names[name_count]);
+            last_status = 1;
+            return 1;
+        }
+    }
+    
+    int tty = isatty(fd);
+    struct termios saved_tmodes;
+    if (tty && prompt) {
+        fputs(prompt, stderr);
+    }
+    if (tty && silent && tcgetattr(fd, &saved_tmodes) == 0) {
+        struct termios quiet = saved_tmodes;
+        quiet.c_lflag &= ~ECHO;
+        tcsetattr(fd, TCSAFLUSH, &quiet);
+    } else {
+        silent = 0;
+    }
+    
+    // Ctrl+C has to end a read that is waiting, not restart it
+    struct sigaction saved_sigint, sigint;
+    sigaction(SIGINT, NULL, &saved_sigint);
+    sigint = saved_sigint;
+    sigint.sa_flags &= ~SA_RESTART;
+    sigaction(SIGINT, &sigint, NULL);
+    
+    ReadInput* in = arena_alloc(&cmd_arena, sizeof(ReadInput));
+    in->fd = fd;
+    in->seekable = !tty && lseek(fd, 0, SEEK_CUR) >= 0;
+    in->pos = 0;
+    in->len = 0;
+    
+    ExpandBuf line = {arena_alloc(&cmd_arena, 128), 0, 128};
+    ExpandBuf escaped = {arena_alloc(&cmd_arena, 128), 0, 128};
+    int status = 1;  // end of input before the delimiter
+    while (count < 0 || line.len < count) {
+        int c = read_input_byte(in);
+        if (c < 0) break;
+        if (c == delim) {
+            status = 0;
+            break;
+        }
+        char flag = 0;
+        if (c == '\\' && !raw) {
+            c = read_input_byte(in);
+            if (c < 0) break;
+            if (c == '\n') continue;  // line continuation
+            flag = 1;
+        }
+        char ch = c;
+        expand_append(&line, &ch, 1);
+        expand_append(&escaped, &flag, 1);
+    }
+    if (count >= 0 && line.len >= count) status = 0;
+    if (in->seekable && in->pos < in->len) {
+        lseek(fd, in->pos - in->len, SEEK_CUR);
+    }
+    sigaction(SIGINT, &saved_sigint, NULL);
+    if (silent) {
+        tcsetattr(fd, TCSAFLUSH, &saved_tmodes);
+        fputc('\n', stderr);
+    }
+    
+    expand_append(&line, "", 1);
+    line.len--;
+    if (name_count == 0) {
+        var_assign("REPLY", 5, line.data, 0);
+    } else {
+        read_assign(names, name_count, &line, escaped.data);
+    }
+    if (interrupted) status = 130;
+    last_status = status;
+    return 1;
+}
+
+// Built-in: enable [-n] [name...]. A disabled builtin is looked up as a
+// program instead, e.g. "enable -n echo test [" to time the external tools.
+// Without names, list the enabled builtins, or with -n the disabled ones.
+int builtin_enable(char** args) {
+    int disable = 0;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-n") == 0) {
+        disable = 1;
+        i++;
+    }
+    if (args[i] == NULL) {
+        for (int b = 0; b < num_builtins(); b++) {
+            if (builtin_disabled[b] == disable) {
+                printf("enable %s%s\n", disable ? "-n " : "", builtin_names[b]);
+            }
+        }
+        return 1;
+    }
+    for (; args[i] != NULL; i++) {
+        int found = 0;
+        for (int b = 0; b < num_builtins(); b++) {
+            if (strcmp(args[i], builtin_names[b]) == 0) {
+                builtin_disabled[b] = disable;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "myshell: enable: %s: not a shell builtin\n", args[i]);
+            last_status = 1;
+        }
+    }
+    return 1;
+}
+
+// Control flow
+
+// Compound commands are compiled into a flat array of instructions that a
+// small interpreter runs. Loops jump back instead of walking the tree again,
+// break and continue become jumps, and nesting costs no C stack. Simple
+// commands, pipelines and anything that needs a job of its own (a background
+// list, a compound command with redirections) stay whole as OP_RUN and go
+// through execute_node. A compound command is compiled the first time it
+// runs; function bodies are compiled once when they are defined.
+
+typedef enum {
+    OP_RUN,          // execute_node(node)
+    OP_JUMP,         // go to target
+    OP_JUMP_FALSE,   // go to target if the last status is not 0
+    OP_JUMP_TRUE,    // go to target if the last status is 0
+    OP_STATUS_ZERO,  // an if without a branch taken succeeds
+    OP_LOOP_START,   // enter loop arg; node is set for a for loop
+    OP_LOOP_SAVE,    // an iteration of loop arg ended with the last status
+    OP_LOOP_END,     // leave loop arg with the status of its last iteration
+    OP_FOR_NEXT,     // assign the next word of loop arg, or go to target
+    OP_CASE,         // go to the body of the clause that matches, or target
+    OP_DEFINE        // define the function node
+} OpCode;
+
+typedef struct {
+    OpCode op;
+    int arg;     // loop number, or the clause bodies' index in case_targets
+    int target;  // jump destination
+    int loop;    // innermost loop around the instruction, -1 if none
+    Node* node;
+} Instr;
+
+typedef struct {
+    int parent;           // enclosing loop, -1 if none
+    int depth;            // loops around the body, counting this one
+    int continue_target;  // the condition, or OP_FOR_NEXT
+    int end;              // OP_LOOP_END
+} LoopInfo;
+
+typedef struct Code {
+    Instr* instrs;
+    int count;
+    int cap;
+    LoopInfo* loops;
+    int loop_count;
+    int loop_cap;
+    int* case_targets;
+    int case_count;
+    int case_cap;
+} Code;
+
+typedef struct {
+    Arena* arena;  // owns the code; the same arena as the tree
+    Code* code;
+    int loop;      // loop being compiled, -1 if none
+} Compiler;
+
+// State of a running loop
+typedef struct {
+    ArenaMark mark;  // released when the loop ends
+    char** words;    // for loop: the expanded word list
+    int count;
+    int next;
+    int status;      // status of the last finished iteration
+} LoopState;
+
+Code* compile_body(Arena* arena, Node* node);
+void compile_node(Compiler* c, Node* node);
+
+int is_compound(Node* node) {
+    return node->type >= NODE_IF && node->type <= NODE_SUBSHELL;
+}
+
+int compile_emit(Compiler* c, OpCode op, Node* node) {
+    Code* code = c->code;
+    code->instrs = arena_grow(c->arena, code->instrs, code->count, &code->cap, sizeof(Instr));
+    Instr* instr = &code->instrs[code->count];
+    instr->op = op;
+    instr->arg = 0;
+    instr->target = -1;
+    instr->loop = c->loop;
+    instr->node = node;
+    return code->count++;
+}
+
+// Compile a command that execute_node will run in the shell, so it is not
+// compiled again, into memory released, on every pass through a loop
+void compile_nested(Compiler* c, Node* node) {
+    if (node->type != NODE_COMMAND && node->type != NODE_FUNCTION && node->type != NODE_COND &&
+        node->code == NULL) {
+        node->code = compile_body(c->arena, node);
+    }
+}
+
+void compile_loop(Compiler* c, Node* node) {
+    Code* code = c->code;
+    int loop = code->loop_count;
+    code->loops = arena_grow(c->arena, code->loops, code->loop_count, &code->loop_cap, sizeof(LoopInfo));
+    code->loop_count++;
+    code->loops[loop].parent = c->loop;
+    code->loops[loop].depth = c->loop < 0 ? 1 : code->loops[c->loop].depth + 1;
+    
+    int start = compile_emit(c, OP_LOOP_START, node->type == NODE_FOR ? node : NULL);
+    code->instrs[start].arg = loop;
+    c->loop = loop;
+    int top = code->count;
+    int exit_jump;
+    if (node->type == NODE_FOR) {
+        exit_jump = compile_emit(c, OP_FOR_NEXT, node);
+        code->instrs[exit_jump].arg = loop;
+        compile_node(c, node->left);
+    } else {
+        compile_node(c, node->left);
+        exit_jump = compile_emit(c, node->type == NODE_WHILE ? OP_JUMP_FALSE : OP_JUMP_TRUE, NULL);
+        compile_node(c, node->right);
+    }
+    int save = compile_emit(c, OP_LOOP_SAVE, NULL);
+    code->instrs[save].arg = loop;
+    int back = compile_emit(c, OP_JUMP, NULL);
+    code->instrs[back].target = top;
+    c->loop = code->loops[loop].parent;
+    int end = compile_emit(c, OP_LOOP_END, NULL);
+    code->instrs[end].arg = loop;
+    code->instrs[exit_jump].target = end;
+    code->loops[loop].continue_target = top;
+    code->loops[loop].end = end;
+}
+
+// Compile a command in place, ignoring its own redirections and &
+void compile_inner(Compiler* c, Node* node) {
+    Code* code = c->code;
+    switch (node->type) {
+        case NODE_COMMAND:
+        case NODE_PIPELINE:
+        case NODE_COND:
+            compile_emit(c, OP_RUN, node);
+            break;
+        case NODE_LIST:
+            for (int i = 0; i < node->child_count; i++) {
+                compile_node(c, node->children[i]);
+            }
+            break;
+        case NODE_AND:
+        case NODE_OR: {
+            compile_node(c, node->left);
+            int skip = compile_emit(c, node->type == NODE_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE, NULL);
+            compile_node(c, node->right);
+            code->instrs[skip].target = code->count;
+            break;
+        }
+        case NODE_IF: {
+            int* ends = arena_alloc(c->arena, node->child_count * sizeof(int));
+            int end_count = 0;
+            int i = 0;
+            for (; i + 1 < node->child_count; i += 2) {
+                compile_node(c, node->children[i]);
+                int next = compile_emit(c, OP_JUMP_FALSE, NULL);
+                compile_node(c, node->children[i + 1]);
+                ends[end_count++] = compile_emit(c, OP_JUMP, NULL);
+                code->instrs[next].target = code->count;
+            }
+            if (i < node->child_count) {
+                compile_node(c, node->children[i]);
+            } else {
+                compile_emit(c, OP_STATUS_ZERO, NULL);
+            }
+            for (int k = 0; k < end_count; k++) {
+                code->instrs[ends[k]].target = code->count;
+            }
+            break;
+        }
+        case NODE_WHILE:
+        case NODE_UNTIL:
+        case NODE_FOR:
+            compile_loop(c, node);
+            break;
+        case NODE_CASE: {
+            int op = compile_emit(c, OP_CASE, node);
+            int base = code->case_count;
+            code->instrs[op].arg = base;
+            for (int i = 0; i < node->child_count; i++) {
+                code->case_targets = arena_grow(c->arena, code->case_targets, code->case_count,
+                                                &code->case_cap, sizeof(int));
+                code->case_targets[code->case_count++] = -1;
+            }
+            int* ends = arena_alloc(c->arena, (node->child_count + 1) * sizeof(int));
+            for (int i = 0; i < node->child_count; i++) {
+                code->case_targets[base + i] = code->count;
+                compile_inner(c, node->children[i]);
+                ends[i] = compile_emit(c, OP_JUMP, NULL);
+            }
+            for (int i = 0; i < node->child_count; i++) {
+                code->instrs[ends[i]].target = code->count;
+            }
+            code->instrs[op].target = code->count;
+            break;
+        }
+        case NODE_GROUP:
+        case NODE_SUBSHELL:
+            compile_node(c, node->left);
+            break;
+        case NODE_FUNCTION:
+            compile_emit(c, OP_DEFINE, node);
+            break;
+    }
+}
+
+void compile_node(Compiler* c, Node* node) {
+    if (node->background) {
+        compile_emit(c, OP_RUN, node);
+    } else if (node->type == NODE_PIPELINE) {
+        for (int i = 0; i < node->child_count; i++) {
+            compile_nested(c, node->children[i]);
+        }
+        compile_emit(c, OP_RUN, node);
+    } else if (node->type == NODE_SUBSHELL || (is_compound(node) && node->redirects)) {
+        compile_nested(c, node);
+        compile_emit(c, OP_RUN, node);
+    } else {
+        compile_inner(c, node);
+    }
+}
+
+// Compile a compound command's body into the arena
+Code* compile_body(Arena* arena, Node* node) {
+    Code* code = arena_alloc(arena, sizeof(Code));
+    memset(code, 0, sizeof(Code));
+    Compiler c = {arena, code, -1};
+    compile_inner(&c, node);
+    return code;
+}
+
+// A break, continue or return waiting to be carried out, or Ctrl+C
+int control_pending() {
+    return pending_break || pending_continue || pending_return || interrupted;
+}
+
+// Index of the first clause of a case command with a pattern matching the
+// subject, or -1
+int vm_case(Node* node) {
+    char* subject = expand_word(&node->words[0]);
+    int len = strlen(subject);
+    for (int i = 0; i < node->child_count; i++) {
+        Node* clause = node->children[i];
+        for (int k = 0; k < clause->word_count; k++) {
+            char* pattern = expand_pattern(clause->words[k].start, clause->words[k].len);
+            if (pattern_match(pattern_get(pattern), subject, len)) return i;
+        }
+    }
+    return -1;
+}
+
+// Carry out a pending break or continue raised inside the given loop.
+// Returns where to go on, or -1 if the request reaches past this code: the
+// levels left stay pending for the code around it.
+int vm_unwind(Code* code, LoopState* states, int loop) {
+    int is_break = pending_break > 0;
+    int levels = is_break ? pending_break : pending_continue;
+    int skipped = -1;
+    while (levels > 1 && loop >= 0) {
+        skipped = loop;
+        loop = code->loops[loop].parent;
+        levels--;
+    }
+    if (loop < 0) {
+        if (is_break) {
+            pending_break = levels;
+        } else {
+            pending_continue = levels;
+        }
+        return -1;
+    }
+    pending_break = 0;
+    pending_continue = 0;
+    if (is_break) {
+        states[loop].status = 0;
+        return code->loops[loop].end;
+    }
+    // The loops continue leaves never reach their OP_LOOP_END
+    if (skipped >= 0) {
+        arena_release(&cmd_arena, states[skipped].mark);
+    }
+    return code->loops[loop].continue_target;
+}
+
+// Run compiled code. Returns 0 if the shell should exit.
+int vm_execute(Code* code) {
+    LoopState* states = NULL;
+    if (code->loop_count > 0) {
+        states = arena_alloc(&cmd_arena, code->loop_count * sizeof(LoopState));
+    }
+    int base_depth = loop_depth;
+    int result = 1;
+    int pc = 0;
+    
+    while (pc < code->count) {
+        Instr* instr = &code->instrs[pc++];
+        switch (instr->op) {
+            case OP_RUN: {
+                loop_depth = base_depth + (instr->loop >= 0 ? code->loops[instr->loop].depth : 0);
+                ArenaMark mark = arena_mark(&cmd_arena);
+                result = execute_node(instr->node);
+                arena_release(&cmd_arena, mark);
+                if (!result || pending_return || interrupted) {
+                    pc = code->count;
+                } else if (pending_break || pending_continue) {
+                    pc = vm_unwind(code, states, instr->loop);
+                    if (pc < 0) pc = code->count;
+                }
+                break;
+            }
+            case OP_JUMP:
+                pc = instr->target;
+                break;
+            case OP_JUMP_FALSE:
+                if (last_status != 0) pc = instr->target;
+                break;
+            case OP_JUMP_TRUE:
+                if (last_status == 0) pc = instr->target;
+                break;
+            case OP_STATUS_ZERO:
+                last_status = 0;
+                break;
+            case OP_LOOP_START: {
+                LoopState* state = &states[instr->arg];
+                state->mark = arena_mark(&cmd_arena);
+                state->status = 0;
+                if (instr->node == NULL) break;
+                state->next = 0;
+                if (instr->node->has_in) {
+                    ArgList words = {0};
+                    expand_word_list(instr->node->words, instr->node->word_count, &words);
+                    if (expand_failed) {
+                        result = expand_abort();
+                        pc = code->count;
+                        break;
+                    }
+                    state->words = words.items;
+                    state->count = words.count;
+                } else {
+                    state->words = positional;
+                    state->count = positional_count;
+                }
+                break;
+            }
+            case OP_LOOP_SAVE:
+                states[instr->arg].status = last_status;
+                if (interrupted) pc = code->count;
+                break;
+            case OP_LOOP_END:
+                last_status = states[instr->arg].status;
+                arena_release(&cmd_arena, states[instr->arg].mark);
+                break;
+            case OP_FOR_NEXT: {
+                LoopState* state = &states[instr->arg];
+                if (state->next >= state->count) {
+                    pc = instr->target;
+                    break;
+                }
+                Word* name = &instr->node->name;
+                var_assign(name->start, name->len, state->words[state->next++], 0);
+                break;
+            }
+            case OP_CASE: {
+                ArenaMark mark = arena_mark(&cmd_arena);
+                int clause = vm_case(instr->node);
+                arena_release(&cmd_arena, mark);
+                if (expand_failed) {
+                    result = expand_abort();
+                    pc = code->count;
+                    break;
+                }
+                last_status = 0;
+                pc = clause < 0 ? instr->target : code->case_targets[instr->arg + clause];
+                break;
+            }
+            case OP_DEFINE:
+                function_define(instr->node);
+                last_status = 0;
+                break;
+        }
+    }
+    
+    loop_depth = base_depth;
+    if (interrupted && last_status == 0) last_status = 130;
+    return result;
+}
+
+// Run a compound command, or a [[ ]] command, in the shell. Its
+// redirections apply to the whole body, with the shell's descriptors put
+// back afterwards.
+int vm_run_node(Node* node) {
+    if (node->code == NULL && node->type != NODE_COND) {
+        node->code = compile_body(&cmd_arena, node);
+    }
+    if (node->redirects == NULL) {
+        return node->type == NODE_COND ? cond_execute(node) : vm_execute(node->code);
+    }
+    
+    IoPlan plan = {0};
+    int before = proc_subst_count;
+    int redirected = open_redirections(node->redirects, &plan);
+    io_plan_take_substs(&plan, before, proc_subst_count);
+    if (redirected < 0) {
+        close_io_plan(&plan);
+        start_substitutions(NULL);
+        last_status = 1;
+        return 1;
+    }
+    
+    // As for a builtin, fan-out helpers and substituted commands run as a
+    // job of their own alongside the body
+    Job* helpers = NULL;
+    if (plan.fanout_count > 0 || proc_subst_count > 0) {
+        helpers = job_new(node->text, node->text_len, 1);
+        sigset_t prev;
+        block_sigchld(&prev);
+        job_register(helpers);
+        start_fanouts(&plan, helpers);
+        start_substitutions(helpers);
+        restore_sigmask(&prev);
+    }
+    
+    FdSave save;
+    int result = 1;
+    if (io_plan_apply_saved(&plan, &save) == 0) {
+        result = node->type == NODE_COND ? cond_execute(node) : vm_execute(node->code);
+    }
+    io_plan_restore(&plan, &save);
+    close_io_plan(&plan);
+    if (helpers) {
+        int status = last_status;
+        wait_for_job(helpers);
+        last_status = status;
+    }
+    return result;
+}
+
+// Functions
+
+Word word_copy(Arena* arena, Word word) {
+    if (word.start != NULL) {
+        word.start = arena_strndup(arena, word.start, word.len);
+    }
+    return word;
+}
+
+// Copy a tree into another arena, so a function body outlives the command
+// line that defined it
+Node* node_copy(Arena* arena, Node* node) {
+    if (node == NULL) return NULL;
+    Node* copy = arena_alloc(arena, sizeof(Node));
+    *copy = *node;
+    copy->code = NULL;
+    copy->name = word_copy(arena, node->name);
+    if (node->text) {
+        copy->text = arena_strndup(arena, node->text, node->text_len);
+    }
+    if (node->word_count > 0) {
+        copy->words = arena_alloc(arena, node->word_count * sizeof(Word));
+        for (int i = 0; i < node->word_count; i++) {
+            copy->words[i] = word_copy(arena, node->words[i]);
+        }
+    }
+    
+    Redirect** tail = &copy->redirects;
+    for (Redirect* r = node->redirects; r != NULL; r = r->next) {
+        Redirect* rc = arena_alloc(arena, sizeof(Redirect));
+        *rc = *r;
+        rc->target = word_copy(arena, r->target);
+        if (r->delimiter) rc->delimiter = arena_strdup(arena, r->delimiter);
+        if (r->body) rc->body = arena_strndup(arena, r->body, r->body_len);
+        rc->next = NULL;
+        rc->next_heredoc = NULL;
+        *tail = rc;
+        tail = &rc->next;
+    }
+    
+    if (node->child_count > 0) {
+        copy->children = arena_alloc(arena, node->child_count * sizeof(Node*));
+        for (int i = 0; i < node->child_count; i++) {
+            copy->children[i] = node_copy(arena, node->children[i]);
+        }
+    }
+    copy->left = node_copy(arena, node->left);
+    copy->right = node_copy(arena, node->right);
+    return copy;
+}
+
+Function* function_find(const char* name) {
+    for (int i = 0; i < function_count; i++) {
+        if (strcmp(functions[i].name, name) == 0) return &functions[i];
+    }
+    return NULL;
+}
+
+void function_release(FunctionBody* body) {
+    if (--body->refs > 0) return;
+    arena_free(&body->arena);
+    free(body);
+}
+
+// Define or redefine a function from its definition node
+void function_define(Node* node) {
+    FunctionBody* body = calloc(1, sizeof(FunctionBody));
+    if (!body) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    body->node = node_copy(&body->arena, node->left);
+    body->node->code = compile_body(&body->arena, body->node);
+    body->refs = 1;
+    
+    char* name = arena_strndup(&cmd_arena, node->name.start, node->name.len);
+    Function* f = function_find(name);
+    if (f) {
+        function_release(f->body);
+        f->body = body;
+        return;
+    }
+    if (function_count == function_cap) {
+        function_cap = function_cap ? function_cap * 2 : 8;
+        functions = realloc(functions, function_cap * sizeof(Function));
+        if (!functions) {
+            fprintf(stderr, "myshell: allocation error\n");
+            exit(1);
+        }
+    }
+    functions[function_count].name = strdup(name);
+    functions[function_count].body = body;
+    function_count++;
+}
+
+void function_unset(const char* name) {
+    Function* f = function_find(name);
+    if (f == NULL) return;
+    free(f->name);
+    function_release(f->body);
+    *f = functions[--function_count];
+}
+
+// Call a shell function: the arguments become $1..$N, local variables live
+// in a scope of its own, and return ends it
+int function_call(char** args) {
+    Function* f = function_find(args[0]);
+    if (f == NULL) {
+        report_exec_error(args[0], ENOENT);
+        last_status = 127;
+        return 1;
+    }
+    if (function_depth >= FUNCTION_MAX_DEPTH) {
+        fprintf(stderr, "myshell: %s: maximum function nesting level exceeded (%d)\n",
+                args[0], FUNCTION_MAX_DEPTH);
+        last_status = 1;
+        return 1;
+    }
+    
+    // Hold the body: the function may redefine or unset itself
+    FunctionBody* body = f->body;
+    body->refs++;
+    char** saved_positional = positional;
+    int saved_count = positional_count;
+    int saved_loop_depth = loop_depth;
+    positional = args + 1;
+    positional_count = 0;
+    while (positional[positional_count] != NULL) positional_count++;
+    loop_depth = 0;
+    function_depth++;
+    var_push_scope();
+    
+    int result = vm_run_node(body->node);
+    
+    var_pop_scope();
+    function_depth--;
+    loop_depth = saved_loop_depth;
+    positional = saved_positional;
+    positional_count = saved_count;
+    pending_return = 0;
+    function_release(body);
+    return result;
+}
+
+// Built-in: local NAME[=value]...
+int builtin_local(char** args) {
+    if (function_depth == 0) {
+        fprintf(stderr, "myshell: local: can only be used in a function\n");
+        last_status = 1;
+        return 1;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        char* equal = strchr(args[i], '=');
+        int len = equal ? equal - args[i] : (int)strlen(args[i]);
+        if (!is_valid_name(args[i], len)) {
+            fprintf(stderr, "myshell: local: `%s': not a valid identifier\n", args[i]);
+            last_status = 1;
+            continue;
+        }
+        var_local(args[i], len);
+        if (equal) var_assign(args[i], len, equal + 1, 0);
+    }
+    return 1;
+}
+
+// Built-in: return [n]
+int builtin_return(char** args) {
+    if (function_depth == 0 && source_depth == 0) {
+        fprintf(stderr, "myshell: return: can only `return' from a function or sourced script\n");
+        last_status = 1;
+        return 1;
+    }
+    last_status = previous_status;
+    if (args[1] != NULL) {
+        char* end;
+        long value = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            fprintf(stderr, "myshell: return: %s: numeric argument required\n", args[1]);
+            value = 2;
+        }
+        last_status = value & 0xff;
+    }
+    pending_return = 1;
+    return 1;
+}
+
+// Shared by break and continue: ask to leave n loops, or to go on with the
+// nth one around the command
+int loop_control(char** args, int* pending) {
+    int levels = 1;
+    if (args[1] != NULL) {
+        char* end;
+        long value = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0' || value < 1) {
+            fprintf(stderr, "myshell: %s: %s: loop count out of range\n", args[0], args[1]);
+            last_status = 1;
+            return 1;
+        }
+        levels = value < loop_depth ? value : loop_depth;
+    }
+    if (loop_depth == 0) {
+        fprintf(stderr, "myshell: %s: only meaningful in a `for', `while', or `until' loop\n", args[0]);
+        return 1;
+    }
+    *pending = levels;
+    return 1;
+}
+
+// Built-in: break [n]
+int builtin_break(char** args) {
+    return loop_control(args, &pending_break);
+}
+
+// Built-in: continue [n]
+int builtin_continue(char** args) {
+    return loop_control(args, &pending_continue);
+}
+
+// Parse and execute one command line. Returns 0 if the shell should exit.
+int run_command_line(char* line) {
+    // The tree points into line, which the caller keeps until this returns.
+    // Everything for this line is released when it finishes.
+    ArenaMark mark = arena_mark(&cmd_arena);
+    Parser parser;
+    Node* program = parse_program(&parser, &cmd_arena, line, strlen(line));
+    int result = 1;
+    
+    if (parser.status == PARSE_INCOMPLETE) {
+        fprintf(stderr, "myshell: syntax error: unexpected end of file\n");
+        last_status = 2;
+    } else if (parser.status == PARSE_ERROR) {
+        last_status = 2;
+    } else {
+        result = execute_node(program);
+    }
+    
+    arena_release(&cmd_arena, mark);
+    return result;
+}
+
+// Parallel
+
+// parallel runs a command once per argument, each in a forked copy of the
+// shell so functions, aliases and variables carry over. Each worker takes the
+// next argument as soon as its job ends, so a slow job never holds up the
+// others. A job's output is collected in memory files and written in one
+// piece when it ends. The shell sleeps in poll() on pidfds until a job exits.
+// With --pipe, stdin is cut into blocks at line ends instead, and each block
+// is the input of one job; the outputs come out in the order of the blocks.
+#define PARALLEL_READ_SIZE 65536
+#define PARALLEL_BLOCK_SIZE (1 << 20)
+
+typedef struct {
+    pid_t pid;
+    int pidfd;   // -1 once the job has been reaped
+    int out;     // memory files holding the job's stdout and stderr
+    int err;
+    long seq;    // position of the argument in the input
+    int status;
+} ParallelJob;
+
+// Where the arguments come from: the words after ::: or the lines or blocks
+// of stdin
+typedef struct {
+    char** args;
+    char* buf;
+    size_t len;
+    size_t pos;
+    size_t cap;
+    int eof;
+} ParallelInput;
+
+// Next argument, or NULL at the end. A line from stdin stays valid until the
+// next call. Unless may_read is set, only lines already read are returned and
+// NULL means none is complete yet.
+char* parallel_next(ParallelInput* in, int may_read) {
+    if (in->args != NULL) return *in->args ? *in->args++ : NULL;
+    while (!interrupted) {
+        char* start = in->buf + in->pos;
+        char* newline = memchr(start, '\n', in->len - in->pos);
+        if (newline != NULL) {
+            *newline = '\0';
+            in->pos = newline + 1 - in->buf;
+            return start;
+        }
+        if (in->eof) {
+            if (in->pos == in->len) return NULL;
+            in->buf[in->len] = '\0';
+            in->pos = in->len;
+            return start;
+        }
+        if (!may_read) return NULL;
+        
+        // Move the partial line to the front and read more after it
+        memmove(in->buf, start, in->len - in->pos);
+        in->len -= in->pos;
+        in->pos = 0;
+        if (in->cap < in->len + PARALLEL_READ_SIZE + 1) {
+            in->cap = in->len + PARALLEL_READ_SIZE + 1;
+            in->buf = realloc(in->buf, in->cap);
+        }
+        ssize_t n = read(STDIN_FILENO, in->buf + in->len, PARALLEL_READ_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in->eof = 1;
+        else in->len += n;
+    }
+    return NULL;
+}
+
+// Next block of stdin for --pipe in a memory file: about block bytes, cut
+// after the last newline so no line is split. A line longer than a block
+// makes a block of its own. Returns -1 at the end, or when may_read is not
+// set and no whole block has been read yet.
+int parallel_block(ParallelInput* in, size_t block, int may_read) {
+    while (!interrupted) {
+        char* start = in->buf + in->pos;
+        size_t avail = in->len - in->pos;
+        size_t size = 0;
+        if (avail >= block) {
+            char* end = memrchr(start, '\n', block);
+            if (end == NULL) end = memchr(start + block, '\n', avail - block);
+            if (end != NULL) size = end + 1 - start;
+        }
+        if (size == 0 && in->eof) size = avail;
+        if (size > 0) {
+            int fd = memfd_create("myshell-parallel", MFD_CLOEXEC);
+            if (fd < 0 || write_all(fd, start, size) < 0) {
+                fprintf(stderr, "myshell: parallel: %s\n", strerror(errno));
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            lseek(fd, 0, SEEK_SET);
+            in->pos += size;
+            return fd;
+        }
+        if (in->eof || !may_read) return -1;
+        
+        memmove(in->buf, start, avail);
+        in->len = avail;
+        in->pos = 0;
+        if (in->cap < in->len + PARALLEL_READ_SIZE + 1) {
+            in->cap = 2 * in->len + PARALLEL_READ_SIZE + 1;
+            in->buf = realloc(in->buf, in->cap);
+        }
+        ssize_t n = read(STDIN_FILENO, in->buf + in->len, in->cap - in->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) in->eof = 1;
+        else in->len += n;
+    }
+    return -1;
+}
+
+// Append text as one single-quoted word
+void parallel_quote(ExpandBuf* out, const char* s, int len) {
+    expand_append(out, "'", 1);
+    int start = 0;
+    for (int i = 0; i < len; i++) {
+        if (s[i] == '\'') {
+            expand_append(out, s + start, i - start);
+            expand_append(out, "'\\''", 4);
+            start = i + 1;
+        }
+    }
+    expand_append(out, s + start, len - start);
+    expand_append(out, "'", 1);
+}
+
+// The part of arg named by the replacement string {name}. Returns 0 if name
+// is not one.
+int parallel_part(const char* name, int n, const char* arg, const char** part, int* len) {
+    const char* slash = strrchr(arg, '/');
+    const char* base = slash ? slash + 1 : arg;
+    int strip = 0;  // drop the extension
+    
+    if (n == 0 || (n == 1 && name[0] == '.')) {
+        *part = arg;
+        strip = n;
+    } else if (n == 1 && name[0] == '/') {
+        *part = base;
+    } else if (n == 2 && name[0] == '/' && name[1] == '/') {
+        *part = slash ? arg : ".";
+        *len = slash ? (slash == arg ? 1 : slash - arg) : 1;
+        return 1;
+    } else if (n == 2 && name[0] == '/' && name[1] == '.') {
+        *part = base;
+        strip = 1;
+    } else {
+        return 0;
+    }
+    
+    *len = strlen(*part);
+    for (int i = *len - 1; strip && i > 0 && (*part)[i] != '/'; i--) {
+        if ((*part)[i] == '.' && (*part)[i - 1] != '/') {
+            *len = i;
+            break;
+        }
+    }
+    return 1;
+}
+
+// The command line for one argument. {} is the argument, {.} the argument
+// without its extension, {/} its base name, {//} its directory, {/.} the base
+// name without extension and {#} the job number. Without any of them the
+// argument is added at the end; an empty template runs each argument as a
+// command. Allocated in the command arena.
+char* parallel_line(const char* template, const char* arg, long seq) {
+    int arg_len = strlen(arg);
+    int cap = strlen(template) + arg_len + 16;
+    ExpandBuf out = {arena_alloc(&cmd_arena, cap), 0, cap};
+    int used = template[0] == '\0';
+    
+    if (used) expand_append(&out, arg, arg_len);
+    for (const char* p = template; *p != '\0'; ) {
+        const char* close = *p == '{' ? strchr(p, '}') : NULL;
+        const char* part;
+        int len;
+        if (close != NULL && close - p == 2 && p[1] == '#') {
+            expand_append_int(&out, seq + 1);
+        } else if (close != NULL && parallel_part(p + 1, close - p - 1, arg, &part, &len)) {
+            parallel_quote(&out, part, len);
+        } else {
+            expand_append(&out, p++, 1);
+            continue;
+        }
+        used = 1;
+        p = close + 1;
+    }
+    if (!used) {
+        expand_append(&out, " ", 1);
+        parallel_quote(&out, arg, arg_len);
+    }
+    out.data[out.len] = '\0';
+    return out.data;
+}
+
+// Fork a copy of the shell to run line with its output going to memory
+// files and its input from input, or /dev/null if it is -1. Returns 0 if the
+// job could not be started.
+int parallel_start(ParallelJob* job, char* line, int input) {
+    job->out = memfd_create("myshell-parallel", MFD_CLOEXEC);
+    job->err = memfd_create("myshell-parallel", MFD_CLOEXEC);
+    job->pid = -1;
+    if (job->out >= 0 && job->err >= 0) {
+        fflush(stdout);
+        fflush(stderr);
+        job->pid = fork();
+    }
+    
+    if (job->pid == 0) {
+        child_signal_setup(NULL);
+        job_list = NULL;
+        job_control = 0;
+        interactive = 0;
+        if (input < 0) input = open("/dev/null", O_RDONLY);
+        if (input >= 0) dup2(input, STDIN_FILENO);
+        dup2(job->out, STDOUT_FILENO);
+        dup2(job->err, STDERR_FILENO);
+        last_status = 0;
+        run_command_line(expand_aliases(line));
+        fflush(stdout);
+        fflush(stderr);
+        _exit(last_status);
+    }
+    if (job->pid < 0) {
+        fprintf(stderr, "myshell: parallel: %s\n", strerror(errno));
+        if (job->out >= 0) close(job->out);
+        if (job->err >= 0) close(job->err);
+        return 0;
+    }
+    
+    // Without pidfds (Linux before 5.3) the jobs run one at a time
+    job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+    if (job->pidfd < 0) {
+        while (waitpid(job->pid, &job->status, 0) < 0 && errno == EINTR);
+    }
+    return 1;
+}
+
+// Write out a finished job's output and release it. Returns 1 if it failed.
+int parallel_emit(ParallelJob* job) {
+    fflush(stdout);
+    fflush(stderr);
+    lseek(job->out, 0, SEEK_SET);
+    splice_stream(job->out, STDOUT_FILENO);
+    lseek(job->err, 0, SEEK_SET);
+    splice_stream(job->err, STDERR_FILENO);
+    close(job->out);
+    close(job->err);
+    return job->status != 0;
+}
+
+// Built-in: parallel [-j N] [-k] [command...] [::: argument...]
+//           parallel --pipe [-j N] [--block size] command...
+int builtin_parallel(char** args) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long workers = cpus < 1 ? 1 : cpus;
+    int keep_order = 0;
+    int pipe_mode = 0;
+    long block = PARALLEL_BLOCK_SIZE;
+    int i = 1;
+    
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+        } else if (strcmp(args[i], "--pipe") == 0) {
+            pipe_mode = 1;
+            keep_order = 1;
+        } else if (strcmp(args[i], "--block") == 0) {
+            block = args[i + 1] ? parse_size(args[++i]) : -1;
+            if (block <= 0) {
+                fprintf(stderr, "myshell: parallel: --block needs a size such as 64K or 1M\n");
+                last_status = 2;
+                return 1;
+            }
+        } else if (strncmp(args[i], "-j", 2) == 0) {
+            char* value = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+            char* end = NULL;
+            workers = value ? strtol(value, &end, 10) : 0;
+            if (value == NULL || end == value || *end != '\0' || workers < 0) {
+                fprintf(stderr, "myshell: parallel: -j needs a number\n");
+                last_status = 2;
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "myshell: parallel: %s: invalid option\n", args[i]);
+            fprintf(stderr, "usage: parallel [-j N] [-k] [command...] [::: argument...]\n");
+            fprintf(stderr, "       parallel --pipe [-j N] [--block size] command...\n");
+            last_status = 2;
+            return 1;
+        }
+    }
+    
+    // The template is the command words as one line, parsed again per job
+    ExpandBuf template = {arena_alloc(&cmd_arena, 64), 0, 64};
+    ParallelInput input = {0};
+    for (; args[i] != NULL && strcmp(args[i], ":::") != 0; i++) {
+        if (template.len > 0) expand_append(&template, " ", 1);
+        expand_append(&template, args[i], strlen(args[i]));
+    }
+    template.data[template.len] = '\0';
+    if (pipe_mode && (template.len == 0 || args[i] != NULL)) {
+        fprintf(stderr, "myshell: parallel: --pipe needs a command and reads stdin\n");
+        last_status = 2;
+        return 1;
+    }
+    if (args[i] != NULL) {
+        input.args = args + i + 1;
+    } else {
+        input.cap = PARALLEL_READ_SIZE + 1;
+        input.buf = malloc(input.cap);
+    }
+    
+    // Each job holds three descriptors until its output is written
+    struct rlimit limit;
+    long budget = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        budget = ((long)limit.rlim_cur - 64) / 3;
+    }
+    if (budget < 1) budget = 1;
+    if (workers == 0 || workers > budget) workers = budget;
+    
+    ParallelJob* running = arena_alloc(&cmd_arena, workers * sizeof(ParallelJob));
+    struct pollfd* fds = arena_alloc(&cmd_arena, (workers + 1) * sizeof(struct pollfd));
+    // With -k, finished jobs wait here for the ones before them
+    ParallelJob* held = keep_order ? arena_alloc(&cmd_arena, budget * sizeof(ParallelJob)) : NULL;
+    int run_count = 0;
+    int held_count = 0;
+    long seq = 0;
+    long next_out = 0;
+    long failed = 0;
+    int more = 1;
+    int input_ready = 0;
+    int signalled = 0;
+    
+    // Ctrl+C has to end a wait or a read of stdin, not restart it
+    struct sigaction saved_sigint, sigint;
+    sigaction(SIGINT, NULL, &saved_sigint);
+    sigint = saved_sigint;
+    sigint.sa_flags &= ~SA_RESTART;
+    sigaction(SIGINT, &sigint, NULL);
+    
+    while (1) {
+        while (more && !interrupted && run_count < workers && run_count + held_count < budget) {
+            // Waiting for stdin is only done when no job could finish
+            // meanwhile; otherwise poll() says when there is more
+            int may_read = input_ready || run_count == 0;
+            char* arg = NULL;
+            int block_fd = -1;
+            if (pipe_mode) {
+                block_fd = parallel_block(&input, block, may_read);
+            } else {
+                arg = parallel_next(&input, may_read);
+            }
+            input_ready = 0;
+            if (arg == NULL && block_fd < 0) {
+                if (may_read) more = 0;
+                break;
+            }
+            ParallelJob* job = &running[run_count];
+            ArenaMark mark = arena_mark(&cmd_arena);
+            job->seq = seq;
+            char* line = pipe_mode ? template.data : parallel_line(template.data, arg, seq);
+            int started = parallel_start(job, line, block_fd);
+            arena_release(&cmd_arena, mark);
+            if (block_fd >= 0) close(block_fd);
+            if (!started) {
+                failed++;
+                more = 0;
+                break;
+            }
+            seq++;
+            if (job->pidfd >= 0) {
+                run_count++;
+            } else if (!keep_order || job->seq == next_out) {
+                failed += parallel_emit(job);
+                next_out++;
+            } else {
+                held[held_count++] = *job;
+            }
+        }
+        if (run_count == 0 && held_count == 0) break;
+        
+        if (interrupted && !signalled) {
+            // The jobs share the terminal and got Ctrl+C too; make sure
+            // the ones that ignore it stop as well
+            for (int k = 0; k < run_count; k++) kill(running[k].pid, SIGTERM);
+            signalled = 1;
+        }
+        if (run_count > 0) {
+            for (int k = 0; k < run_count; k++) {
+                fds[k].fd = running[k].pidfd;
+                fds[k].events = POLLIN;
+                fds[k].revents = 0;
+            }
+            int want_input = more && !interrupted && input.args == NULL &&
+                             run_count < workers && run_count + held_count < budget;
+            fds[run_count].fd = want_input ? STDIN_FILENO : -1;
+            fds[run_count].events = POLLIN;
+            fds[run_count].revents = 0;
+            if (poll(fds, run_count + 1, -1) < 0 && errno != EINTR) {
+                fprintf(stderr, "myshell: parallel: %s\n", strerror(errno));
+                break;
+            }
+            input_ready = fds[run_count].revents != 0;
+        }
+        
+        for (int k = run_count - 1; k >= 0; k--) {
+            if (fds[k].revents == 0) continue;
+            ParallelJob job = running[k];
+            running[k] = running[--run_count];
+            while (waitpid(job.pid, &job.status, 0) < 0 && errno == EINTR);
+            close(job.pidfd);
+            job.pidfd = -1;
+            if (keep_order && job.seq != next_out) {
+                held[held_count++] = job;
+            } else {
+                failed += parallel_emit(&job);
+                next_out++;
+            }
+        }
+        
+        // Write the held outputs that are now next in order
+        for (int k = 0; k < held_count; k++) {
+            if (held[k].seq == next_out) {
+                failed += parallel_emit(&held[k]);
+                next_out++;
+                held[k] = held[--held_count];
+                k = -1;
+            }
+        }
+    }
+    
+    sigaction(SIGINT, &saved_sigint, NULL);
+    free(input.buf);
+    if (interrupted) {
+        last_status = 130;
+    } else {
+        last_status = failed > 101 ? 101 : failed;
+    }
+    return 1;
+}
+
+// Scripts
+
+// A script run with myshell -c, myshell FILE or from standard input. It is
+// parsed and run one complete command at a time, so a syntax error further
+// down does not stop the commands before it, and lines have no length limit.
+// A file is mapped and parsed in place. Standard input is read in blocks
+// when it can seek, and the read-ahead is given back before each command
+// runs, so a command reading stdin starts right after the script text it
+// belongs to; a pipe is read a line at a time for the same reason.
+#define SCRIPT_BLOCK_SIZE 8192
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;      // size of data when it is read from fd
+    size_t pos;      // start of the next command
+    int fd;          // descriptor the text still comes from, or -1
+    int seekable;
+    int eof;         // everything there is has been read
+    int mapped;      // data is a mapping of the whole file
+} Script;
+
+// Read more text, after dropping what was already run. Returns 0 at the end.
+int script_read_more(Script* s) {
+    if (s->fd < 0 || s->eof) return 0;
+    if (s->pos > 0) {
+        memmove(s->data, s->data + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+    }
+    
+    size_t got = 0;
+    while (1) {
+        if (s->len + SCRIPT_BLOCK_SIZE > s->cap) {
+            s->cap = s->cap ? s->cap * 2 : SCRIPT_BLOCK_SIZE * 2;
+            s->data = realloc(s->data, s->cap);
+            if (!s->data) {
+                fprintf(stderr, "myshell: allocation error\n");
+                exit(1);
+            }
+        }
+        ssize_t n = read(s->fd, s->data + s->len, s->seekable ? SCRIPT_BLOCK_SIZE : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            s->eof = 1;
+            break;
+        }
+        s->len += n;
+        got += n;
+        if (s->seekable || s->data[s->len - 1] == '\n') break;
+    }
+    return got > 0;
+}
+
+// Open a script file: mapped if it is a regular file, read as a stream if
+// it is something like a pipe (myshell <(cmd)). Returns -1 after reporting
+// an error.
+int script_open(Script* s, const char* path) {
+    memset(s, 0, sizeof(Script));
+    s->fd = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "myshell: %s: Is a directory\n", path);
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        s->fd = fd;
+        s->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+        return 0;
+    }
+    if (st.st_size > 0) {
+        s->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->data == MAP_FAILED) {
+            fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        s->len = st.st_size;
+        s->mapped = 1;
+        madvise(s->data, s->len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return 0;
+}
+
+void script_close(Script* s) {
+    if (s->mapped) {
+        munmap(s->data, s->len);
+    } else if (s->fd >= 0) {
+        free(s->data);
+        if (s->fd != STDIN_FILENO) close(s->fd);
+    }
+}
+
+// Run a script to its end, an exit, or a syntax error (status 2).
+// Returns 0 if the shell should exit.
+int script_run(Script* s) {
+    int result = 1;
+    while (result) {
+        interrupted = 0;
+        ArenaMark mark = arena_mark(&cmd_arena);
+        Parser parser;
+        int used = 0;
+        Node* line = parse_line(&parser, &cmd_arena, s->data + s->pos, s->len - s->pos, &used);
+        
+        // Text from a stream is only complete up to the last newline read
+        int partial = s->fd >= 0 && !s->eof &&
+                      (parser.status == PARSE_INCOMPLETE ||
+                       (parser.status == PARSE_OK && (used == 0 || s->data[s->pos + used - 1] != '\n')));
+        if (partial) {
+            arena_release(&cmd_arena, mark);
+            script_read_more(s);
+            continue;
+        }
+        if (parser.status != PARSE_OK) {
+            if (parser.status == PARSE_INCOMPLETE) {
+                fprintf(stderr, "myshell: syntax error: unexpected end of file\n");
+            }
+            arena_release(&cmd_arena, mark);
+            last_status = 2;
+            break;
+        }
+        
+        size_t end = s->pos + used;
+        if (s->fd >= 0 && s->seekable && end < s->len) {
+            lseek(s->fd, -(off_t)(s->len - end), SEEK_CUR);
+            s->len = end;
+        }
+        s->pos = end;
+        if (line->child_count > 0) {
+            result = execute_node(line);
+        } else if (s->pos == s->len && !script_read_more(s)) {
+            arena_release(&cmd_arena, mark);
+            break;
+        }
+        arena_release(&cmd_arena, mark);
+    }
+    fflush(stdout);
+    return result;
+}
+
+// Load and execute .myshellrc. It runs like a script: each command is parsed
+// into the command arena as it is reached, so commands can span lines and
+// lines have no length limit.
+void load_myshellrc() {
+    char* home = var_lookup("HOME");
+    if (!home) return;
+    
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/.myshellrc", home);
+    if (access(filepath, R_OK) < 0) return;
+    
+    Script script;
+    if (script_open(&script, filepath) < 0) return;
+    printf("Loading ~/.myshellrc...\n");
+    script_run(&script);
+    script_close(&script);
+    printf("Loaded %d aliases from ~/.myshellrc\n", alias_count);
+}
+
+// Find a program the way exec does: a name with a slash is used as it is,
+// anything else is looked for in $PATH. Returns NULL if there is none, and
+// otherwise fills st for the file found.
+char* command_path(const char* name, char* buf, size_t size, struct stat* st) {
+    if (strchr(name, '/')) return stat(name, st) == 0 ? (char*)name : NULL;
+    const char* path = var_lookup("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    while (1) {
+        const char* end = strchrnul(path, ':');
+        int dir_len = end - path;
+        if (snprintf(buf, size, "%.*s%s%s", dir_len, path, dir_len ? "/" : "", name) < (int)size &&
+            stat(buf, st) == 0 && S_ISREG(st->st_mode) && access(buf, X_OK) == 0) {
+            return buf;
+        }
+        if (*end == '\0') return NULL;
+        path = end + 1;
+    }
+}
+
+// What is_own_script found for a file, trusted while the file is unchanged.
+// Every command is checked, so this keeps a program from being opened and
+// read on each launch.
+#define SCRIPT_CHECK_SIZE 64
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;           // 0 for an empty slot
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    int own;
+} ScriptCheck;
+
+ScriptCheck script_checks[SCRIPT_CHECK_SIZE];
+
+int script_check_read(const char* path, int* stable);
+
+// Whether path, whose stat is st, is a script whose #! line runs this
+// shell's own binary, directly or through "#!/usr/bin/env myshell".
+// Interpreter options are left to a real exec.
+int is_own_script(const char* path, struct stat* st) {
+    if (!S_ISREG(st->st_mode)) return 0;
+    ScriptCheck* check = &script_checks[(st->st_ino ^ st->st_dev) % SCRIPT_CHECK_SIZE];
+    if (check->ino == st->st_ino && check->dev == st->st_dev && check->size == st->st_size &&
+        check->mtime.tv_sec == st->st_mtim.tv_sec && check->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+        check->ctime.tv_sec == st->st_ctim.tv_sec && check->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+        return check->own;
+    }
+    int stable = 1;
+    int own = script_check_read(path, &stable);
+    if (stable) {
+        *check = (ScriptCheck){st->st_dev, st->st_ino, st->st_size, st->st_mtim, st->st_ctim, own};
+    }
+    return own;
+}
+
+// Read the #! line of path for is_own_script. *stable is cleared when the
+// answer may change while the file does not: it could not be read, or env
+// looked the interpreter up in $PATH.
+int script_check_read(const char* path, int* stable) {
+    static int self_known = 0;
+    static struct stat self;
+    if (!self_known) self_known = stat("/proc/self/exe", &self) == 0 ? 1 : -1;
+    if (self_known < 0) return 0;
+
+    char line[256];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd < 0 ? -1 : read(fd, line, sizeof(line) - 1);
+    if (fd >= 0) close(fd);
+    if (n < 0) *stable = 0;
+    if (n < 2 || line[0] != '#' || line[1] != '!') return 0;
+    line[n] = '\0';
+    char* end = strchr(line, '\n');
+    if (end == NULL) return 0;
+    *end = '\0';
+
+    char* words[3];
+    int count = 0;
+    for (char* word = strtok(line + 2, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+        if (count == 3) return 0;
+        words[count++] = word;
+    }
+    char buf[PATH_MAX];
+    struct stat st;
+    if (count == 2 && strcmp(strrchr(words[0], '/') ? strrchr(words[0], '/') + 1 : words[0], "env") == 0) {
+        *stable = 0;
+        if (command_path(words[1], buf, sizeof(buf), &st) == NULL) return 0;
+    } else if (count != 1 || stat(words[0], &st) < 0) {
+        return 0;
+    }
+    return st.st_dev == self.st_dev && st.st_ino == self.st_ino;
+}
+
+// Run a myshell script in a forked copy of the shell instead of exec'ing a
+// new one. The copy already has everything built at startup and every cache
+// filled since, so it only has to forget what exec would have dropped:
+// variables that are not exported, functions, options, and the descriptors
+// marked close-on-exec. Does not return.
+void script_run_forked(const char* path, char** args) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            int fd = atoi(entry->d_name);
+            if (fd > STDERR_FILENO && fd != dirfd(dir) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+                close(fd);
+            }
+        }
+        closedir(dir);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The environment is the one exec would have passed
+    vars = NULL;
+    var_cap = var_used = var_depth = 0;
+    var_envp = NULL;
+    var_envp_cap = 0;
+    var_save_count = 0;
+    var_import_environ();
+    function_count = 0;
+    for (size_t i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++) {
+        *shell_options[i].flag = 0;
+    }
+    memset(builtin_disabled, 0, sizeof(builtin_disabled));
+    rematch_count = 0;
+    pipe_status_count = 0;
+    proc_subst_count = 0;
+    function_depth = source_depth = loop_depth = 0;
+    pending_break = pending_continue = pending_return = 0;
+    last_status = previous_status = 0;
+    last_background_pid = 0;
+
+    shell_pid = getpid();
+    shell_name = strdup(path);
+    positional = args + 1;
+    positional_count = 0;
+    while (positional[positional_count] != NULL) positional_count++;
+
+    Script script;
+    if (script_open(&script, path) < 0) _exit(exec_status(errno));
+    script_run(&script);
+    _exit(last_status);
+}
+
+// Sourced files. A file is parsed once and each of its commands compiled
+// into an arena of its own, so sourcing a helper library again just runs
+// the cached code. Entries are found by device and inode and trusted while
+// the size and modification and change times match. When those change the
+// text is read and hashed, and only text that really changed is parsed
+// again. A file changed within the last second could change again without
+// its timestamps moving, so it is hashed every time until it settles.
+// An interactive shell expands aliases and the arithmetic shortcut in sourced
+// files as it does at the prompt. That changes the code, so an entry also
+// records the alias generation it was compiled under and is compiled again
+// when the aliases have changed since.
+#define SOURCE_CACHE_SIZE 32
+
+typedef struct SourceScript {
+    Arena arena;         // owns the text, the trees and their bytecode
+    char* text;
+    size_t len;
+    uint64_t hash;
+    Node** lines;        // the commands, compiled
+    long* ends;          // where the text each command came from ends
+    int line_count;
+    int alias_gen;       // alias_generation compiled under, -1 for no aliases
+    long error_at;       // offset of a command that does not parse, or -1
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    int racy;            // timestamps too recent to trust
+    int refs;            // the cache and each running source
+    struct SourceScript* next;
+} SourceScript;
+
+SourceScript* source_cache = NULL;  // most recently used first
+int source_cache_count = 0;
+
+// FNV-1a
+uint64_t source_hash(const char* s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void source_release(SourceScript* s) {
+    if (--s->refs > 0) return;
+    arena_free(&s->arena);
+    free(s);
+}
+
+void source_set_stat(SourceScript* s, struct stat* st) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    s->dev = st->st_dev;
+    s->ino = st->st_ino;
+    s->size = st->st_size;
+    s->mtime = st->st_mtim;
+    s->ctime = st->st_ctim;
+    s->racy = st->st_ctim.tv_sec >= now.tv_sec - 1 || st->st_mtim.tv_sec >= now.tv_sec - 1;
+}
+
+// The alias generation sourced code is compiled under: none in scripts
+int source_alias_gen() {
+    return interactive ? alias_generation : -1;
+}
+
+void source_add_line(SourceScript* s, Node* line, long end, int* cap) {
+    if (line->child_count == 0) return;
+    line->code = compile_body(&s->arena, line);
+    if (s->line_count == *cap) {
+        *cap = *cap ? *cap * 2 : 16;
+        Node** lines = arena_alloc(&s->arena, *cap * sizeof(Node*));
+        long* ends = arena_alloc(&s->arena, *cap * sizeof(long));
+        if (s->line_count > 0) {
+            memcpy(lines, s->lines, s->line_count * sizeof(Node*));
+            memcpy(ends, s->ends, s->line_count * sizeof(long));
+        }
+        s->lines = lines;
+        s->ends = ends;
+    }
+    s->lines[s->line_count] = line;
+    s->ends[s->line_count++] = end;
+}
+
+// Replace the command text[pos..pos+len) by its expansion, as the prompt
+// would run it: a line that is an arithmetic expression becomes an echo of
+// its value, and aliases are expanded. Returns NULL if nothing changes;
+// otherwise the new text, which lives in the entry's arena.
+char* source_expand(SourceScript* s, long pos, long len, int arithmetic) {
+    ArenaMark mark = arena_mark(&cmd_arena);
+    char* command = arena_strndup(&cmd_arena, s->text + pos, len);
+    char* expanded = expand_aliases(command);
+    char* result = NULL;
+    if (arithmetic && is_arithmetic_expression(expanded)) {
+        double value = evaluate_expression(expanded);
+        char line[64];
+        if (value == (int)value) {
+            snprintf(line, sizeof(line), "echo %d", (int)value);
+        } else {
+            snprintf(line, sizeof(line), "echo %.2f", value);
+        }
+        result = arena_strdup(&s->arena, line);
+    } else if (!arithmetic && expanded != command) {
+        result = arena_strdup(&s->arena, expanded);
+    }
+    arena_release(&cmd_arena, mark);
+    return result;
+}
+
+// Parse and compile a copy of text from offset from on. Parsing stops at the
+// first command with a syntax error; it is parsed again to report it when
+// the run gets there.
+SourceScript* source_compile(const char* text, size_t len, uint64_t hash, size_t from) {
+    SourceScript* s = calloc(1, sizeof(SourceScript));
+    if (!s) {
+        fprintf(stderr, "myshell: allocation error\n");
+        exit(1);
+    }
+    s->text = arena_strndup(&s->arena, text, len);
+    s->len = len;
+    s->hash = hash;
+    s->error_at = -1;
+    s->alias_gen = source_alias_gen();
+
+    int cap = 0;
+    size_t pos = from;
+    parse_quiet = 1;
+    while (pos < len) {
+        Parser parser;
+        int used = 0;
+        char* expanded = NULL;
+        if (s->alias_gen >= 0) {
+            // The arithmetic shortcut takes a whole line, which need not parse
+            char* newline = memchr(s->text + pos, '\n', len - pos);
+            long line_len = newline ? newline - (s->text + pos) : (long)(len - pos);
+            expanded = source_expand(s, pos, line_len, 1);
+            if (expanded) used = line_len + (newline != NULL);
+        }
+        if (expanded == NULL) {
+            Node* line = parse_line(&parser, &s->arena, s->text + pos, len - pos, &used);
+            if (line == NULL) {
+                s->error_at = pos;
+                break;
+            }
+            if (s->alias_gen >= 0 && alias_count > 0) expanded = source_expand(s, pos, used, 0);
+            if (expanded == NULL) source_add_line(s, line, pos + used, &cap);
+        }
+        // The expansion of a command may hold several
+        for (int at = 0, n = expanded ? strlen(expanded) : 0, part = 0; at < n; at += part) {
+            Node* line = parse_line(&parser, &s->arena, expanded + at, n - at, &part);
+            if (line == NULL) {
+                s->error_at = pos;
+                break;
+            }
+            source_add_line(s, line, pos + used, &cap);
+            if (part == 0) break;
+        }
+        if (used == 0 || s->error_at >= 0) break;
+        pos += used;
+    }
+    parse_quiet = 0;
+    return s;
+}
+
+// The compiled form of an open file, with a reference for the caller.
+// Only regular files are kept in the cache.
+SourceScript* source_get(int fd, struct stat* st) {
+    int cacheable = S_ISREG(st->st_mode);
+    SourceScript* old = NULL;
+    SourceScript** link = &source_cache;
+    if (cacheable) {
+        for (; *link; link = &(*link)->next) {
+            if ((*link)->dev == st->st_dev && (*link)->ino == st->st_ino) {
+                old = *link;
+                *link = old->next;
+                source_cache_count--;
+                break;
+            }
+        }
+    }
+
+    SourceScript* s = old;
+    if (old == NULL || old->racy || old->alias_gen != source_alias_gen() || old->size != st->st_size ||
+        old->mtime.tv_sec != st->st_mtim.tv_sec || old->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+        old->ctime.tv_sec != st->st_ctim.tv_sec || old->ctime.tv_nsec != st->st_ctim.tv_nsec) {
+        ArenaMark mark = arena_mark(&cmd_arena);
+        ExpandBuf text = {arena_alloc(&cmd_arena, 64), 0, 64};
+        read_file_into(fd, &text);
+        uint64_t hash = source_hash(text.data, text.len);
+        if (old == NULL || old->hash != hash || old->len != (size_t)text.len ||
+            old->alias_gen != source_alias_gen()) {
+            s = source_compile(text.data, text.len, hash, 0);
+            s->refs = cacheable ? 1 : 0;
+            if (old) source_release(old);
+        }
+        arena_release(&cmd_arena, mark);
+        source_set_stat(s, st);
+    }
+
+    if (cacheable) {
+        s->next = source_cache;
+        source_cache = s;
+        if (++source_cache_count > SOURCE_CACHE_SIZE) {
+            SourceScript** last = &source_cache;
+            while ((*last)->next) last = &(*last)->next;
+            source_release(*last);
+            *last = NULL;
+            source_cache_count--;
+        }
+    }
+    s->refs++;
+    return s;
+}
+
+// Built-in: source [-q] file
+// Runs the commands of a file in the current shell. An interactive shell
+// reports the start and end on stdout unless -q is given; elsewhere the
+// output is left to the file's commands.
+int builtin_source(char** args) {
+    int quiet = !interactive;
+    int i = 1;
+    if (args[i] && strcmp(args[i], "-q") == 0) {
+        quiet = 1;
+        i++;
+    }
+    if (args[i] == NULL) {
+        fprintf(stderr, "myshell: source: missing filename\n");
+        fprintf(stderr, "Usage: source [-q] <file>\n");
+        last_status = 1;
+        return 1;
+    }
+
+    const char* path = args[i];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "myshell: source: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        last_status = 1;
+        return 1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "myshell: source: %s: Is a directory\n", path);
+        close(fd);
+        last_status = 1;
+        return 1;
+    }
+    SourceScript* s = source_get(fd, &st);
+    close(fd);
+
+    if (!quiet) printf("Sourcing %s...\n", path);
+    last_status = 0;
+    source_depth++;
+    int result = 1;
+    for (int k = 0; k < s->line_count && result && !pending_return && !interrupted; k++) {
+        ArenaMark mark = arena_mark(&cmd_arena);
+        result = vm_execute(s->lines[k]->code);
+        arena_release(&cmd_arena, mark);
+        // A command that defined an alias changes how the rest of the file
+        // reads: compile what follows its text again, outside the cache
+        long end = s->ends[k];
+        if (s->alias_gen != source_alias_gen() && end < (long)s->len &&
+            (k + 1 == s->line_count || s->ends[k + 1] != end)) {
+            SourceScript* rest = source_compile(s->text, s->len, s->hash, end);
+            rest->refs = 1;
+            source_release(s);
+            s = rest;
+            k = -1;
+        }
+    }
+
+    int failed = 0;
+    if (result && !pending_return && !interrupted && s->error_at >= 0) {
+        // Parse the bad command again, this time reporting the error
+        ArenaMark mark = arena_mark(&cmd_arena);
+        Parser parser;
+        int used = 0;
+        parse_line(&parser, &cmd_arena, s->text + s->error_at, s->len - s->error_at, &used);
+        if (parser.status == PARSE_INCOMPLETE) {
+            fprintf(stderr, "myshell: %s: syntax error: unexpected end of file\n", path);
+        }
+        arena_release(&cmd_arena, mark);
+        last_status = 2;
+        failed = 1;
+    }
+
+    // A return at the top level of the file ends the source
+    source_depth--;
+    pending_return = 0;
+    source_release(s);
+
+    if (!quiet) {
+        if (failed) {
+            printf("⚠️  Sourced %s up to a syntax error\n", path);
+        } else {
+            printf("✅ Successfully sourced %s\n", path);
+        }
+    }
+    return result;
+}
+
+// Tasks
+
+// A task file is a myshell script that declares tasks with task:
+//     task build -d gen -i main.c gen.h -o app -- cc -o app main.c
+// tasks sources it and runs the tasks asked for after the tasks they depend
+// on, as many at a time as there are cores, each in a forked copy of the
+// shell like the jobs of parallel. A task's key is a hash of its command,
+// the contents of its inputs and the keys of its dependencies. The keys of
+// the tasks that succeeded are kept in a state file next to the task file,
+// and a task whose key is unchanged and whose outputs exist is skipped.
+#define TASK_FILE "Taskfile"
+// Characters a command word can hold and still be shown without quotes
+#define TASK_PLAIN "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-+=.,/:@%"
+
+typedef struct {
+    char* name;
+    char** deps;
+    int dep_count;
+    char** inputs;
+    int input_count;
+    char** outputs;
+    int output_count;
+    char* command;   // NULL for a task that only groups others
+} Task;
+
+// Declarations live until the next run of tasks reads the file again
+Arena task_arena;
+Task* tasks = NULL;
+int task_count = 0;
+int task_cap = 0;
+
+int task_find(const char* name) {
+    for (int i = 0; i < task_count; i++) {
+        if (strcmp(tasks[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Built-in: task name [-d task...] [-i file...] [-o file...] [-- command...]
+int builtin_task(char** args) {
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+    if (argc < 2 || args[1][0] == '-') {
+        fprintf(stderr, "usage: task name [-d task...] [-i file...] [-o file...] [-- command...]\n");
+        last_status = 2;
+        return 1;
+    }
+    
+    Task task = {0};
+    task.name = arena_strdup(&task_arena, args[1]);
+    task.deps = arena_alloc(&task_arena, argc * sizeof(char*));
+    task.inputs = arena_alloc(&task_arena, argc * sizeof(char*));
+    task.outputs = arena_alloc(&task_arena, argc * sizeof(char*));
+    char** list = NULL;
+    int* count = NULL;
+    int i = 2;
+    for (; args[i] != NULL && strcmp(args[i], "--") != 0; i++) {
+        if (strcmp(args[i], "-d") == 0) {
+            list = task.deps;
+            count = &task.dep_count;
+        } else if (strcmp(args[i], "-i") == 0) {
+            list = task.inputs;
+            count = &task.input_count;
+        } else if (strcmp(args[i], "-o") == 0) {
+            list = task.outputs;
+            count = &task.output_count;
+        } else if (list == NULL) {
+            fprintf(stderr, "myshell: task: %s: expected -d, -i, -o or --\n", args[i]);
+            last_status = 2;
+            return 1;
+        } else {
+            list[(*count)++] = arena_strdup(&task_arena, args[i]);
+        }
+    }
+    
+    // The command is parsed again when the task runs. A single word is
+    // taken as shell code, so it can hold redirections and pipes; several
+    // words are one command's arguments and are quoted to stay as they are.
+    if (args[i] != NULL && args[i + 1] != NULL && args[i + 2] == NULL) {
+        task.command = arena_strdup(&task_arena, args[i + 1]);
+    } else if (args[i] != NULL && args[i + 1] != NULL) {
+        ArenaMark mark = arena_mark(&cmd_arena);
+        ExpandBuf command = {arena_alloc(&cmd_arena, 64), 0, 64};
+        for (int k = i + 1; args[k] != NULL; k++) {
+            if (k > i + 1) expand_append(&command, " ", 1);
+            size_t n = strlen(args[k]);
+            if (n > 0 && strspn(args[k], TASK_PLAIN) == n) {
+                expand_append(&command, args[k], n);
+            } else {
+                parallel_quote(&command, args[k], n);
+            }
+        }
+        task.command = arena_strndup(&task_arena, command.data, command.len);
+        arena_release(&cmd_arena, mark);
+    }
+    
+    int slot = task_find(task.name);
+    if (slot < 0) {
+        tasks = arena_grow(&task_arena, tasks, task_count, &task_cap, sizeof(Task));
+        slot = task_count++;
+    }
+    tasks[slot] = task;
+    last_status = 0;
+    return 1;
+}
+
+// What tasks knows about one task during a run
+typedef struct {
+    int* deps;       // indexes into tasks
+    int needed;      // asked for, directly or through a dependency
+    int visiting;    // on the current path of the dependency walk
+    int waiting;     // dependencies that have not finished
+    int started;
+    int ran;         // its command ran (or would, with -n)
+    int failed;
+    int has_old;     // old_key came from the state file
+    int has_key;     // key is valid and goes into the state file
+    uint64_t old_key;
+    uint64_t key;
+} TaskRun;
+
+// Mark task i and everything it depends on as needed. Returns 0 after
+// reporting an unknown task or a cycle.
+int task_select(TaskRun* runs, int i) {
+    if (runs[i].needed) return 1;
+    if (runs[i].visiting) {
+        fprintf(stderr, "myshell: tasks: %s is part of a dependency cycle\n", tasks[i].name);
+        return 0;
+    }
+    runs[i].visiting = 1;
+    runs[i].deps = arena_alloc(&cmd_arena, (tasks[i].dep_count + 1) * sizeof(int));
+    for (int d = 0; d < tasks[i].dep_count; d++) {
+        int dep = task_find(tasks[i].deps[d]);
+        if (dep < 0) {
+            fprintf(stderr, "myshell: tasks: %s: no task named %s\n", tasks[i].name, tasks[i].deps[d]);
+            return 0;
+        }
+        if (!task_select(runs, dep)) return 0;
+        runs[i].deps[d] = dep;
+    }
+    runs[i].visiting = 0;
+    runs[i].needed = 1;
+    runs[i].waiting = tasks[i].dep_count;
+    return 1;
+}
+
+// Hash the contents of a regular file. Returns 0 with errno set on failure.
+int task_hash_file(const char* path, uint64_t* hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return 0;
+    }
+    char* data = "";
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+    }
+    *hash = source_hash(data, st.st_size);
+    if (st.st_size > 0) munmap(data, st.st_size);
+    close(fd);
+    return 1;
+}
+
+// Compute the key of task i from its command, inputs and dependencies.
+// Returns 0 after reporting an input that cannot be read.
+int task_key(TaskRun* runs, int i) {
+    Task* task = &tasks[i];
+    ExpandBuf text = {arena_alloc(&cmd_arena, 256), 0, 256};
+    if (task->command) expand_append(&text, task->command, strlen(task->command) + 1);
+    for (int d = 0; d < task->dep_count; d++) {
+        expand_append(&text, (char*)&runs[runs[i].deps[d]].key, sizeof(uint64_t));
+    }
+    for (int k = 0; k < task->input_count; k++) {
+        uint64_t hash;
+        if (!task_hash_file(task->inputs[k], &hash)) {
+            fprintf(stderr, "myshell: tasks: %s: %s: %s\n", task->name, task->inputs[k], strerror(errno));
+            return 0;
+        }
+        expand_append(&text, task->inputs[k], strlen(task->inputs[k]) + 1);
+        expand_append(&text, (char*)&hash, sizeof(hash));
+    }
+    runs[i].key = source_hash(text.data, text.len);
+    return 1;
+}
+
+// Load the keys saved by the last run
+void task_load_state(const char* path, TaskRun* runs) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ExpandBuf text = {arena_alloc(&cmd_arena, 4096), 0, 4096};
+    read_file_into(fd, &text);
+    close(fd);
+    text.data[text.len] = '\0';
+    
+    char* line = text.data;
+    while (*line != '\0') {
+        char* end = strchr(line, '\n');
+        if (end == NULL) end = line + strlen(line);
+        char* name;
+        uint64_t key = strtoull(line, &name, 16);
+        if (*name == ' ') {
+            int i = task_find(arena_strndup(&cmd_arena, name + 1, end - name - 1));
+            if (i >= 0) {
+                runs[i].old_key = key;
+                runs[i].has_old = 1;
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+}
+
+// Write the keys of the tasks that are up to date, replacing the file at once
+void task_save_state(const char* path, TaskRun* runs) {
+    char* temp = arena_alloc(&cmd_arena, strlen(path) + 32);
+    sprintf(temp, "%s.%d", path, (int)getpid());
+    FILE* out = fopen(temp, "we");
+    if (out == NULL) {
+        fprintf(stderr, "myshell: tasks: %s: %s\n", temp, strerror(errno));
+        return;
+    }
+    for (int i = 0; i < task_count; i++) {
+        if (runs[i].has_key) {
+            fprintf(out, "%016llx %s\n", (unsigned long long)runs[i].key, tasks[i].name);
+        } else if (runs[i].has_old && !runs[i].failed) {
+            fprintf(out, "%016llx %s\n", (unsigned long long)runs[i].old_key, tasks[i].name);
+        }
+    }
+    if (fclose(out) != 0 || rename(temp, path) < 0) {
+        fprintf(stderr, "myshell: tasks: %s: %s\n", path, strerror(errno));
+        unlink(temp);
+    }
+}
+
+// Record that task i has finished and release the tasks waiting for it
+void task_finish(TaskRun* runs, int i, int ok) {
+    if (!ok) {
+        // What depends on it never becomes ready
+        runs[i].failed = 1;
+        return;
+    }
+    runs[i].has_key = 1;
+    for (int j = 0; j < task_count; j++) {
+        if (!runs[j].needed || runs[j].started) continue;
+        for (int d = 0; d < tasks[j].dep_count; d++) {
+            if (runs[j].deps[d] == i) runs[j].waiting--;
+        }
+    }
+}
+
+// Built-in: tasks [-f file] [-j N] [-n] [-B] [task...]
+int builtin_tasks(char** args) {
+    char* file = TASK_FILE;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long workers = cpus < 1 ? 1 : cpus;
+    int dry_run = 0;
+    int force = 0;
+    int i = 1;
+    
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-n") == 0) {
+            dry_run = 1;
+        } else if (strcmp(args[i], "-B") == 0) {
+            force = 1;
+        } else if (strcmp(args[i], "-f") == 0 && args[i + 1] != NULL) {
+            file = args[++i];
+        } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            char* end;
+            workers = strtol(args[++i], &end, 10);
+            if (*end != '\0' || workers < 1) {
+                fprintf(stderr, "myshell: tasks: -j needs a positive number\n");
+                last_status = 2;
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "usage: tasks [-f file] [-j N] [-n] [-B] [task...]\n");
+            last_status = 2;
+            return 1;
+        }
+    }
+    
+    // Read the declarations again; the file sees the shell's state
+    if (access(file, R_OK) < 0) {
+        fprintf(stderr, "myshell: tasks: %s: %s\n", file, strerror(errno));
+        last_status = 1;
+        return 1;
+    }
+    tasks = NULL;
+    task_count = 0;
+    task_cap = 0;
+    arena_reset(&task_arena);
+    char* source_args[] = {"source", "-q", file, NULL};
+    if (!builtin_source(source_args)) return 0;
+    if (interrupted) return 1;
+    
+    TaskRun* runs = arena_alloc(&cmd_arena, (task_count + 1) * sizeof(TaskRun));
+    memset(runs, 0, (task_count + 1) * sizeof(TaskRun));
+    // Without names, every task is run
+    for (int t = 0; args[i] == NULL && t < task_count; t++) {
+        if (!task_select(runs, t)) goto invalid;
+    }
+    for (int k = i; args[k] != NULL; k++) {
+        int t = task_find(args[k]);
+        if (t < 0) {
+            fprintf(stderr, "myshell: tasks: no task named %s\n", args[k]);
+            goto invalid;
+        }
+        if (!task_select(runs, t)) goto invalid;
+    }
+    
+    // The state file sits next to the task file: dir/.name.state
+    const char* slash = strrchr(file, '/');
+    int dir_len = slash ? slash - file + 1 : 0;
+    char* state = arena_alloc(&cmd_arena, strlen(file) + 16);
+    sprintf(state, "%.*s.%s.state", dir_len, file, file + dir_len);
+    task_load_state(state, runs);
+    
+    ParallelJob* running = arena_alloc(&cmd_arena, workers * sizeof(ParallelJob));
+    struct pollfd* fds = arena_alloc(&cmd_arena, workers * sizeof(struct pollfd));
+    int run_count = 0;
+    int ran = 0;
+    int failed = 0;
+    int signalled = 0;
+    
+    struct sigaction saved_sigint, sigint;
+    sigaction(SIGINT, NULL, &saved_sigint);
+    sigint = saved_sigint;
+    sigint.sa_flags &= ~SA_RESTART;
+    sigaction(SIGINT, &sigint, NULL);
+    
+    while (1) {
+        // Start every task whose dependencies are done, as slots allow. A
+        // task that is skipped can make others ready, so look again.
+        int progress = 1;
+        while (progress && !failed && !interrupted && run_count < workers) {
+            progress = 0;
+            for (int t = 0; t < task_count && !failed && run_count < workers; t++) {
+                TaskRun* run = &runs[t];
+                if (!run->needed || run->started || run->waiting > 0) continue;
+                run->started = 1;
+                progress = 1;
+                
+                int deps_ran = 0;
+                for (int d = 0; d < tasks[t].dep_count; d++) {
+                    deps_ran |= runs[run->deps[d]].ran;
+                }
+                // With -n a dependency that would run may change the inputs
+                if (dry_run && deps_ran) {
+                    run->ran = 1;
+                    if (tasks[t].command != NULL) {
+                        printf("[%s] %s\n", tasks[t].name, tasks[t].command);
+                        ran++;
+                    }
+                    task_finish(runs, t, 1);
+                    continue;
+                }
+                if (!task_key(runs, t)) {
+                    failed = 1;
+                    task_finish(runs, t, 0);
+                    break;
+                }
+                int current = !force && run->has_old && run->old_key == run->key;
+                for (int k = 0; current && k < tasks[t].output_count; k++) {
+                    current = access(tasks[t].outputs[k], F_OK) == 0;
+                }
+                if (current || tasks[t].command == NULL) {
+                    task_finish(runs, t, 1);
+                    continue;
+                }
+                
+                run->ran = 1;
+                ran++;
+                if (dry_run) {
+                    printf("[%s] %s\n", tasks[t].name, tasks[t].command);
+                    task_finish(runs, t, 1);
+                    continue;
+                }
+                ParallelJob* job = &running[run_count];
+                job->seq = t;
+                if (!parallel_start(job, tasks[t].command, -1)) {
+                    failed = 1;
+                    task_finish(runs, t, 0);
+                    break;
+                }
+                if (job->pidfd >= 0) {
+                    run_count++;
+                } else {
+                    printf("[%s] %s\n", tasks[t].name, tasks[t].command);
+                    int ok = !parallel_emit(job);
+                    if (!ok) {
+                        fprintf(stderr, "myshell: tasks: %s failed with status %d\n",
+                                tasks[t].name, status_from_wait(job->status));
+                        failed = 1;
+                    }
+                    task_finish(runs, t, ok);
+                }
+            }
+        }
+        if (run_count <= 0) break;
+        
+        if (interrupted && !signalled) {
+            for (int k = 0; k < run_count; k++) kill(running[k].pid, SIGTERM);
+            signalled = 1;
+        }
+        for (int k = 0; k < run_count; k++) {
+            fds[k].fd = running[k].pidfd;
+            fds[k].events = POLLIN;
+            fds[k].revents = 0;
+        }
+        if (poll(fds, run_count, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "myshell: tasks: %s\n", strerror(errno));
+            break;
+        }
+        for (int k = run_count - 1; k >= 0; k--) {
+            if (fds[k].revents == 0) continue;
+            ParallelJob job = running[k];
+            running[k] = running[--run_count];
+            while (waitpid(job.pid, &job.status, 0) < 0 && errno == EINTR);
+            close(job.pidfd);
+            // The output of each task comes out in one piece under its name
+            printf("[%s] %s\n", tasks[job.seq].name, tasks[job.seq].command);
+            int ok = !parallel_emit(&job);
+            if (!ok) {
+                fprintf(stderr, "myshell: tasks: %s failed with status %d\n",
+                        tasks[job.seq].name, status_from_wait(job.status));
+                failed = 1;
+            }
+            task_finish(runs, job.seq, ok);
+        }
+    }
+    
+    sigaction(SIGINT, &saved_sigint, NULL);
+    if (!dry_run) task_save_state(state, runs);
+    if (ran == 0 && !failed && !interrupted) printf("tasks: everything is up to date\n");
+    last_status = interrupted ? 130 : failed;
+    return 1;
+    
+invalid:
+    last_status = 2;
+    return 1;
+}
+
+// Main shell loop
+void shell_loop() {
     char* input;
-    char** args;
     int status;
     
     do {
+        interrupted = 0;
+        notify_jobs();
         display_prompt();
         input = read_input_with_completion();
         
+        // Keep reading while the command is unfinished (open quote, trailing | or &&)
+        while (parse_needs_more(input)) {
+            printf("> ");
+            fflush(stdout);
+            char* more = read_input_with_completion();
+            char* joined = malloc(strlen(input) + strlen(more) + 2);
+            sprintf(joined, "%s\n%s", input, more);
+            free(input);
+            free(more);
+            input = joined;
+        }
+        
         // Expand aliases
         char* expanded = expand_aliases(input);
         
@@ -1932,18 +11452,83 @@ void shell_loop() {
             }
             status = 1;
         } else {
-            args = parse_input(strdup(expanded));
-            status = execute_command(args);
-            free(args);
+            status = run_command_line(expanded);
         }
         
         free(input);
+        arena_reset(&cmd_arena);
     } while (status);
 }
 
+void usage_error(const char* message) {
+    fprintf(stderr, "myshell: %s\n", message);
+    fprintf(stderr, "Usage: myshell [-c command [name [arg...]] | file [arg...]]\n");
+    exit(2);
+}
+
 int main(int argc, char** argv) {
-    // Ignore Ctrl+C in parent
-    signal(SIGINT, SIG_IGN);
+    // myshell -c command [name [arg...]], myshell file [arg...], or with no
+    // arguments commands from standard input: interactive on a terminal,
+    // a script otherwise
+    shell_pid = getpid();
+    Script script;
+    int interactive_mode = 0;
+    int first_arg = argc;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) usage_error("-c: option requires an argument");
+        memset(&script, 0, sizeof(Script));
+        script.data = argv[2];
+        script.len = strlen(argv[2]);
+        script.fd = -1;
+        if (argc > 3) shell_name = argv[3];
+        first_arg = 4;
+    } else if (argc > 1 && argv[1][0] == '-' && strcmp(argv[1], "-") != 0) {
+        char message[256];
+        snprintf(message, sizeof(message), "%s: invalid option", argv[1]);
+        usage_error(message);
+    } else if (argc > 1) {
+        shell_name = argv[1];
+        first_arg = 2;
+        if (strcmp(argv[1], "-") == 0) {
+            memset(&script, 0, sizeof(Script));
+            script.fd = STDIN_FILENO;
+        } else if (script_open(&script, argv[1]) < 0) {
+            return exec_status(errno);
+        }
+    } else if (isatty(STDIN_FILENO)) {
+        interactive_mode = 1;
+    } else {
+        memset(&script, 0, sizeof(Script));
+        script.fd = STDIN_FILENO;
+    }
+    if (script.fd == STDIN_FILENO && !interactive_mode) {
+        script.seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    }
+    if (first_arg < argc) {
+        positional = argv + first_arg;
+        positional_count = argc - first_arg;
+    }
+    
+    var_import_environ();
+    
+    // Own the terminal; Ctrl+C and Ctrl+Z go to the foreground job
+    init_job_control(interactive_mode);
+    
+    // Builtins write to pipes from inside the shell; a closed reader must
+    // make the write fail, not kill the shell
+    signal(SIGPIPE, SIG_IGN);
+    
+    char* force_fork = var_lookup("MYSHELL_FORCE_FORK");
+    if (force_fork && strcmp(force_fork, "1") == 0) {
+        use_posix_spawn = 0;
+    }
+    
+    // Scripts skip everything meant for a person at a terminal
+    if (!interactive_mode) {
+        script_run(&script);
+        script_close(&script);
+        return last_status;
+    }
     
     // Load command history
     load_history_from_file();
@@ -1961,10 +11546,13 @@ int main(int argc, char** argv) {
     load_myshellrc();
     printf("\n");
     
+    // Attach to the shared history ring if enabled in the environment or rc
+    shared_history_init();
+    
     shell_loop();
     
     // Save history before exit
     save_history_to_file();
     
-    return 0;
+    return last_status;
 }
\ No newline at end of file